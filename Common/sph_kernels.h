@@ -0,0 +1,155 @@
+#ifndef SPH_KERNELS_H
+#define SPH_KERNELS_H
+
+// Smoothing kernels and equations of state shared by the SPH cores.
+//
+// All kernels have support q = r / h < 2, so they fit the existing cell
+// grids: W(r, h) = sigma_d / h^d * w(q) and dW/dr = sigma_d / h^(d+1) * w'(q).
+// The normalisation sigma_d is a literal per dimension picked at compile
+// time, powers are unrolled products; a pair costs no transcendental call.
+// Plain templates, no constexpr, so the VS2008 Peristalsis build keeps going.
+//
+//   typedef sph::WendlandC2<2> Kernel;
+//   float w  = Kernel::value(dist, h);      // coefficient(h) * shape(q)
+//   float dw = Kernel::derivative(dist, h); // gradientCoefficient(h) * shapeDerivative(q)
+// In neighbour loops with a fixed h the coefficients go out of the loop.
+
+#ifdef __CUDACC__
+#define SPH_HD __host__ __device__
+#else
+#define SPH_HD
+#endif
+
+namespace sph {
+
+// x^N by squaring, unrolled at compile time
+template <int N> struct Pow {
+	template <typename T> static SPH_HD inline T eval(T x){
+		T half = Pow<N / 2>::eval(x * x);
+		return (N & 1) ? half * x : half;
+	}
+};
+template <> struct Pow<0> {
+	template <typename T> static SPH_HD inline T eval(T){ return T(1); }
+};
+template <int N, typename T> SPH_HD inline T ipow(T x){ return Pow<N>::eval(x); }
+
+#define SPH_PI 3.14159265358979323846
+
+// Common interface on top of the shape w(q), its derivative w'(q) and sigma_d.
+template <typename Shape, int Dim> struct Kernel {
+	template <typename T> static SPH_HD inline T coefficient(T h){
+		return T(Shape::sigma(Dim)) / ipow<Dim>(h);
+	}
+	template <typename T> static SPH_HD inline T gradientCoefficient(T h){
+		return T(Shape::sigma(Dim)) / ipow<Dim + 1>(h);
+	}
+	template <typename T> static SPH_HD inline T shape(T q){ return Shape::shape(q); }
+	template <typename T> static SPH_HD inline T shapeDerivative(T q){ return Shape::shapeDerivative(q); }
+	template <typename T> static SPH_HD inline T value(T r, T h){
+		T q = r / h;
+		return (q < T(2)) ? coefficient(h) * Shape::shape(q) : T(0);
+	}
+	// dW/dr, negative inside the support
+	template <typename T> static SPH_HD inline T derivative(T r, T h){
+		T q = r / h;
+		return (q < T(2)) ? gradientCoefficient(h) * Shape::shapeDerivative(q) : T(0);
+	}
+};
+
+// Wendland C2, (1 - q/2)^4 (2q + 1); 2D and 3D
+struct WendlandC2Shape {
+	static SPH_HD inline double sigma(int dim){
+		return (dim == 2) ? 7.0 / (4 * SPH_PI) : 21.0 / (16 * SPH_PI);
+	}
+	template <typename T> static SPH_HD inline T shape(T q){
+		T w = T(1) - T(0.5) * q;
+		return ipow<4>(w) * (T(2) * q + T(1));
+	}
+	template <typename T> static SPH_HD inline T shapeDerivative(T q){
+		T w = T(1) - T(0.5) * q;
+		return T(-5) * q * ipow<3>(w);
+	}
+};
+
+// Wendland C4, (1 - q/2)^6 (35/12 q^2 + 3q + 1); 2D and 3D
+struct WendlandC4Shape {
+	static SPH_HD inline double sigma(int dim){
+		return (dim == 2) ? 9.0 / (4 * SPH_PI) : 495.0 / (256 * SPH_PI);
+	}
+	template <typename T> static SPH_HD inline T shape(T q){
+		T w = T(1) - T(0.5) * q;
+		return ipow<6>(w) * ((T(35) / T(12) * q + T(3)) * q + T(1));
+	}
+	template <typename T> static SPH_HD inline T shapeDerivative(T q){
+		T w = T(1) - T(0.5) * q;
+		return T(-14) / T(3) * q * (T(1) + T(2.5) * q) * ipow<5>(w);
+	}
+};
+
+// M4 cubic spline
+struct CubicSplineShape {
+	static SPH_HD inline double sigma(int dim){
+		return (dim == 1) ? 2.0 / 3 : (dim == 2) ? 10.0 / (7 * SPH_PI) : 1.0 / SPH_PI;
+	}
+	template <typename T> static SPH_HD inline T shape(T q){
+		if (q < T(1))
+			return T(1) - T(1.5) * q * q + T(0.75) * q * q * q;
+		return T(0.25) * ipow<3>(T(2) - q);
+	}
+	template <typename T> static SPH_HD inline T shapeDerivative(T q){
+		if (q < T(1))
+			return q * (T(-3) + T(2.25) * q);
+		return T(-0.75) * ipow<2>(T(2) - q);
+	}
+};
+
+// M6 quintic spline, support 3h' stretched to 2h (s = 1.5 q, h' = 2h/3)
+struct QuinticSplineShape {
+	static SPH_HD inline double sigma(int dim){
+		return (dim == 1) ? 1.0 / 80 : (dim == 2) ? 63.0 / (1912 * SPH_PI) : 9.0 / (320 * SPH_PI);
+	}
+	template <typename T> static SPH_HD inline T shape(T q){
+		T s = T(1.5) * q;
+		T w = ipow<5>(T(3) - s);
+		if (s < T(2))
+			w -= T(6) * ipow<5>(T(2) - s);
+		if (s < T(1))
+			w += T(15) * ipow<5>(T(1) - s);
+		return w;
+	}
+	template <typename T> static SPH_HD inline T shapeDerivative(T q){
+		T s = T(1.5) * q;
+		T dw = ipow<4>(T(3) - s);
+		if (s < T(2))
+			dw -= T(6) * ipow<4>(T(2) - s);
+		if (s < T(1))
+			dw += T(15) * ipow<4>(T(1) - s);
+		return T(-7.5) * dw;
+	}
+};
+
+template <int Dim> struct WendlandC2 : Kernel<WendlandC2Shape, Dim> {};
+template <int Dim> struct WendlandC4 : Kernel<WendlandC4Shape, Dim> {};
+template <int Dim> struct CubicSpline : Kernel<CubicSplineShape, Dim> {};
+template <int Dim> struct QuinticSpline : Kernel<QuinticSplineShape, Dim> {};
+
+// Tait equation, p = B ((rho / rho0)^Gamma - 1), integer exponent unrolled
+template <int Gamma> struct Tait {
+	enum { gamma = Gamma };
+	template <typename T> static SPH_HD inline T pressure(T density, T restDensity, T B){
+		return B * (ipow<Gamma>(density / restDensity) - T(1));
+	}
+};
+
+// linear equation p = K rho; K is the stiffness chosen by the caller, c^2 for
+// an isothermal gas of sound speed c
+struct Isothermal {
+	template <typename T> static SPH_HD inline T pressure(T density, T K){
+		return K * density;
+	}
+};
+
+} // namespace sph
+
+#endif
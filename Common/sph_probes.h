@@ -0,0 +1,117 @@
+#ifndef SPH_PROBES_H
+#define SPH_PROBES_H
+
+// Field sampling at probe points on the neighbour grid of the cores.
+//
+// A probe walks the cells around it like the density pass does and takes
+// Shepard normalised SPH averages over the fluid particles
+//   f(x) = sum_j V_j f_j W(x - x_j, h) / sum_j V_j W(x - x_j, h),  V_j = m / rho_j,
+// one thread per probe, so the cost follows the number of probes, not N.
+// The denominator comes back as coverage in velocity.w: about 1 inside the
+// fluid, falling to 0 at walls and free surfaces. Only the fluid cell range
+// is read; walls are sorted after it, at hash + numGridCells.
+//
+// A core passes a grid with
+//   __device__ int3 gridPos(float3 p) const;  // its calcGridPos
+//   __device__ uint hash(int3 gridPos) const; // its calcGridHash
+//   __device__ bool inside(int3 gridPos) const;
+// and the sorted arrays of the last step. Probes are float4, w unused.
+
+#include "vector_types.h"
+#include "vector_functions.h"
+
+typedef unsigned int uint;
+
+namespace sph {
+
+#ifdef __CUDACC__
+template <typename Kernel, typename Grid>
+__global__ void sampleProbesD(
+	float4*       velocity,       // output, coverage in w
+	float4*       measures,       // output, density and pressure in x, y
+	const float4* probes,         // input
+	uint          numProbes,
+	const float4* sortedPos,      // input, sorted positions
+	const float4* sortedVel,      // input, sorted velocities
+	const float4* sortedMeasures, // input, sorted density and pressure
+	const uint*   cellStart,      // input
+	const uint*   cellEnd,        // input
+	Grid          grid,
+	int           cellcount,
+	float         h,
+	float         mass){
+		uint index = blockIdx.x * blockDim.x + threadIdx.x;
+		if (index >= numProbes) return;
+
+		float4 p = probes[index];
+		int3 gridPos = grid.gridPos(make_float3(p.x, p.y, p.z));
+		float4 v = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+		float4 m = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+		if (grid.inside(gridPos)) {
+			float coefficient = Kernel::coefficient(h);
+			float support2 = 4.0f * h * h;
+			for(int z = -cellcount; z <= cellcount; z++)
+				for(int y = -cellcount; y <= cellcount; y++)
+					for(int x = -cellcount; x <= cellcount; x++){
+						uint hash = grid.hash(make_int3(gridPos.x + x, gridPos.y + y, gridPos.z + z));
+						uint start = cellStart[hash];
+						if (start == 0xffffffff)
+							continue;
+						uint end = cellEnd[hash];
+						for(uint j = start; j < end; j++){
+							float4 pj = sortedPos[j];
+							float dx = p.x - pj.x, dy = p.y - pj.y, dz = p.z - pj.z;
+							float dist2 = dx * dx + dy * dy + dz * dz;
+							float4 mj = sortedMeasures[j];
+							if (dist2 >= support2 || mj.x <= 0.0f)
+								continue;
+							float w = mass / mj.x * coefficient * Kernel::shape(sqrtf(dist2) / h);
+							float4 vj = sortedVel[j];
+							v.x += w * vj.x;
+							v.y += w * vj.y;
+							v.z += w * vj.z;
+							v.w += w;
+							m.x += w * mj.x;
+							m.y += w * mj.y;
+						}
+					}
+		}
+		if (v.w > 0.0f) {
+			v.x /= v.w;
+			v.y /= v.w;
+			v.z /= v.w;
+			m.x /= v.w;
+			m.y /= v.w;
+		}
+		velocity[index] = v;
+		measures[index] = m;
+}
+#endif
+
+// count probes from a to b, both ends included
+inline void lineProbes(float4* probes, float3 a, float3 b, uint count){
+	for(uint i = 0; i < count; i++){
+		float t = (count > 1) ? (float)i / (count - 1) : 0.0f;
+		probes[i] = make_float4(
+			a.x + t * (b.x - a.x),
+			a.y + t * (b.y - a.y),
+			a.z + t * (b.z - a.z),
+			0.0f);
+	}
+}
+
+// regular Eulerian grid, x fastest: probe (i, j, k) at origin + (i, j, k) * spacing
+inline void gridProbes(float4* probes, float3 origin, float3 spacing, uint3 size){
+	for(uint k = 0; k < size.z; k++)
+		for(uint j = 0; j < size.y; j++)
+			for(uint i = 0; i < size.x; i++)
+				probes[(k * size.y + j) * size.x + i] = make_float4(
+					origin.x + i * spacing.x,
+					origin.y + j * spacing.y,
+					origin.z + k * spacing.z,
+					0.0f);
+}
+
+} // namespace sph
+
+#endif
@@ -3,42 +3,148 @@
 #include "fluid_kernel.cuh"
 #include <cuda_runtime.h>
 #include "../Common/helper_cuda.h"
+#include "../Common/helper_timer.h"
 #include <assert.h>
 #include <math.h>
 #include <memory.h>
 #include <cstdio>
 #include <cstdlib>
 #include <algorithm>
+#include <cfloat>
 #include <GL/glew.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #ifndef CUDART_PI_F
 #define CUDART_PI_F         3.141592654f
 #endif
+
+// hydrostatic relaxation: velocity damping per step, step limit, and the
+// residual speed (fraction of sqrt(g * H)) at which the column counts as settled
+const float HydrostaticDamping = 0.98f;
+const uint HydrostaticMinSteps = 200;
+const uint HydrostaticMaxSteps = 2000;
+const uint HydrostaticCheckInterval = 50;
+const float HydrostaticTolerance = 0.005f;
+
+// implicit solver: Jacobi relaxation, mean compression tolerance, iteration
+// bounds, Courant number on the particle spacing and the time step cap
+const float IisphOmega = 0.5f;
+const float IisphTolerance = 0.001f;
+const uint IisphMinIterations = 2;
+const uint IisphMaxIterations = 100;
+const float IisphCourant = 0.4f;
+const float IisphMaxDeltaTime = 5e-3f;
+
+// adaptive refinement: steps between split/merge passes, spare slots as a
+// fraction of the column (three per split), and coarse kernel sum ratios
+// to rest density below which particles split and above which they merge
+const uint RefinementInterval = 10;
+const float RefinementReserve = 0.25f;
+const float RefinementSplitRatio = 0.95f;
+const float RefinementMergeRatio = 0.99f;
+
+// bucket grid: slots per cell before the first overflow
+const uint BucketInitialCapacity = 8;
+
+// mapped state: default particles per streamed chunk, 1 MB of float4
+const uint StateChunkParticles = 1 << 16;
+const char* StateFileSuffixes[5] = {".pos", ".vel", ".measures", ".acc", ".velLeapFrog"};
+
+// small checkpoint file next to the mapped arrays
+struct StateHeader {
+	double elapsedTime;
+	uint stepCount;
+	uint numActiveFluidParticles;
+	uint gateRemoved;
+	float rightBoundary;
+	float gateShift;
+};
+
 DamBreakSystem::DamBreakSystem(
 	uint3 fluidParticlesSize,
 	int boundaryOffset,
 	uint3 gridSize,
 	float particleRadius,
-	bool bUseOpenGL) :
+	bool bUseOpenGL,
+	BoundaryModel boundaryModel) :
 	IsInitialized(false),
 	IsOpenGL(bUseOpenGL),    
+	IsPersistentOrdering(false),
+	IsOrdered(false),
+	IsCompactNeighbourData(false),
+	IsHydrostaticInit(false),
+	IsSubdomain(false),
+	IsDeterministic(false),
+	IsPairCache(false),
+	IsBucketGrid(false),
+	IsNeighbourTiming(false),
+	IsPairCounting(false),
+	IsMappedState(false),
+	stateChunkParticles(StateChunkParticles),
+	subdomainMin(-FLT_MAX),
+	subdomainMax(FLT_MAX),
 	fluidParticlesSize(fluidParticlesSize),
+	elapsedTime(0.0f),
+	stepCount(0),
+	solver(WeaklyCompressible),
+	solverIterations(0),
+	totalSolverIterations(0),
+	densityError(0.0f),
+	pairEvaluations(0.0),
+	fullPairEvaluations(0.0),
+	phaseTimer(0),
 	hPos(0),
 	hVel(0),
 	hMeasures(0),	
 	dPos(0),
 	dVel(0),
-	dMeasures(0),		
-	dVariations(0),	
-	elapsedTime(0.0f){
-		numParticles = fluidParticlesSize.x * fluidParticlesSize.y * fluidParticlesSize.z + 
-		+ gridSize.x * boundaryOffset
-		+ 2 * (gridSize.y - boundaryOffset) * boundaryOffset
-		;
+	dVariations(0),
+	dMeasures(0),
+	dMoved(0),
+	dHashScratch(0),
+	dIndexScratch(0),
+	dPermuteScratch(0),
+	dIisphVelAdv(0),
+	dIisphPressureAcc(0),
+	dIisphError(0),
+	dSumScratch(0),
+	dLevel(0),
+	dBlockMeasures(0),
+	dPairCount(0),
+	dPairCache(0),
+	dPairIndex(0),
+	dPairData(0),
+	bucketCapacity(BucketInitialCapacity),
+	dBucketCount(0),
+	dBucketSlots(0),
+	dBucketOverflow(0),
+	dChildren(0),
+	dRefineFlags(0),
+	dSplitRank(0),
+	dFreeSlots(0),
+	dExchange(0),
+	dTankField(0),
+	dGateField(0),
+	dCompactPos(0),
+	dCompactVel(0),
+	dCompactMeasures(0){
+		setNeighbourTiming(false);
+		numFluidParticles = fluidParticlesSize.x * fluidParticlesSize.y * fluidParticlesSize.z;
+		numActiveFluidParticles = numFluidParticles;
+		numWallParticles = gridSize.x * boundaryOffset
+			+ 2 * (gridSize.y - boundaryOffset) * boundaryOffset;
+		numParticles = numFluidParticles;
+		if (boundaryModel == ParticleWalls)
+			numParticles += numWallParticles;
 		numGridCells = gridSize.x * gridSize.y * gridSize.z;
 		gridSortBits = 18;	//see radix sort for details
 		params.fluidParticlesSize = fluidParticlesSize;
 		params.gridSize = gridSize;		
+		params.numGridCells = numGridCells;
 		params.boundaryOffset = boundaryOffset;
 	    			
 		params.particleRadius = particleRadius;//1.0f / 64;		
@@ -63,20 +169,35 @@ DamBreakSystem::DamBreakSystem(
 		
 
 		params.gravity = make_float3(0.0f, -9.8f, 0.0f);    	  		
-		params.gamma = 7;
+		params.gamma = DamBreakEos::gamma;
 		params.B = 200 * params.restDensity * abs(params.gravity.y) *		
 			(2 * params.particleRadius * fluidParticlesSize.y ) / params.gamma;		
 
 		params.D = 10 * params.gravity.y * 2 * params.particleRadius * fluidParticlesSize.y;
 		params.a = 1 * params.particleRadius;
+		params.boundarySubsteps = 1;
+		params.blockLevels = 0;
+		params.adaptiveRefinement = 0;
 
 		params.soundspeed = sqrt(params.B * params.gamma / params.restDensity);
+		//front speed of the collapse, replaces soundspeed in artificial viscosity of the implicit solver
+		params.viscositySpeed = sqrt(2 * abs(params.gravity.y) * 2 * params.particleRadius * fluidParticlesSize.y);
+		params.iisphOmega = IisphOmega;
 
 		params.deltaTime = pow(10.0f, -4.0f);
+
+		params.boundaryModel = boundaryModel;
+		params.tankField = 0;
+		params.gateField = 0;
+		params.fieldSpacing = params.particleRadius;
+		params.fieldSize = make_uint2(2 * gridSize.x + 1, 2 * gridSize.y + 1);
+		params.gateShift = 0.0f;
 		_initialize(numParticles);
 }
 
 DamBreakSystem::~DamBreakSystem(){
+	if (phaseTimer)
+		sdkDeleteTimer(&phaseTimer);
 	_finalize();
 	numParticles = 0;
 }
@@ -118,19 +239,14 @@ void DamBreakSystem::_initialize(int numParticles){
 
 	numParticles = numParticles;
 
-	hPos = new float[numParticles*4];
-	hVel = new float[numParticles*4];
-	hVelLeapFrog = new float[numParticles*4];		
-	hMeasures = new float[numParticles*4];
-	hAcceleration = new float[numParticles*4];
-	memset(hPos, 0, numParticles*4*sizeof(float));
-	memset(hVel, 0, numParticles*4*sizeof(float));
-	memset(hVelLeapFrog, 0, numParticles*4*sizeof(float));
-	memset(hAcceleration, 0, numParticles*4*sizeof(float));	
-	memset(hMeasures, 0, numParticles*4*sizeof(float)); 
-
-	for(uint i = 0; i < numParticles; i++)
-		hMeasures[4*i+0] = params.restDensity;
+	hPos = allocateHostArray(POSITION);
+	hVel = allocateHostArray(VELOCITY);
+	hVelLeapFrog = allocateHostArray(VELOCITYLEAPFROG);
+	hMeasures = allocateHostArray(MEASURES);
+	hAcceleration = allocateHostArray(ACCELERATION);
+	//mapped files keep what they hold until reset() or restoreState()
+	if (!IsMappedState)
+		clearHostState();
 	
 
 	unsigned int memSize = sizeof(float) * 4 * numParticles;
@@ -154,8 +270,30 @@ void DamBreakSystem::_initialize(int numParticles){
 	allocateArray((void**)&dHash, numParticles*sizeof(uint));
 	allocateArray((void**)&dIndex, numParticles*sizeof(uint));
 
-	allocateArray((void**)&dCellStart, numGridCells*sizeof(uint));
-	allocateArray((void**)&dCellEnd, numGridCells*sizeof(uint));
+	//one more cell for the key of free refinement slots
+	allocateArray((void**)&dCellStart, (2*numGridCells+1)*sizeof(uint));
+	allocateArray((void**)&dCellEnd, (2*numGridCells+1)*sizeof(uint));
+
+	//buffers of the optional modes exist only while their mode is on
+	if (IsPersistentOrdering)
+		allocateOrderingBuffers();
+	if (IsCompactNeighbourData)
+		allocateCompactData();
+	if (solver == ImplicitIncompressible)
+		allocateImplicitSolver();
+	if (params.blockLevels > 0)
+		allocateBlockSteps();
+	if (params.adaptiveRefinement)
+		allocateRefinement();
+	//free slots of refinement or imported particles, past the column
+	if (numFluidParticles > fluidParticlesSize.x * fluidParticlesSize.y * fluidParticlesSize.z)
+		allocateArray((void**)&dFreeSlots, numParticles*sizeof(uint));
+	if (IsSubdomain)
+		allocateExchange();
+	if (IsPairCache)
+		allocatePairCache();
+	if (IsBucketGrid)
+		allocateBucketGrid();
 
 	if (IsOpenGL) {
 		colorVBO = createVBO(numParticles*4*sizeof(float));
@@ -183,19 +321,49 @@ void DamBreakSystem::_initialize(int numParticles){
         checkCudaErrors( cudaMalloc( (void **)&cudaColorVBO, sizeof(float)*numParticles*4) );
 	}	   
 
+	if (params.boundaryModel == DistanceFieldWalls) {
+		assert(params.boundaryOffset > 0);
+		uint fieldMemSize = params.fieldSize.x * params.fieldSize.y * 4 * sizeof(float);
+		allocateArray((void**)&dTankField, fieldMemSize);
+		allocateArray((void**)&dGateField, fieldMemSize);
+		params.tankField = (float4*)dTankField;
+		params.gateField = (float4*)dGateField;
+	}
+
 	setParameters(&params);
 
+	if (params.boundaryModel == DistanceFieldWalls)
+		buildWallFields(params.particleRadius * 2.0f);
+
 	IsInitialized = true;
 }
 
+void DamBreakSystem::buildWallFields(float spacing){
+	float* hWall = new float[numWallParticles*4];
+	memset(hWall, 0, numWallParticles*4*sizeof(float));
+	initBoundaryParticles(spacing, hWall, 0);
+
+	float* dWall;
+	allocateArray((void**)&dWall, numWallParticles*4*sizeof(float));
+	copyArrayToDevice(dWall, hWall, 0, numWallParticles*4*sizeof(float));
+
+	uint numFieldNodes = params.fieldSize.x * params.fieldSize.y;
+	float gateWall = params.rightBoundary + params.particleRadius;
+	buildWallField(dTankField, dWall, numWallParticles, numFieldNodes, gateWall, false);
+	buildWallField(dGateField, dWall, numWallParticles, numFieldNodes, gateWall, true);
+
+	freeArray(dWall);
+	delete [] hWall;
+}
+
 void DamBreakSystem::_finalize(){
 	assert(IsInitialized);
 
-	delete [] hPos;
-	delete [] hVel;
-	delete [] hVelLeapFrog;	
-	delete [] hMeasures;
-	delete [] hAcceleration;    
+	freeHostArray(hPos);
+	freeHostArray(hVel);
+	freeHostArray(hVelLeapFrog);
+	freeHostArray(hMeasures);
+	freeHostArray(hAcceleration);
 
 	freeArray(dVel);
 	freeArray(dVelLeapFrog);	
@@ -210,6 +378,24 @@ void DamBreakSystem::_finalize(){
 	freeArray(dCellStart);
 	freeArray(dCellEnd);
 
+	freeOrderingBuffers();
+	freeCompactData();
+	freeImplicitSolver();
+	freeBlockSteps();
+	freeRefinement();
+	if (dFreeSlots) {
+		freeArray(dFreeSlots);
+		dFreeSlots = 0;
+	}
+	freeExchange();
+
+	if (dTankField)
+		freeArray(dTankField);
+	if (dGateField)
+		freeArray(dGateField);
+	freePairCache();
+	freeBucketGrid();
+
 	if (IsOpenGL) {
 		unregisterGLBufferObject(cuda_posvbo_resource);
 		glDeleteBuffers(1, (const GLuint*)&posVbo);
@@ -219,8 +405,114 @@ void DamBreakSystem::_finalize(){
         checkCudaErrors( cudaFree(cudaColorVBO) );
 	}	
 }
+
+void DamBreakSystem::allocateOrderingBuffers(){
+	allocateArray((void**)&dMoved, numParticles*sizeof(uint));
+	allocateArray((void**)&dHashScratch, numParticles*sizeof(uint));
+	allocateArray((void**)&dIndexScratch, numParticles*sizeof(uint));
+	allocateArray((void**)&dPermuteScratch, numParticles*4*sizeof(float));
+}
+
+void DamBreakSystem::freeOrderingBuffers(){
+	if (!dMoved)
+		return;
+	freeArray(dMoved);
+	freeArray(dHashScratch);
+	freeArray(dIndexScratch);
+	freeArray(dPermuteScratch);
+	dMoved = 0;
+	dHashScratch = 0;
+	dIndexScratch = 0;
+	dPermuteScratch = 0;
+}
+
+void DamBreakSystem::allocateCompactData(){
+	allocateArray((void**)&dCompactPos, numParticles*4*sizeof(ushort));
+	allocateArray((void**)&dCompactVel, numParticles*4*sizeof(ushort));
+	allocateArray((void**)&dCompactMeasures, numParticles*2*sizeof(ushort));
+}
+
+void DamBreakSystem::freeCompactData(){
+	if (!dCompactPos)
+		return;
+	freeArray(dCompactPos);
+	freeArray(dCompactVel);
+	freeArray(dCompactMeasures);
+	dCompactPos = 0;
+	dCompactVel = 0;
+	dCompactMeasures = 0;
+}
+
+void DamBreakSystem::allocateImplicitSolver(){
+	allocateArray((void**)&dIisphVelAdv, numParticles*4*sizeof(float));
+	allocateArray((void**)&dIisphPressureAcc, numParticles*4*sizeof(float));
+	allocateArray((void**)&dIisphError, numParticles*sizeof(float));
+	allocateArray((void**)&dSumScratch, 2*((numParticles + 255)/256)*sizeof(float));
+}
+
+void DamBreakSystem::freeImplicitSolver(){
+	if (!dIisphVelAdv)
+		return;
+	freeArray(dIisphVelAdv);
+	freeArray(dIisphPressureAcc);
+	freeArray(dIisphError);
+	freeArray(dSumScratch);
+	dIisphVelAdv = 0;
+	dIisphPressureAcc = 0;
+	dIisphError = 0;
+	dSumScratch = 0;
+}
+
+//all particles start on the finest level, with the current measures
+void DamBreakSystem::allocateBlockSteps(){
+	allocateArray((void**)&dLevel, numParticles*sizeof(uint));
+	allocateArray((void**)&dBlockMeasures, numParticles*4*sizeof(float));
+	allocateArray((void**)&dPairCount, 2*numParticles*sizeof(uint));
+	checkCudaErrors(cudaMemset(dLevel, 0, numParticles*sizeof(uint)));
+	checkCudaErrors(cudaMemcpy(dBlockMeasures, dMeasures, numParticles*4*sizeof(float), cudaMemcpyDeviceToDevice));
+}
+
+void DamBreakSystem::freeBlockSteps(){
+	if (!dLevel)
+		return;
+	freeArray(dLevel);
+	freeArray(dBlockMeasures);
+	freeArray(dPairCount);
+	dLevel = 0;
+	dBlockMeasures = 0;
+	dPairCount = 0;
+}
+
+void DamBreakSystem::allocateRefinement(){
+	allocateArray((void**)&dChildren, numParticles*4*sizeof(uint));
+	allocateArray((void**)&dRefineFlags, numParticles*sizeof(uint));
+	allocateArray((void**)&dSplitRank, numParticles*sizeof(uint));
+}
+
+void DamBreakSystem::freeRefinement(){
+	if (!dChildren)
+		return;
+	freeArray(dChildren);
+	freeArray(dRefineFlags);
+	freeArray(dSplitRank);
+	dChildren = 0;
+	dRefineFlags = 0;
+	dSplitRank = 0;
+}
+
+void DamBreakSystem::allocateExchange(){
+	allocateArray((void**)&dExchange, 3*numParticles*4*sizeof(float));
+}
+
+void DamBreakSystem::freeExchange(){
+	if (!dExchange)
+		return;
+	freeArray(dExchange);
+	dExchange = 0;
+}
 void DamBreakSystem::removeRightBoundary(){
 	params.rightBoundary = 0xffffffff;
+	params.gateField = 0;
 	setParameters(&params); 
 
 	float *dPos;
@@ -238,6 +530,7 @@ void DamBreakSystem::removeRightBoundary(){
 
 void DamBreakSystem::changeRightBoundary(){ 
 	params.rightBoundary += params.fluidParticlesSize.x * 2 * params.particleRadius;
+	params.gateShift += params.fluidParticlesSize.x * 2 * params.particleRadius;
 	setParameters(&params); 
 
 	float *dPos;
@@ -254,6 +547,29 @@ void DamBreakSystem::changeRightBoundary(){
 	//elapsedTime = 0.0f;
 }
 
+void DamBreakSystem::setPersistentOrdering(bool enable){
+	assert(!enable || (!IsBucketGrid && params.blockLevels == 0 && !IsPairCache && !IsSubdomain));
+	IsPersistentOrdering = enable;
+	IsOrdered = false;
+	freeOrderingBuffers();
+	if (enable && IsInitialized)
+		allocateOrderingBuffers();
+}
+
+void DamBreakSystem::setCompactNeighbourData(bool enable){
+	assert(!enable || solver == WeaklyCompressible);
+	assert(!enable || !IsSubdomain);
+	IsCompactNeighbourData = enable;
+	freeCompactData();
+	if (enable && IsInitialized)
+		allocateCompactData();
+}
+
+void DamBreakSystem::setDeterministic(bool enable){
+	assert(!enable || (!IsBucketGrid && !IsSubdomain));
+	IsDeterministic = enable;
+}
+
 void DamBreakSystem::update(){
 	assert(IsInitialized);
 
@@ -264,58 +580,565 @@ void DamBreakSystem::update(){
 	else 
 		dPos = (float *) cudaPosVBO;
     
+	if (solver == ImplicitIncompressible) {
+		//Courant limit on the particle spacing and the explicit viscosity limit
+		float speed = maxSpeed(dVel, numFluidParticles);
+		float dt = std::min(IisphMaxDeltaTime, params.smoothingRadius / (0.38f * params.viscositySpeed));
+		if (speed > 0.0f)
+			dt = std::min(dt, IisphCourant * 2 * params.particleRadius / speed);
+		params.deltaTime = dt;
+	}
 
 	setParameters(&params); 
+
+	if (params.blockLevels > 0) {
+		updateBlockSteps(dPos);
+		if (IsOpenGL) {
+			unmapGLBufferObject(cuda_posvbo_resource);
+		}
+		elapsedTime+= params.deltaTime;
+		stepCount++;
+		return;
+	}
+
+	float* sortedPos = dSortedPos;
+	float* sortedVel = dSortedVel;
+	startPhases();
+	if (IsBucketGrid) {
+		buildBucketGrid(dPos);
+	} else if (IsPersistentOrdering) {
+		uint numMoved = numParticles;
+		if (IsOrdered) {
+			calcHashPersistent(dHash, dIndex, dMoved, dPos, numParticles);
+			numMoved = incrementalSortParticles(dHash, dIndex, dHashScratch, dIndexScratch, dMoved, numParticles);
+		} else {
+			calcHash(dHash, dIndex, dPos, numParticles);
+			sortParticles(dHash, dIndex, numParticles);
+			IsOrdered = true;
+		}
+
+		//colours are per particle slot, they move with the particles
+		float* dColor = IsOpenGL ? (float*)mapGLBufferObject(&cuda_colorvbo_resource) : cudaColorVBO;
+		reorderPersistentData(
+			dCellStart,
+			dCellEnd,
+			dPos,
+			dVel,
+			dVelLeapFrog,
+			dColor,
+			dSortedPos,
+			dPermuteScratch,
+			dSortedVel,
+			dHash,
+			dIndex,
+			numMoved > 0,
+			numParticles,
+			2*numGridCells);
+		if (IsOpenGL)
+			unmapGLBufferObject(cuda_colorvbo_resource);
+		//particle arrays are sorted themselves, no gather/scatter needed
+		sortedPos = dPos;
+		sortedVel = dVelLeapFrog;
+	} else {
+		calcHash(dHash, dIndex, dPos, numParticles);
+
+		sortParticles(dHash, dIndex, numParticles);
+
+		reorderDataAndFindCellStart(
+			dCellStart,
+			dCellEnd,
+			dSortedPos,		
+			dSortedVel,
+			dHash,
+			dIndex,
+			dPos,		
+			dVelLeapFrog,
+			numParticles,
+			2*numGridCells);		
+	}
+	timePhase(RebuildPhase);
+
+	if (IsBucketGrid) {
+		calculateDamBreakDensityBuckets(
+			dMeasures,
+			dPos,
+			dBucketCount,
+			dBucketSlots,
+			bucketCapacity,
+			numParticles,
+			numFluidParticles);
+		timePhase(DensityPhase);
+
+		calcAndApplyAccelerationBuckets(
+			dAcceleration,
+			dMeasures,
+			dPos,
+			dVelLeapFrog,
+			dBucketCount,
+			dBucketSlots,
+			bucketCapacity,
+			numParticles,
+			numFluidParticles);
+		timePhase(ForcePhase);
+	} else if (solver == ImplicitIncompressible) {
+		calculateDamBreakDensity(		
+			dMeasures, //output
+			dMeasures,//input
+			sortedPos,	
+			sortedVel,
+			dIndex,
+			dCellStart,
+			dCellEnd,
+			0,
+			0,
+			0,
+			numParticles,
+			numFluidParticles,
+			numGridCells);
+
+		solverIterations = solveIisphPressure(
+			dAcceleration,
+			dVel,
+			dVelLeapFrog,
+			dMeasures,
+			sortedPos,
+			sortedVel,
+			dIisphVelAdv,
+			dIisphPressureAcc,
+			dIisphError,
+			dIndex,
+			dCellStart,
+			dCellEnd,
+			numParticles,
+			numFluidParticles,
+			numGridCells,
+			IisphTolerance,
+			IisphMinIterations,
+			IisphMaxIterations,
+			IsDeterministic ? dSumScratch : 0,
+			&densityError);
+		totalSolverIterations += solverIterations;
+	} else if (IsCompactNeighbourData) {
+		packCompactData(dCompactPos, dCompactVel, sortedPos, sortedVel, numParticles);
+
+		calculateDamBreakDensityCompact(
+			dMeasures, //output
+			dCompactMeasures, //output
+			sortedPos,
+			dCompactPos,
+			dCellStart,
+			dCellEnd,
+			numParticles,
+			numFluidParticles,
+			numGridCells);
+
+		calcAndApplyAccelerationCompact(
+			dAcceleration,
+			dMeasures,
+			dCompactMeasures,
+			sortedPos,
+			sortedVel,
+			dCompactPos,
+			dCompactVel,
+			dIndex,
+			dCellStart,
+			dCellEnd,
+			numParticles,
+			numFluidParticles,
+			numGridCells);
+	} else {
+		calculateDamBreakDensity(		
+			dMeasures, //output
+			dMeasures,//input
+			sortedPos,	
+			sortedVel,
+			dIndex,
+			dCellStart,
+			dCellEnd,
+			dPairCache,
+			dPairIndex,
+			dPairData,
+			numParticles,
+			numActiveFluidParticles,
+			numGridCells);
+		timePhase(DensityPhase);
+
+		calcAndApplyAcceleration(
+			dAcceleration,
+			dMeasures,		
+			sortedPos,			
+			sortedVel,
+			dIndex,
+			dCellStart,
+			dCellEnd,
+			dPairCache,
+			dPairIndex,
+			dPairData,
+			numParticles,
+			numActiveFluidParticles,
+			numGridCells);  
+		timePhase(ForcePhase);
+	}
+
+	if (params.boundarySubsteps > 1)
+		integrateSubsteps(
+			dPos,
+			dVel,
+			dVelLeapFrog,
+			dAcceleration,
+			sortedPos,
+			dCellStart,
+			dCellEnd,
+			params.deltaTime,
+			params.boundarySubsteps,
+			numParticles,
+			numFluidParticles,
+			numGridCells);
+	else
+		integrateSystem(
+			dPos,
+			dVel,	
+			dVelLeapFrog,
+			dAcceleration,
+			numFluidParticles);
+
+	if (params.adaptiveRefinement && (stepCount + 1) % RefinementInterval == 0)
+		refine(dPos);
 	
-	calcHash(dHash, dIndex, dPos, numParticles);
-	
-	sortParticles(dHash, dIndex, numParticles);
+	if (IsOpenGL) {
+		unmapGLBufferObject(cuda_posvbo_resource);
+	}
+	elapsedTime+= params.deltaTime;
+	stepCount++;
+}
 
-	reorderDataAndFindCellStart(
-		dCellStart,
-		dCellEnd,
-		dSortedPos,		
-		dSortedVel,
-		dHash,
-		dIndex,
-		dPos,		
+//split and merge on the sorted state of the step just integrated
+void DamBreakSystem::refine(float* dPos){
+	numActiveFluidParticles = refineParticles(
+		dPos,
+		dVel,
 		dVelLeapFrog,
-		numParticles,
-		numGridCells);		
-
-	calculateDamBreakDensity(		
-		dMeasures, //output
-		dMeasures,//input
-		dSortedPos,	
+		dAcceleration,
+		dChildren,
+		dRefineFlags,
+		dSplitRank,
+		dFreeSlots,
+		dSortedPos,
 		dSortedVel,
 		dIndex,
 		dCellStart,
 		dCellEnd,
+		RefinementSplitRatio,
+		RefinementMergeRatio,
 		numParticles,
+		numActiveFluidParticles,
+		numFluidParticles,
 		numGridCells);
+	//walls move in the sorted list with the number of fluid particles
+	fillWallMeasures(dMeasures, params.restDensity, numActiveFluidParticles, numWallParticles);
+}
 
-	calcAndApplyAcceleration(
-		dAcceleration,
-		dMeasures,		
-		dSortedPos,			
-		dSortedVel,
-		dIndex,
-		dCellStart,
-		dCellEnd,
-		numParticles,
-		numGridCells);  
+void DamBreakSystem::updateBlockSteps(float* dPos){
+	//the finest level runs at the smallest particle limit, so the others can
+	//take 2, 4, ... of its substeps; the step is 2^blockLevels substeps
+	uint substeps = 1u << params.blockLevels;
+	float substepTime = minBlockTimeLimit(dVel, dAcceleration, numFluidParticles);
+	params.deltaTime = substeps * substepTime;
+	setParameters(&params);
+	for(uint k = 0; k < substeps; k++){
+		calcHash(dHash, dIndex, dPos, numParticles);
 
-	integrateSystem(
-		dPos,
-		dVel,	
-		dVelLeapFrog,
-		dAcceleration,
-		numParticles);
-	
-	if (IsOpenGL) {
-		unmapGLBufferObject(cuda_posvbo_resource);
+		sortParticles(dHash, dIndex, numParticles);
+
+		reorderDataAndFindCellStart(
+			dCellStart,
+			dCellEnd,
+			dSortedPos,
+			dSortedVel,
+			dHash,
+			dIndex,
+			dPos,
+			dVelLeapFrog,
+			numParticles,
+			2*numGridCells);
+
+		blockTimeStep(
+			dPos,
+			dVel,
+			dVelLeapFrog,
+			dAcceleration,
+			dMeasures,
+			dBlockMeasures,
+			dSortedPos,
+			dSortedVel,
+			dLevel,
+			IsPairCounting ? dPairCount : 0,
+			dIndex,
+			dCellStart,
+			dCellEnd,
+			k,
+			substepTime,
+			numParticles,
+			numFluidParticles,
+			numGridCells,
+			&pairEvaluations,
+			&fullPairEvaluations);
 	}
-	elapsedTime+= params.deltaTime;
+}
+
+void DamBreakSystem::getLevelHistogram(uint* counts){
+	assert(params.blockLevels > 0);
+	memset(counts, 0, (params.blockLevels + 1) * sizeof(uint));
+	uint* hLevel = new uint[numFluidParticles];
+	copyArrayFromDevice(hLevel, dLevel, 0, numFluidParticles*sizeof(uint));
+	for(uint i = 0; i < numFluidParticles; i++)
+		counts[hLevel[i]]++;
+	delete [] hLevel;
+}
+
+void DamBreakSystem::setPressureSolver(PressureSolver pressureSolver){
+	assert(pressureSolver == WeaklyCompressible || params.boundaryModel == ParticleWalls);
+	assert(pressureSolver == WeaklyCompressible || params.blockLevels == 0);
+	assert(pressureSolver == WeaklyCompressible || !params.adaptiveRefinement);
+	assert(pressureSolver == WeaklyCompressible || !IsBucketGrid);
+	assert(pressureSolver == WeaklyCompressible || !IsSubdomain);
+	assert(pressureSolver == WeaklyCompressible || !IsCompactNeighbourData);
+	solver = pressureSolver;
+	freeImplicitSolver();
+	if (solver == ImplicitIncompressible && IsInitialized)
+		allocateImplicitSolver();
+	if (solver == WeaklyCompressible)
+		params.deltaTime = params.boundarySubsteps * pow(10.0f, -4.0f);
+}
+
+void DamBreakSystem::setBoundarySubsteps(uint substeps){
+	assert(substeps > 0);
+	assert(substeps == 1 || (params.blockLevels == 0 && !params.adaptiveRefinement && !IsBucketGrid
+		&& !IsSubdomain));
+	params.boundarySubsteps = substeps;
+	if (solver == WeaklyCompressible)
+		params.deltaTime = substeps * pow(10.0f, -4.0f);
+}
+
+void DamBreakSystem::setBlockTimeStepping(uint levels){
+	assert(levels == 0 || (solver == WeaklyCompressible && params.boundarySubsteps == 1
+		&& !IsPersistentOrdering && !IsCompactNeighbourData && !params.adaptiveRefinement && !IsBucketGrid
+		&& !IsPairCache && !IsSubdomain));
+	params.blockLevels = levels;
+	freeBlockSteps();
+	if (levels > 0 && IsInitialized)
+		allocateBlockSteps();
+	if (solver == WeaklyCompressible)
+		params.deltaTime = (1u << levels) * pow(10.0f, -4.0f);
+}
+
+void DamBreakSystem::setAdaptiveRefinement(bool enable){
+	assert(!enable || (solver == WeaklyCompressible && params.boundarySubsteps == 1
+		&& params.blockLevels == 0 && params.boundaryModel == ParticleWalls
+		&& !IsPersistentOrdering && !IsCompactNeighbourData && !IsBucketGrid));
+	assert(!enable || !IsSubdomain);
+	uint numColumnParticles = fluidParticlesSize.x * fluidParticlesSize.y * fluidParticlesSize.z;
+	uint capacity = numColumnParticles;
+	if (enable)
+		capacity += 3 * (uint)ceilf(RefinementReserve * numColumnParticles);
+	resizeFluidCapacity(capacity);
+	params.adaptiveRefinement = enable;
+	freeRefinement();
+	if (enable && IsInitialized)
+		allocateRefinement();
+	//children have half the smoothing length
+	params.deltaTime = (enable ? 0.5f : 1.0f) * pow(10.0f, -4.0f);
+}
+
+void DamBreakSystem::setBucketGrid(bool enable){
+	assert(!enable || (solver == WeaklyCompressible && params.boundarySubsteps == 1 && params.blockLevels == 0
+		&& !params.adaptiveRefinement && !IsPersistentOrdering && !IsCompactNeighbourData && !IsSubdomain
+		&& !IsDeterministic));
+	IsBucketGrid = enable;
+	freeBucketGrid();
+	if (enable && IsInitialized)
+		allocateBucketGrid();
+}
+
+void DamBreakSystem::allocateBucketGrid(){
+	allocateArray((void**)&dBucketCount, 2*numGridCells*sizeof(uint));
+	allocateArray((void**)&dBucketSlots, 2*numGridCells*bucketCapacity*sizeof(uint));
+	allocateArray((void**)&dBucketOverflow, sizeof(uint));
+}
+
+void DamBreakSystem::freeBucketGrid(){
+	if (!dBucketCount)
+		return;
+	freeArray(dBucketCount);
+	freeArray(dBucketSlots);
+	freeArray(dBucketOverflow);
+	dBucketCount = 0;
+	dBucketSlots = 0;
+	dBucketOverflow = 0;
+}
+
+//capacity only grows, to the next power of two above the fullest bucket
+void DamBreakSystem::buildBucketGrid(float* dPos){
+	uint maxCount = buildBuckets(dBucketCount, dBucketSlots, dBucketOverflow, dPos,
+		bucketCapacity, numParticles, numGridCells);
+	if (maxCount == 0)
+		return;
+	while (bucketCapacity < maxCount)
+		bucketCapacity *= 2;
+	freeArray(dBucketSlots);
+	allocateArray((void**)&dBucketSlots, 2*numGridCells*bucketCapacity*sizeof(uint));
+	buildBuckets(dBucketCount, dBucketSlots, dBucketOverflow, dPos, bucketCapacity, numParticles, numGridCells);
+}
+
+size_t DamBreakSystem::getBucketGridBytes() const {
+	if (!IsBucketGrid)
+		return 0;
+	return 2 * (size_t)numGridCells * (bucketCapacity + 1) * sizeof(uint);
+}
+
+void DamBreakSystem::setNeighbourTiming(bool enable){
+	IsNeighbourTiming = enable;
+	if (enable && !phaseTimer)
+		sdkCreateTimer(&phaseTimer);
+	for(int k = 0; k < NeighbourPhases; k++)
+		neighbourSeconds[k] = 0.0;
+}
+
+void DamBreakSystem::startPhases(){
+	if (!IsNeighbourTiming)
+		return;
+	cudaThreadSynchronize();
+	sdkResetTimer(&phaseTimer);
+	sdkStartTimer(&phaseTimer);
+}
+
+void DamBreakSystem::timePhase(NeighbourPhase phase){
+	if (!IsNeighbourTiming)
+		return;
+	cudaThreadSynchronize();
+	neighbourSeconds[phase] += sdkGetTimerValue(&phaseTimer) / 1000.0;
+	sdkResetTimer(&phaseTimer);
+}
+
+void DamBreakSystem::setPairCache(bool enable){
+	assert(!enable || (!IsPersistentOrdering && params.blockLevels == 0 && !IsSubdomain));
+	IsPairCache = enable;
+	freePairCache();
+	if (enable && IsInitialized)
+		allocatePairCache();
+}
+
+size_t DamBreakSystem::getPairCacheBytes() const {
+	if (!IsPairCache)
+		return 0;
+	return numFluidParticles * (sizeof(uint) + PAIR_CACHE_SIZE * (sizeof(uint) + 2*sizeof(float)));
+}
+
+void DamBreakSystem::allocatePairCache(){
+	allocateArray((void**)&dPairCache, numFluidParticles*sizeof(uint));
+	allocateArray((void**)&dPairIndex, PAIR_CACHE_SIZE*numFluidParticles*sizeof(uint));
+	allocateArray((void**)&dPairData, PAIR_CACHE_SIZE*numFluidParticles*2*sizeof(float));
+}
+
+void DamBreakSystem::freePairCache(){
+	if (!dPairCache)
+		return;
+	freeArray(dPairCache);
+	freeArray(dPairIndex);
+	freeArray(dPairData);
+	dPairCache = 0;
+	dPairIndex = 0;
+	dPairData = 0;
+}
+
+void DamBreakSystem::resizeFluidCapacity(uint capacity){
+	if (capacity == numFluidParticles)
+		return;
+	_finalize();
+	IsInitialized = false;
+	numFluidParticles = capacity;
+	numActiveFluidParticles = fluidParticlesSize.x * fluidParticlesSize.y * fluidParticlesSize.z;
+	numParticles = numFluidParticles + numWallParticles;
+	_initialize(numParticles);
+}
+
+void DamBreakSystem::setSubdomain(float xMin, float xMax){
+	assert(xMin < xMax);
+	assert(!IsOpenGL && solver == WeaklyCompressible && params.boundaryModel == ParticleWalls
+		&& params.boundarySubsteps == 1 && params.blockLevels == 0 && !params.adaptiveRefinement
+		&& !IsPersistentOrdering && !IsCompactNeighbourData && !IsBucketGrid && !IsPairCache && !IsDeterministic);
+	uint numColumnParticles = fluidParticlesSize.x * fluidParticlesSize.y * fluidParticlesSize.z;
+	//any slab may end up holding the whole column plus its halo
+	resizeFluidCapacity(numColumnParticles + numColumnParticles / 4);
+	IsSubdomain = true;
+	freeExchange();
+	if (IsInitialized)
+		allocateExchange();
+	subdomainMin = xMin;
+	subdomainMax = xMax;
+}
+
+uint DamBreakSystem::exportParticles(float xMin, float xMax, bool migrate, float* records){
+	assert(IsSubdomain);
+	float* dPos = (float *) cudaPosVBO;
+	uint count = selectParticles(dPos, dVel, dVelLeapFrog, dExchange, xMin, xMax, numFluidParticles);
+	copyArrayFromDevice(records, dExchange, 0, 3*count*4*sizeof(float));
+	if (migrate && count > 0) {
+		retypeParticles(dPos, dVel, dVelLeapFrog, Fluid, Inactive, xMin, xMax, numFluidParticles);
+		updateActiveCount();
+	}
+	return count;
+}
+
+uint DamBreakSystem::importParticles(const float* records, uint count, bool halo){
+	assert(IsSubdomain);
+	if (count == 0)
+		return 0;
+	assert(count <= numFluidParticles);
+	copyArrayToDevice(dExchange, records, 0, 3*count*4*sizeof(float));
+	uint inserted = insertParticles((float *) cudaPosVBO, dVel, dVelLeapFrog, dExchange, dFreeSlots,
+		halo ? Halo : Fluid, count, numFluidParticles);
+	updateActiveCount();
+	return inserted;
+}
+
+void DamBreakSystem::clearHalo(){
+	assert(IsSubdomain);
+	retypeParticles((float *) cudaPosVBO, dVel, dVelLeapFrog, Halo, Inactive, -FLT_MAX, FLT_MAX, numFluidParticles);
+	updateActiveCount();
+}
+
+//fluid and halo particles are sorted before the walls
+void DamBreakSystem::updateActiveCount(){
+	numActiveFluidParticles = countActiveParticles((float *) cudaPosVBO, numFluidParticles);
+	fillWallMeasures(dMeasures, params.restDensity, numActiveFluidParticles, numWallParticles);
+}
+
+uint DamBreakSystem::relax(float relaxTime){
+	uint steps = 0;
+	if (!IsHydrostaticInit) {
+		while(elapsedTime < relaxTime){
+			update();
+			steps++;
+		}
+		return steps;
+	}
+
+	float height = 2 * params.particleRadius * params.fluidParticlesSize.y;
+	float tolerance = HydrostaticTolerance * sqrtf(fabs(params.gravity.y) * height);
+	for(; steps < HydrostaticMaxSteps; steps++){
+		if(steps >= HydrostaticMinSteps && steps % HydrostaticCheckInterval == 0
+			&& getMaxFluidSpeed() < tolerance)
+			break;
+		update();
+		dampVelocity(dVel, dVelLeapFrog, HydrostaticDamping, numFluidParticles);
+	}
+	elapsedTime = relaxTime;
+	return steps;
+}
+
+float DamBreakSystem::getMaxFluidSpeed(){
+	return maxSpeed(dVel, numFluidParticles);
 }
 
 void DamBreakSystem::setArray(ParticleArray array, const float* data, int start, int count){
@@ -354,29 +1177,249 @@ void DamBreakSystem::setArray(ParticleArray array, const float* data, int start,
 	}       
 }
 
+void DamBreakSystem::clearHostState(){
+	memset(hPos, 0, numParticles*4*sizeof(float));
+	memset(hVel, 0, numParticles*4*sizeof(float));
+	memset(hVelLeapFrog, 0, numParticles*4*sizeof(float));
+	memset(hAcceleration, 0, numParticles*4*sizeof(float));	
+	memset(hMeasures, 0, numParticles*4*sizeof(float)); 
+
+	for(uint i = 0; i < numParticles; i++)
+		hMeasures[4*i+0] = params.restDensity;
+}
+
+bool DamBreakSystem::setStateFiles(const char* prefix){
+#ifdef _WIN32
+	if (prefix != 0)
+		return false;
+#endif
+	_finalize();
+	IsInitialized = false;
+	IsMappedState = (prefix != 0);
+	statePrefix = prefix ? prefix : "";
+	_initialize(numParticles);
+	return true;
+}
+
+//numParticles float4, a shared file mapping with mapped state; new files read as zeros
+float* DamBreakSystem::allocateHostArray(ParticleArray array){
+#ifndef _WIN32
+	if (IsMappedState) {
+		size_t size = numParticles*4*sizeof(float);
+		std::string name = statePrefix + StateFileSuffixes[array];
+		int fd = open(name.c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0 || ftruncate(fd, size) != 0) {
+			printf("DamBreakSystem: cannot open state file %s\n", name.c_str());
+			exit(EXIT_FAILURE);
+		}
+		void* data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED) {
+			printf("DamBreakSystem: cannot map state file %s\n", name.c_str());
+			exit(EXIT_FAILURE);
+		}
+		return (float*)data;
+	}
+#endif
+	return new float[numParticles*4];
+}
+
+void DamBreakSystem::freeHostArray(float* data){
+#ifndef _WIN32
+	if (IsMappedState) {
+		munmap(data, numParticles*4*sizeof(float));
+		return;
+	}
+#endif
+	delete [] data;
+}
+
+float* DamBreakSystem::hostArray(ParticleArray array){
+	float* arrays[5] = {hPos, hVel, hMeasures, hAcceleration, hVelLeapFrog};
+	return arrays[array];
+}
+
+float* DamBreakSystem::deviceArray(ParticleArray array){
+	float* arrays[5] = {(float*)cudaPosVBO, dVel, dMeasures, dAcceleration, dVelLeapFrog};
+	return arrays[array];
+}
+
+//chunks of a page multiple, the mapping itself is page aligned
+void DamBreakSystem::adviseState(float* data, uint start, uint count, int advice){
+#ifndef _WIN32
+	madvise(data + 4*start, count*4*sizeof(float), advice);
+#endif
+}
+
+void DamBreakSystem::setStateChunkParticles(uint count){
+#ifndef _WIN32
+	assert(count > 0 && count*4*sizeof(float) % sysconf(_SC_PAGESIZE) == 0);
+#endif
+	stateChunkParticles = count;
+}
+
+#ifndef _WIN32
+//starts the write-back of a chunk without waiting for it; Linux only,
+//elsewhere the msync at the end of the checkpoint writes everything
+static void startWriteBack(int fd, uint start, uint count){
+#ifdef __linux__
+	sync_file_range(fd, start*4*sizeof(float), count*4*sizeof(float), SYNC_FILE_RANGE_WRITE);
+#endif
+}
+
+//waits for the write-back of a chunk and drops its pages from the page cache
+static void finishWriteBack(int fd, uint start, uint count){
+#ifdef __linux__
+	sync_file_range(fd, start*4*sizeof(float), count*4*sizeof(float),
+		SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(fd, start*4*sizeof(float), count*4*sizeof(float), POSIX_FADV_DONTNEED);
+#endif
+}
+#endif
+
+void DamBreakSystem::checkpoint(){
+#ifndef _WIN32
+	assert(IsMappedState && !IsOpenGL);
+	for(int array = POSITION; array <= VELOCITYLEAPFROG; array++){
+		float* data = hostArray((ParticleArray)array);
+		float* device = deviceArray((ParticleArray)array);
+		std::string name = statePrefix + StateFileSuffixes[array];
+		int fd = open(name.c_str(), O_RDWR);
+		assert(fd >= 0);
+		uint previous = 0;
+		for(uint start = 0; start < numParticles; start += stateChunkParticles){
+			uint count = std::min(stateChunkParticles, numParticles - start);
+			copyArrayFromDevice(data + 4*start, device, start*4*sizeof(float), count*4*sizeof(float));
+			startWriteBack(fd, start, count);
+			adviseState(data, start, count, MADV_DONTNEED);
+			//the previous chunk was written back while this one was copied
+			if (start > 0)
+				finishWriteBack(fd, previous, stateChunkParticles);
+			previous = start;
+		}
+		msync(data, numParticles*4*sizeof(float), MS_SYNC);
+		finishWriteBack(fd, previous, numParticles - previous);
+		close(fd);
+	}
+
+	StateHeader header;
+	header.elapsedTime = elapsedTime;
+	header.stepCount = stepCount;
+	header.numActiveFluidParticles = numActiveFluidParticles;
+	header.gateRemoved = (params.gateField == 0);
+	header.rightBoundary = params.rightBoundary;
+	header.gateShift = params.gateShift;
+	std::string name = statePrefix + ".meta";
+	FILE* file = fopen(name.c_str(), "wb");
+	assert(file);
+	fwrite(&header, sizeof(header), 1, file);
+	fclose(file);
+#endif
+}
+
+void DamBreakSystem::restoreState(){
+#ifndef _WIN32
+	assert(IsMappedState && !params.adaptiveRefinement);
+	StateHeader header;
+	std::string name = statePrefix + ".meta";
+	FILE* file = fopen(name.c_str(), "rb");
+	if (!file || fread(&header, sizeof(header), 1, file) != 1) {
+		printf("DamBreakSystem: no checkpoint in %s\n", name.c_str());
+		exit(EXIT_FAILURE);
+	}
+	fclose(file);
+
+	for(int array = POSITION; array <= VELOCITYLEAPFROG; array++){
+		float* data = hostArray((ParticleArray)array);
+		adviseState(data, 0, std::min(stateChunkParticles, numParticles), MADV_WILLNEED);
+		for(uint start = 0; start < numParticles; start += stateChunkParticles){
+			uint count = std::min(stateChunkParticles, numParticles - start);
+			//read ahead of the next chunk overlaps the copy of this one
+			uint next = start + count;
+			if (next < numParticles)
+				adviseState(data, next, std::min(stateChunkParticles, numParticles - next), MADV_WILLNEED);
+			setArray((ParticleArray)array, data + 4*start, start, count);
+			adviseState(data, start, count, MADV_DONTNEED);
+		}
+	}
+	//measures are recomputed by the next density pass, all particles on the finest level
+	if (params.blockLevels > 0) {
+		copyArrayToDevice(dBlockMeasures, hMeasures, 0, numParticles*4*sizeof(float));
+		checkCudaErrors(cudaMemset(dLevel, 0, numParticles*sizeof(uint)));
+	}
+
+	elapsedTime = header.elapsedTime;
+	stepCount = header.stepCount;
+	solverIterations = 0;
+	totalSolverIterations = 0;
+	densityError = 0.0f;
+	pairEvaluations = 0.0;
+	fullPairEvaluations = 0.0;
+	IsOrdered = false;
+	numActiveFluidParticles = header.numActiveFluidParticles;
+	if (IsSubdomain)
+		updateActiveCount();
+	params.rightBoundary = header.rightBoundary;
+	params.gateField = header.gateRemoved ? 0 : (float4*)dGateField;
+	params.gateShift = header.gateShift;
+#endif
+}
+
 inline float frand(){
 	return rand() / (float) RAND_MAX;
 }
 
 void DamBreakSystem::reset(){
+	if (IsMappedState)
+		clearHostState();
 	elapsedTime = 0.0f;
+	stepCount = 0;
+	solverIterations = 0;
+	totalSolverIterations = 0;
+	densityError = 0.0f;
+	pairEvaluations = 0.0;
+	fullPairEvaluations = 0.0;
+	IsOrdered = false;
+	numActiveFluidParticles = fluidParticlesSize.x * fluidParticlesSize.y * fluidParticlesSize.z;
 	float jitter = params.particleRadius*0.01f;			            
 	uint s = (int) (powf((float) numParticles, 1.0f / 3.0f));
 	float spacing = params.particleRadius * 2.0f;
 	uint gridSize[3];
 	gridSize[0] = gridSize[1] = gridSize[2] = s;
 	initFluid(gridSize, spacing, jitter, numParticles);
-	if(params.boundaryOffset > 0)
-		initBoundaryParticles(spacing);
+	for(uint i = numActiveFluidParticles; i < numFluidParticles; i++)
+		hPos[i*4+3] = Inactive;
+	//a subdomain keeps only the part of the column inside its slab
+	for(uint i = 0; IsSubdomain && i < numActiveFluidParticles; i++)
+		if (hPos[i*4] < subdomainMin || hPos[i*4] >= subdomainMax) {
+			hPos[i*4+3] = Inactive;
+			hVel[i*4] = hVel[i*4+1] = hVel[i*4+2] = 0.0f;
+			hVelLeapFrog[i*4] = hVelLeapFrog[i*4+1] = hVelLeapFrog[i*4+2] = 0.0f;
+		}
+	if(params.boundaryOffset > 0 && params.boundaryModel == ParticleWalls)
+		initBoundaryParticles(spacing, hPos, numFluidParticles);
 
 	setArray(POSITION, hPos, 0, numParticles);
 	setArray(VELOCITY, hVel, 0, numParticles);	
 	setArray(MEASURES, hMeasures, 0, numParticles);
 	setArray(ACCELERATION, hAcceleration, 0, numParticles);
 	setArray(VELOCITYLEAPFROG, hVelLeapFrog, 0, numParticles);
+	//all particles start on the finest level, hAcceleration is all zero
+	if (params.blockLevels > 0) {
+		copyArrayToDevice(dBlockMeasures, hMeasures, 0, numParticles*4*sizeof(float));
+		copyArrayToDevice(dLevel, hAcceleration, 0, numParticles*sizeof(uint));
+	}
+	if (params.adaptiveRefinement) {
+		resetRefinement(dChildren, numFluidParticles);
+		fillWallMeasures(dMeasures, params.restDensity, numActiveFluidParticles, numWallParticles);
+	}
+	if (IsSubdomain)
+		updateActiveCount();
 
 	params.rightBoundary = params.worldOrigin.x +
 		(params.boundaryOffset + params.fluidParticlesSize.x) * 2 * params.particleRadius;
+	params.gateField = (float4*)dGateField;
+	params.gateShift = 0.0f;
 }
 
 void DamBreakSystem::initFluid(uint *size, float spacing, float jitter, uint numParticles){
@@ -384,6 +1427,22 @@ void DamBreakSystem::initFluid(uint *size, float spacing, float jitter, uint num
 	int xsize = fluidParticlesSize.x;
 	int ysize = fluidParticlesSize.y;
 	int zsize = fluidParticlesSize.z;
+
+	//row heights above the first row; with the hydrostatic start rows are
+	//compressed to the Tait density rho0 * (1 + rho0 * g * depth / B)^(1/gamma)
+	float* rowY = new float[ysize];
+	float* rowDensity = new float[ysize];
+	float height = ysize * spacing;
+	float offset = 0.0f;
+	for(int row = 0; row < ysize; row++){
+		float ratio = 1.0f;
+		if (IsHydrostaticInit)
+			ratio = powf(1.0f + params.restDensity * fabs(params.gravity.y) * (height - offset) / params.B,
+				1.0f / params.gamma);
+		rowY[row] = IsHydrostaticInit ? offset : spacing * row;
+		rowDensity[row] = params.restDensity * ratio;
+		offset += spacing / ratio;
+	}
 	
 	for(uint z = 0; z < zsize; z++) {
 		for(uint y = 0; y < ysize; y++) {
@@ -393,24 +1452,25 @@ void DamBreakSystem::initFluid(uint *size, float spacing, float jitter, uint num
 					hPos[i*4] = (spacing * x) + params.particleRadius - getHalfWorldXSize()
 						+ params.boundaryOffset * 2 * params.particleRadius
 						;//+ 1 * 2 * params.particleRadius;					
-					hPos[i*4+1] = (spacing * y) + params.particleRadius -getHalfWorldYSize()
+					hPos[i*4+1] = rowY[y] + params.particleRadius -getHalfWorldYSize()
 						+ params.boundaryOffset * 2 * params.particleRadius;
 					hPos[i*4+2] = (spacing * z) + params.particleRadius - getHalfWorldZSize();					
 					hPos[i*4+3] = Fluid;//0.0f;//fluid
+					hMeasures[i*4] = rowDensity[y];
+					hMeasures[i*4+1] = DamBreakEos::pressure(rowDensity[y], params.restDensity, params.B);
 				}
 			}
 		}
 	}
+	delete [] rowY;
+	delete [] rowDensity;
 }
 
 
-void DamBreakSystem::initBoundaryParticles(float spacing)
+void DamBreakSystem::initBoundaryParticles(float spacing, float* hPos, int firstIndex)
 {	
 	uint size[3];	
-	int numAllocatedParticles = 
-		params.fluidParticlesSize.x *
-		params.fluidParticlesSize.y * 
-		params.fluidParticlesSize.z;
+	int numAllocatedParticles = firstIndex;
 	//bottom type 1
 	size[0] = params.gridSize.x - (params.boundaryOffset -1);
 	size[1] = 1;
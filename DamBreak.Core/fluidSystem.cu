@@ -2,12 +2,24 @@
 #include <cstdlib>
 #include <cstdio>
 #include <string.h>
+#include <cfloat>
 #include <GL/freeglut.h>
 #include <cuda_gl_interop.h>
 #include "thrust/device_ptr.h"
 #include "thrust/for_each.h"
 #include "thrust/iterator/zip_iterator.h"
 #include "thrust/sort.h"
+#include "thrust/copy.h"
+#include "thrust/remove.h"
+#include "thrust/merge.h"
+#include "thrust/reduce.h"
+#include "thrust/sequence.h"
+#include "thrust/functional.h"
+#include "thrust/transform_reduce.h"
+#include "thrust/transform_scan.h"
+#include "thrust/count.h"
+#include "thrust/fill.h"
+#include "thrust/iterator/counting_iterator.h"
 #include "fluid_kernel.cu"
 
 #include "../Common/helper_cuda.h"
@@ -78,6 +90,11 @@ extern "C"
         checkCudaErrors(cudaMemcpy((char *) device + offset, host, size, cudaMemcpyHostToDevice));
 	}
 
+	void copyArrayFromDevice(void* host, const void* device, int offset, int size)
+	{
+        checkCudaErrors(cudaMemcpy(host, (const char *) device + offset, size, cudaMemcpyDeviceToHost));
+	}
+
 	void ExtChangeRightBoundary(
 		float * position,
 		uint numParticles){
@@ -91,13 +108,157 @@ extern "C"
 //			cutilCheckMsg("removeRightBoundary kernel execution failed");
 	}
 
+	// stable, particles of a cell stay in index order; for uint keys this is
+	// the same radix sort thrust picks for sort_by_key
 	void sortParticles(uint *dHash, uint *dIndex, uint numParticles)
 	{
-		thrust::sort_by_key(thrust::device_ptr<uint>(dHash),
+		thrust::stable_sort_by_key(thrust::device_ptr<uint>(dHash),
 							thrust::device_ptr<uint>(dHash + numParticles),
 							thrust::device_ptr<uint>(dIndex));
 	}
 
+	void calcHashPersistent(
+		uint* gridParticleHash,
+		uint* gridParticleIndex,
+		uint* moved,
+		float* pos,
+		int numParticles){
+			uint numThreads, numBlocks;
+			computeGridSize(numParticles, 256, numBlocks, numThreads);
+
+			calcHashPersistentD<<< numBlocks, numThreads >>>(
+				gridParticleHash,
+				gridParticleIndex,
+				moved,
+				(float4 *) pos,
+				numParticles);
+	}
+
+	// Re-sorts an almost sorted hash list: particles which kept their cell are
+	// still in order, so only the moved ones are sorted and merged back.
+	// Returns number of particles that changed cell.
+	uint incrementalSortParticles(
+		uint *dHash,
+		uint *dIndex,
+		uint *dHashScratch,
+		uint *dIndexScratch,
+		uint *dMoved,
+		uint numParticles){
+			thrust::device_ptr<uint> hash(dHash);
+			thrust::device_ptr<uint> index(dIndex);
+			thrust::device_ptr<uint> moved(dMoved);
+			thrust::device_ptr<uint> hashScratch(dHashScratch);
+			thrust::device_ptr<uint> indexScratch(dIndexScratch);
+
+			uint numMoved = thrust::reduce(moved, moved + numParticles);
+			if (numMoved == 0)
+				return 0;
+
+			//merging only pays off while few particles change cell
+			if (4 * numMoved > numParticles) {
+				sortParticles(dHash, dIndex, numParticles);
+				return numMoved;
+			}
+
+			uint numStayed = numParticles - numMoved;
+			thrust::remove_copy_if(
+				thrust::make_zip_iterator(thrust::make_tuple(hash, index)),
+				thrust::make_zip_iterator(thrust::make_tuple(hash + numParticles, index + numParticles)),
+				moved,
+				thrust::make_zip_iterator(thrust::make_tuple(hashScratch, indexScratch)),
+				thrust::identity<uint>());
+			thrust::copy_if(
+				thrust::make_zip_iterator(thrust::make_tuple(hash, index)),
+				thrust::make_zip_iterator(thrust::make_tuple(hash + numParticles, index + numParticles)),
+				moved,
+				thrust::make_zip_iterator(thrust::make_tuple(hashScratch + numStayed, indexScratch + numStayed)),
+				thrust::identity<uint>());
+
+			thrust::stable_sort_by_key(hashScratch + numStayed, hashScratch + numParticles, indexScratch + numStayed);
+
+			thrust::merge_by_key(
+				hashScratch, hashScratch + numStayed,
+				hashScratch + numStayed, hashScratch + numParticles,
+				indexScratch,
+				indexScratch + numStayed,
+				hash,
+				index);
+			return numMoved;
+	}
+
+	void reorderPersistentData(
+		uint*  cellStart,
+		uint*  cellEnd,
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float* color,
+		float* scratchPos,
+		float* scratchVel,
+		float* scratchVelLeapFrog,
+		uint*  gridParticleHash,
+		uint*  gridParticleIndex,
+		bool   permute,
+		uint   numParticles,
+		uint   numCells){
+			uint numThreads, numBlocks;
+			computeGridSize(numParticles, 256, numBlocks, numThreads);
+
+			checkCudaErrors(cudaMemset(cellStart, 0xffffffff, numCells*sizeof(uint)));
+
+			uint smemSize = sizeof(uint)*(numThreads+1);
+			reorderPersistentDataD<<< numBlocks, numThreads, smemSize>>>(
+				cellStart,
+				cellEnd,
+				(float4 *) scratchPos,
+				(float4 *) scratchVel,
+				(float4 *) scratchVelLeapFrog,
+				gridParticleHash,
+				gridParticleIndex,
+				(float4 *) pos,
+				(float4 *) vel,
+				(float4 *) velLeapFrog,
+				permute,
+				numParticles);
+
+			if (!permute)
+				return;
+
+			uint memSize = numParticles*sizeof(float4);
+			checkCudaErrors(cudaMemcpy(pos, scratchPos, memSize, cudaMemcpyDeviceToDevice));
+			checkCudaErrors(cudaMemcpy(vel, scratchVel, memSize, cudaMemcpyDeviceToDevice));
+			checkCudaErrors(cudaMemcpy(velLeapFrog, scratchVelLeapFrog, memSize, cudaMemcpyDeviceToDevice));
+			if (color) {
+				gatherFloat4D<<< numBlocks, numThreads >>>(
+					(float4 *) scratchPos,
+					(float4 *) color,
+					gridParticleIndex,
+					numParticles);
+				checkCudaErrors(cudaMemcpy(color, scratchPos, memSize, cudaMemcpyDeviceToDevice));
+			}
+			//data is in grid order now, force pass scatters through identity
+			thrust::sequence(thrust::device_ptr<uint>(gridParticleIndex),
+							 thrust::device_ptr<uint>(gridParticleIndex + numParticles));
+	}
+
+	void buildWallField(
+		float* field,
+		float* wallPos,
+		uint   numWallParticles,
+		uint   numFieldNodes,
+		float  gateWall,
+		bool   isGate){
+			uint numThreads, numBlocks;
+			computeGridSize(numFieldNodes, 256, numBlocks, numThreads);
+
+			buildWallFieldD<<< numBlocks, numThreads >>>(
+				(float4*)field,
+				(float4*)wallPos,
+				numWallParticles,
+				gateWall,
+				isGate);
+	}
+
 	void ExtRemoveRightBoundary(
 		float * position,
 		uint numParticles){
@@ -130,6 +291,94 @@ extern "C"
 //			cutilCheckMsg("integrate kernel execution failed");
 	}
 
+	void integrateSubsteps(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float* acc,
+		float* sortedPos,
+		uint*  cellStart,
+		uint*  cellEnd,
+		float  deltaTime,
+		uint   substeps,
+		uint   numParticles,
+		uint   numFluidParticles,
+		uint   numGridCells){
+			uint numThreads, numBlocks;
+			computeGridSize(numFluidParticles, 256, numBlocks, numThreads);
+
+			slowKickD<<< numBlocks, numThreads >>>(
+				(float4*)vel,
+				(float4*)velLeapFrog,
+				(float4*)acc,
+				numFluidParticles);
+
+			#if USE_TEX
+            checkCudaErrors(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
+            checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, 2*numGridCells*sizeof(uint)));
+            checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, 2*numGridCells*sizeof(uint)));
+			#endif
+
+			computeGridSize(numFluidParticles, 64, numBlocks, numThreads);
+			for(uint k = 0; k < substeps; k++)
+				boundarySubstepD<<< numBlocks, numThreads >>>(
+					(float4*)pos,
+					(float4*)vel,
+					(float4*)velLeapFrog,
+					(float4*)sortedPos,
+					cellStart,
+					cellEnd,
+					deltaTime / substeps,
+					k == substeps - 1,
+					numFluidParticles);
+		    
+//			cutilCheckMsg("boundarySubstep kernel execution failed");
+
+			#if USE_TEX
+            checkCudaErrors(cudaUnbindTexture(oldPosTex));
+            checkCudaErrors(cudaUnbindTexture(cellStartTex));
+            checkCudaErrors(cudaUnbindTexture(cellEndTex));
+			#endif
+	}
+
+	void dampVelocity(
+		float* vel,
+		float* velLeapFrog,
+		float factor,
+		uint numFluidParticles){
+			uint numThreads, numBlocks;
+			computeGridSize(numFluidParticles, 256, numBlocks, numThreads);
+
+			dampVelocityD<<< numBlocks, numThreads >>>(
+				(float4*)vel,
+				(float4*)velLeapFrog,
+				factor,
+				numFluidParticles);
+		    
+//			cutilCheckMsg("dampVelocity kernel execution failed");
+	}
+
+	float maxSpeed(
+		float* vel,
+		uint numFluidParticles){
+			thrust::device_ptr<float4> v((float4*)vel);
+			float speed2 = thrust::transform_reduce(v, v + numFluidParticles,
+				speedSquared(), 0.0f, thrust::maximum<float>());
+			return sqrtf(speed2);
+	}
+
+	float minBlockTimeLimit(
+		float* vel,
+		float* acceleration,
+		uint numFluidParticles){
+			thrust::device_ptr<float4> v((float4*)vel);
+			thrust::device_ptr<float4> a((float4*)acceleration);
+			return thrust::transform_reduce(
+				thrust::make_zip_iterator(thrust::make_tuple(v, a)),
+				thrust::make_zip_iterator(thrust::make_tuple(v + numFluidParticles, a + numFluidParticles)),
+				blockTimeLimitOf(), FLT_MAX, thrust::minimum<float>());
+	}
+
 	void calcHash(
 		uint* gridParticleHash,
 		uint* gridParticleIndex,
@@ -195,18 +444,22 @@ extern "C"
 		uint* gridParticleIndex,
 		uint* cellStart,
 		uint* cellEnd,
+		uint* pairCount,
+		uint* pairIndex,
+		float* pairData,
 		uint numParticles,
+		uint numFluidParticles,
 		uint numGridCells){
 			#if USE_TEX
             checkCudaErrors(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
             checkCudaErrors(cudaBindTexture(0, oldMeasuresTex, sortedMeasures, numParticles*sizeof(float4)));
             checkCudaErrors(cudaBindTexture(0, oldVelTex, sortedVel, numParticles*sizeof(float4)));
-            checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, numGridCells*sizeof(uint)));
-            checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, numGridCells*sizeof(uint)));
+            checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, 2*numGridCells*sizeof(uint)));
+            checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, 2*numGridCells*sizeof(uint)));
 			#endif
 
 			uint numThreads, numBlocks;
-			computeGridSize(numParticles, 64, numBlocks, numThreads);
+			computeGridSize(numFluidParticles, 64, numBlocks, numThreads);
 
 			calculateDamBreakDensityD<<< numBlocks, numThreads >>>(										  
 				(float4*)sortedMeasuresOutput,
@@ -216,14 +469,220 @@ extern "C"
 				gridParticleIndex,
 				cellStart,
 				cellEnd,
+				pairCount,
+				pairIndex,
+				(float2*)pairData,
+				numFluidParticles);
+
+//			cutilCheckMsg("Kernel execution failed");
+
+			#if USE_TEX
+            checkCudaErrors(cudaUnbindTexture(oldPosTex));
+            checkCudaErrors(cudaUnbindTexture(oldMeasuresTex));
+            checkCudaErrors(cudaUnbindTexture(oldVelTex));
+            checkCudaErrors(cudaUnbindTexture(cellStartTex));
+            checkCudaErrors(cudaUnbindTexture(cellEndTex));
+			#endif
+	}
+
+	uint buildBuckets(
+		uint*  bucketCount,
+		uint*  bucketSlots,
+		uint*  overflow,
+		float* pos,
+		uint   capacity,
+		uint   numParticles,
+		uint   numGridCells){
+			uint numThreads, numBlocks;
+			computeGridSize(numParticles, 256, numBlocks, numThreads);
+
+			checkCudaErrors(cudaMemset(bucketCount, 0, 2*numGridCells*sizeof(uint)));
+			checkCudaErrors(cudaMemset(overflow, 0, sizeof(uint)));
+			buildBucketsD<<< numBlocks, numThreads >>>(
+				bucketCount,
+				bucketSlots,
+				overflow,
+				(float4*)pos,
+				capacity,
 				numParticles);
 
+//			cutilCheckMsg("Kernel execution failed");
+
+			uint maxCount;
+			checkCudaErrors(cudaMemcpy(&maxCount, overflow, sizeof(uint), cudaMemcpyDeviceToHost));
+			return maxCount;
+	}
+
+	void calculateDamBreakDensityBuckets(
+		float* measures,
+		float* pos,
+		uint*  bucketCount,
+		uint*  bucketSlots,
+		uint   capacity,
+		uint   numParticles,
+		uint   numFluidParticles){
+			#if USE_TEX
+            checkCudaErrors(cudaBindTexture(0, oldPosTex, pos, numParticles*sizeof(float4)));
+			#endif
+
+			uint numThreads, numBlocks;
+			computeGridSize(numFluidParticles, 64, numBlocks, numThreads);
+
+			calculateDamBreakDensityBucketsD<<< numBlocks, numThreads >>>(
+				(float4*)measures,
+				(float4*)pos,
+				bucketCount,
+				bucketSlots,
+				capacity,
+				numFluidParticles);
+
+//			cutilCheckMsg("Kernel execution failed");
+
+			#if USE_TEX
+            checkCudaErrors(cudaUnbindTexture(oldPosTex));
+			#endif
+	}
+
+	void calcAndApplyAccelerationBuckets(
+		float* acceleration,
+		float* measures,
+		float* pos,
+		float* vel,
+		uint*  bucketCount,
+		uint*  bucketSlots,
+		uint   capacity,
+		uint   numParticles,
+		uint   numFluidParticles){
+			#if USE_TEX
+            checkCudaErrors(cudaBindTexture(0, oldPosTex, pos, numParticles*sizeof(float4)));
+            checkCudaErrors(cudaBindTexture(0, oldVelTex, vel, numParticles*sizeof(float4)));
+            checkCudaErrors(cudaBindTexture(0, oldMeasuresTex, measures, numParticles*sizeof(float4)));
+			#endif
+
+			uint numThreads, numBlocks;
+			computeGridSize(numFluidParticles, 64, numBlocks, numThreads);
+
+			calcAndApplyAccelerationBucketsD<<< numBlocks, numThreads >>>(
+				(float4*)acceleration,
+				(float4*)measures,
+				(float4*)pos,
+				(float4*)vel,
+				bucketCount,
+				bucketSlots,
+				capacity,
+				numFluidParticles);
+
 //			cutilCheckMsg("Kernel execution failed");
 
 			#if USE_TEX
             checkCudaErrors(cudaUnbindTexture(oldPosTex));
+            checkCudaErrors(cudaUnbindTexture(oldVelTex));
             checkCudaErrors(cudaUnbindTexture(oldMeasuresTex));
+			#endif
+	}
+
+	void packCompactData(
+		ushort* compactPos,
+		ushort* compactVel,
+		float*  sortedPos,
+		float*  sortedVel,
+		uint    numParticles){
+			uint numThreads, numBlocks;
+			computeGridSize(numParticles, 256, numBlocks, numThreads);
+
+			packCompactDataD<<< numBlocks, numThreads >>>(
+				(ushort4*)compactPos,
+				(ushort4*)compactVel,
+				(float4*)sortedPos,
+				(float4*)sortedVel,
+				numParticles);
+	}
+
+	void calculateDamBreakDensityCompact(
+		float*  sortedMeasuresOutput,
+		ushort* compactMeasuresOutput,
+		float*  sortedPos,
+		ushort* compactPos,
+		uint* cellStart,
+		uint* cellEnd,
+		uint numParticles,
+		uint numFluidParticles,
+		uint numGridCells){
+			#if USE_TEX
+            checkCudaErrors(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
+            checkCudaErrors(cudaBindTexture(0, compactPosTex, compactPos, numParticles*sizeof(ushort4)));
+            checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, 2*numGridCells*sizeof(uint)));
+            checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, 2*numGridCells*sizeof(uint)));
+			#endif
+
+			uint numThreads, numBlocks;
+			computeGridSize(numFluidParticles, 64, numBlocks, numThreads);
+
+			calculateDamBreakDensityCompactD<<< numBlocks, numThreads >>>(
+				(float4*)sortedMeasuresOutput,
+				(ushort2*)compactMeasuresOutput,
+				(float4*)sortedPos,
+				(ushort4*)compactPos,
+				cellStart,
+				cellEnd,
+				numFluidParticles);
+
+			#if USE_TEX
+            checkCudaErrors(cudaUnbindTexture(oldPosTex));
+            checkCudaErrors(cudaUnbindTexture(compactPosTex));
+            checkCudaErrors(cudaUnbindTexture(cellStartTex));
+            checkCudaErrors(cudaUnbindTexture(cellEndTex));
+			#endif
+	}
+
+	void calcAndApplyAccelerationCompact(
+		float*  acceleration,
+		float*  sortedMeasures,
+		ushort* compactMeasures,
+		float*  sortedPos,
+		float*  sortedVel,
+		ushort* compactPos,
+		ushort* compactVel,
+		uint* gridParticleIndex,
+		uint* cellStart,
+		uint* cellEnd,
+		uint numParticles,
+		uint numFluidParticles,
+		uint numGridCells){
+			#if USE_TEX
+            checkCudaErrors(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
+            checkCudaErrors(cudaBindTexture(0, oldVelTex, sortedVel, numParticles*sizeof(float4)));
+            checkCudaErrors(cudaBindTexture(0, oldMeasuresTex, sortedMeasures, numParticles*sizeof(float4)));
+            checkCudaErrors(cudaBindTexture(0, compactPosTex, compactPos, numParticles*sizeof(ushort4)));
+            checkCudaErrors(cudaBindTexture(0, compactVelTex, compactVel, numParticles*sizeof(ushort4)));
+            checkCudaErrors(cudaBindTexture(0, compactMeasuresTex, compactMeasures, numParticles*sizeof(ushort2)));
+            checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, 2*numGridCells*sizeof(uint)));
+            checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, 2*numGridCells*sizeof(uint)));
+			#endif
+
+			uint numThreads, numBlocks;
+			computeGridSize(numFluidParticles, 64, numBlocks, numThreads);
+
+			calcAndApplyAccelerationCompactD<<< numBlocks, numThreads >>>(
+				(float4*)acceleration,
+				(float4*)sortedMeasures,
+				(ushort2*)compactMeasures,
+				(float4*)sortedPos,
+				(float4*)sortedVel,
+				(ushort4*)compactPos,
+				(ushort4*)compactVel,
+				gridParticleIndex,
+				cellStart,
+				cellEnd,
+				numFluidParticles);
+
+			#if USE_TEX
+            checkCudaErrors(cudaUnbindTexture(oldPosTex));
             checkCudaErrors(cudaUnbindTexture(oldVelTex));
+            checkCudaErrors(cudaUnbindTexture(oldMeasuresTex));
+            checkCudaErrors(cudaUnbindTexture(compactPosTex));
+            checkCudaErrors(cudaUnbindTexture(compactVelTex));
+            checkCudaErrors(cudaUnbindTexture(compactMeasuresTex));
             checkCudaErrors(cudaUnbindTexture(cellStartTex));
             checkCudaErrors(cudaUnbindTexture(cellEndTex));
 			#endif
@@ -237,18 +696,22 @@ extern "C"
 		uint* gridParticleIndex,
 		uint* cellStart,
 		uint* cellEnd,
+		uint* pairCount,
+		uint* pairIndex,
+		float* pairData,
 		uint numParticles,
+		uint numFluidParticles,
 		uint numGridCells){
 			#if USE_TEX
             checkCudaErrors(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
             checkCudaErrors(cudaBindTexture(0, oldVelTex, sortedVel, numParticles*sizeof(float4)));
             checkCudaErrors(cudaBindTexture(0, oldMeasuresTex, sortedMeasures, numParticles*sizeof(float4)));
-            checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, numGridCells*sizeof(uint)));
-            checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, numGridCells*sizeof(uint)));
+            checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, 2*numGridCells*sizeof(uint)));
+            checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, 2*numGridCells*sizeof(uint)));
 			#endif
 
 			uint numThreads, numBlocks;
-			computeGridSize(numParticles, 64, numBlocks, numThreads);
+			computeGridSize(numFluidParticles, 64, numBlocks, numThreads);
 
 			calcAndApplyAccelerationD<<< numBlocks, numThreads >>>(
 				(float4*)acceleration,
@@ -258,7 +721,427 @@ extern "C"
 				gridParticleIndex,
 				cellStart,
 				cellEnd,
-				numParticles);
+				0,
+				0,
+				pairCount,
+				pairIndex,
+				(float2*)pairData,
+				numFluidParticles);
+
+//			cutilCheckMsg("Kernel execution failed");
+
+			#if USE_TEX
+            checkCudaErrors(cudaUnbindTexture(oldPosTex));
+            checkCudaErrors(cudaUnbindTexture(oldVelTex));
+            checkCudaErrors(cudaUnbindTexture(oldMeasuresTex));
+            checkCudaErrors(cudaUnbindTexture(cellStartTex));
+            checkCudaErrors(cudaUnbindTexture(cellEndTex));
+			#endif
+	}
+
+	void blockTimeStep(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float* acceleration,
+		float* sortedMeasures,
+		float* heldMeasures,
+		float* sortedPos,
+		float* sortedVel,
+		uint*  level,
+		uint*  pairCount,
+		uint*  gridParticleIndex,
+		uint*  cellStart,
+		uint*  cellEnd,
+		uint   substep,
+		float  substepTime,
+		uint   numParticles,
+		uint   numFluidParticles,
+		uint   numGridCells,
+		double* pairs,
+		double* fullPairs){
+			#if USE_TEX
+            checkCudaErrors(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
+            checkCudaErrors(cudaBindTexture(0, oldVelTex, sortedVel, numParticles*sizeof(float4)));
+            checkCudaErrors(cudaBindTexture(0, oldMeasuresTex, sortedMeasures, numParticles*sizeof(float4)));
+            checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, 2*numGridCells*sizeof(uint)));
+            checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, 2*numGridCells*sizeof(uint)));
+			#endif
+
+			uint numThreads, numBlocks;
+			computeGridSize(numFluidParticles, 64, numBlocks, numThreads);
+
+			blockDensityD<<< numBlocks, numThreads >>>(
+				(float4*)sortedMeasures,
+				(float4*)heldMeasures,
+				pairCount,
+				level,
+				(float4*)sortedPos,
+				(float4*)sortedVel,
+				gridParticleIndex,
+				cellStart,
+				cellEnd,
+				substep,
+				numFluidParticles);
+			if (pairCount)
+				countPairsD<<< numBlocks, numThreads >>>(
+					pairCount + numFluidParticles,
+					(float4*)sortedPos,
+					cellStart,
+					cellEnd,
+					numFluidParticles);
+
+			calcAndApplyAccelerationD<<< numBlocks, numThreads >>>(
+				(float4*)acceleration,
+				(float4*)sortedMeasures,
+				(float4*)sortedPos,
+				(float4*)sortedVel,
+				gridParticleIndex,
+				cellStart,
+				cellEnd,
+				level,
+				substep,
+				0,
+				0,
+				0,
+				numFluidParticles);
+
+			#if USE_TEX
+            checkCudaErrors(cudaUnbindTexture(oldPosTex));
+            checkCudaErrors(cudaUnbindTexture(oldVelTex));
+            checkCudaErrors(cudaUnbindTexture(oldMeasuresTex));
+            checkCudaErrors(cudaUnbindTexture(cellStartTex));
+            checkCudaErrors(cudaUnbindTexture(cellEndTex));
+			#endif
+
+			computeGridSize(numFluidParticles, 256, numBlocks, numThreads);
+			blockIntegrateD<<< numBlocks, numThreads >>>(
+				(float4*)pos,
+				(float4*)vel,
+				(float4*)velLeapFrog,
+				(float4*)acceleration,
+				level,
+				substep,
+				substepTime,
+				numFluidParticles);
+
+//			cutilCheckMsg("Kernel execution failed");
+
+			if (!pairCount)
+				return;
+			thrust::device_ptr<uint> count(pairCount);
+			*pairs += (double)thrust::reduce(count, count + numFluidParticles, 0ull);
+			*fullPairs += (double)thrust::reduce(count + numFluidParticles, count + 2 * numFluidParticles, 0ull);
+	}
+
+	void resetRefinement(
+		uint*  children,
+		uint   numFluidParticles){
+			checkCudaErrors(cudaMemset(children, 0xff, numFluidParticles*4*sizeof(uint)));
+	}
+
+	void fillWallMeasures(
+		float* sortedMeasures,
+		float  restDensity,
+		uint   numActiveFluidParticles,
+		uint   numWallParticles){
+			thrust::device_ptr<float4> measures((float4*)sortedMeasures);
+			thrust::fill(measures + numActiveFluidParticles,
+				measures + numActiveFluidParticles + numWallParticles,
+				make_float4(restDensity, 0.0f, 0.0f, 0.0f));
+	}
+
+	uint refineParticles(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float* acceleration,
+		uint*  children,
+		uint*  flags,
+		uint*  splitRank,
+		uint*  freeSlots,
+		float* sortedPos,
+		float* sortedVel,
+		uint*  gridParticleIndex,
+		uint*  cellStart,
+		uint*  cellEnd,
+		float  splitRatio,
+		float  mergeRatio,
+		uint   numParticles,
+		uint   numActiveFluidParticles,
+		uint   numFluidParticles,
+		uint   numGridCells){
+			#if USE_TEX
+            checkCudaErrors(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
+            checkCudaErrors(cudaBindTexture(0, oldVelTex, sortedVel, numParticles*sizeof(float4)));
+            checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, 2*numGridCells*sizeof(uint)));
+            checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, 2*numGridCells*sizeof(uint)));
+			#endif
+
+			checkCudaErrors(cudaMemset(flags, 0, numFluidParticles*sizeof(uint)));
+
+			uint numThreads, numBlocks;
+			computeGridSize(numActiveFluidParticles, 64, numBlocks, numThreads);
+			markRefinementD<<< numBlocks, numThreads >>>(
+				flags,
+				(float4*)sortedPos,
+				(float4*)sortedVel,
+				gridParticleIndex,
+				cellStart,
+				cellEnd,
+				splitRatio,
+				mergeRatio,
+				numActiveFluidParticles);
+
+			#if USE_TEX
+            checkCudaErrors(cudaUnbindTexture(oldPosTex));
+            checkCudaErrors(cudaUnbindTexture(oldVelTex));
+            checkCudaErrors(cudaUnbindTexture(cellStartTex));
+            checkCudaErrors(cudaUnbindTexture(cellEndTex));
+			#endif
+
+			computeGridSize(numFluidParticles, 256, numBlocks, numThreads);
+			mergeParticlesD<<< numBlocks, numThreads >>>(
+				(float4*)pos,
+				(float4*)vel,
+				(float4*)velLeapFrog,
+				(float4*)acceleration,
+				(uint4*)children,
+				flags,
+				numFluidParticles);
+
+			//free slots after merging, then one rank per split candidate
+			thrust::device_ptr<float4> p((float4*)pos);
+			thrust::device_ptr<uint> f(flags);
+			thrust::device_ptr<uint> freeBegin(freeSlots);
+			thrust::device_ptr<uint> freeEnd = thrust::copy_if(
+				thrust::counting_iterator<uint>(0),
+				thrust::counting_iterator<uint>(numFluidParticles),
+				p, freeBegin, isInactiveSlot());
+			thrust::transform_exclusive_scan(f, f + numFluidParticles,
+				thrust::device_ptr<uint>(splitRank), isSplitFlag(), 0u, thrust::plus<uint>());
+
+			splitParticlesD<<< numBlocks, numThreads >>>(
+				(float4*)pos,
+				(float4*)vel,
+				(float4*)velLeapFrog,
+				(float4*)acceleration,
+				(uint4*)children,
+				flags,
+				splitRank,
+				freeSlots,
+				(uint)(freeEnd - freeBegin),
+				numFluidParticles);
+
+//			cutilCheckMsg("Kernel execution failed");
+
+			return thrust::count_if(p, p + numFluidParticles, isFluidSlot());
+	}
+
+	uint selectParticles(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float* records,
+		float  xMin,
+		float  xMax,
+		uint   numFluidParticles){
+			thrust::device_ptr<float4> p((float4*)pos);
+			thrust::device_ptr<float4> v((float4*)vel);
+			thrust::device_ptr<float4> l((float4*)velLeapFrog);
+			thrust::device_ptr<float4> r((float4*)records);
+			//structure of arrays, each part sized for all fluid slots
+			thrust::zip_iterator<thrust::tuple<thrust::device_ptr<float4>, thrust::device_ptr<float4>,
+				thrust::device_ptr<float4> > > end = thrust::copy_if(
+				thrust::make_zip_iterator(thrust::make_tuple(p, v, l)),
+				thrust::make_zip_iterator(thrust::make_tuple(p + numFluidParticles, v + numFluidParticles, l + numFluidParticles)),
+				thrust::make_zip_iterator(thrust::make_tuple(r, r + numFluidParticles, r + 2 * numFluidParticles)),
+				isOwnedInSlab(xMin, xMax));
+			uint count = thrust::get<0>(end.get_iterator_tuple()) - r;
+			//pack velocities behind the positions
+			thrust::copy(r + numFluidParticles, r + numFluidParticles + count, r + count);
+			thrust::copy(r + 2 * numFluidParticles, r + 2 * numFluidParticles + count, r + 2 * count);
+			return count;
+	}
+
+	void retypeParticles(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float  fromType,
+		float  toType,
+		float  xMin,
+		float  xMax,
+		uint   numFluidParticles){
+			uint numThreads, numBlocks;
+			computeGridSize(numFluidParticles, 256, numBlocks, numThreads);
+			retypeParticlesD<<< numBlocks, numThreads >>>(
+				(float4*)pos,
+				(float4*)vel,
+				(float4*)velLeapFrog,
+				fromType,
+				toType,
+				xMin,
+				xMax,
+				numFluidParticles);
+	}
+
+	uint insertParticles(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float* records,
+		uint*  freeSlots,
+		float  type,
+		uint   count,
+		uint   numFluidParticles){
+			thrust::device_ptr<float4> p((float4*)pos);
+			thrust::device_ptr<uint> freeBegin(freeSlots);
+			thrust::device_ptr<uint> freeEnd = thrust::copy_if(
+				thrust::counting_iterator<uint>(0),
+				thrust::counting_iterator<uint>(numFluidParticles),
+				p, freeBegin, isInactiveSlot());
+			count = min(count, (uint)(freeEnd - freeBegin));
+			if (count == 0)
+				return 0;
+
+			uint numThreads, numBlocks;
+			computeGridSize(count, 256, numBlocks, numThreads);
+			insertParticlesD<<< numBlocks, numThreads >>>(
+				(float4*)pos,
+				(float4*)vel,
+				(float4*)velLeapFrog,
+				(float4*)records,
+				freeSlots,
+				type,
+				count);
+			return count;
+	}
+
+	uint countActiveParticles(
+		float* pos,
+		uint   numFluidParticles){
+			thrust::device_ptr<float4> p((float4*)pos);
+			return thrust::count_if(p, p + numFluidParticles, isActiveSlot());
+	}
+
+	float deterministicSum(
+		float* values,
+		float* scratch,
+		uint   n){
+			//ping-pong between the two halves of scratch, in is never overwritten
+			float* in = values;
+			float* out = scratch;
+			float* other = scratch + iDivUp(n, SUM_BLOCK_SIZE);
+			while (n > 1) {
+				uint numBlocks = iDivUp(n, SUM_BLOCK_SIZE);
+				blockSumD<<< numBlocks, SUM_BLOCK_SIZE >>>(out, in, n);
+				in = out;
+				out = (in == scratch) ? other : scratch;
+				n = numBlocks;
+			}
+			float sum = 0.0f;
+			if (n == 1)
+				checkCudaErrors(cudaMemcpy(&sum, in, sizeof(float), cudaMemcpyDeviceToHost));
+			return sum;
+	}
+
+	uint solveIisphPressure(
+		float* acceleration,
+		float* velocity,
+		float* velLeapFrog,
+		float* sortedMeasures,
+		float* sortedPos,
+		float* sortedVel,
+		float* velAdv,
+		float* pressureAcc,
+		float* error,
+		uint* gridParticleIndex,
+		uint* cellStart,
+		uint* cellEnd,
+		uint numParticles,
+		uint numFluidParticles,
+		uint numGridCells,
+		float tolerance,
+		uint minIterations,
+		uint maxIterations,
+		float* sumScratch,
+		float* densityError){
+			#if USE_TEX
+            checkCudaErrors(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
+            checkCudaErrors(cudaBindTexture(0, oldVelTex, sortedVel, numParticles*sizeof(float4)));
+            checkCudaErrors(cudaBindTexture(0, oldMeasuresTex, sortedMeasures, numParticles*sizeof(float4)));
+            checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, 2*numGridCells*sizeof(uint)));
+            checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, 2*numGridCells*sizeof(uint)));
+			#endif
+
+			uint numThreads, numBlocks;
+			computeGridSize(numFluidParticles, 64, numBlocks, numThreads);
+
+			iisphPredictAdvectionD<<< numBlocks, numThreads >>>(
+				(float4*)velAdv,
+				(float4*)acceleration,
+				(float4*)velocity,
+				(float4*)sortedMeasures,
+				(float4*)sortedPos,
+				(float4*)sortedVel,
+				gridParticleIndex,
+				cellStart,
+				cellEnd,
+				numFluidParticles);
+
+			iisphSourceD<<< numBlocks, numThreads >>>(
+				(float4*)sortedMeasures,
+				(float4*)velAdv,
+				(float4*)sortedPos,
+				(float4*)sortedVel,
+				cellStart,
+				cellEnd,
+				numFluidParticles);
+
+			thrust::device_ptr<float> errorPtr(error);
+			uint iterations = 0;
+			do {
+				iisphPressureAccelerationD<<< numBlocks, numThreads >>>(
+					(float4*)pressureAcc,
+					(float4*)sortedMeasures,
+					(float4*)sortedPos,
+					cellStart,
+					cellEnd,
+					numFluidParticles);
+
+				iisphPressureUpdateD<<< numBlocks, numThreads >>>(
+					(float4*)sortedMeasures,
+					error,
+					(float4*)pressureAcc,
+					(float4*)velAdv,
+					(float4*)sortedPos,
+					cellStart,
+					cellEnd,
+					numFluidParticles);
+
+				if (sumScratch)
+					*densityError = deterministicSum(error, sumScratch, numFluidParticles) / numFluidParticles;
+				else
+					*densityError = thrust::reduce(errorPtr, errorPtr + numFluidParticles) / numFluidParticles;
+				iterations++;
+			} while ((*densityError > tolerance || iterations < minIterations) && iterations < maxIterations);
+
+			iisphPressureAccelerationD<<< numBlocks, numThreads >>>(
+				(float4*)pressureAcc,
+				(float4*)sortedMeasures,
+				(float4*)sortedPos,
+				cellStart,
+				cellEnd,
+				numFluidParticles);
+
+			iisphApplyPressureD<<< numBlocks, numThreads >>>(
+				(float4*)acceleration,
+				(float4*)velLeapFrog,
+				(float4*)pressureAcc,
+				(float4*)sortedMeasures,
+				gridParticleIndex,
+				numFluidParticles);
 
 //			cutilCheckMsg("Kernel execution failed");
 
@@ -269,6 +1152,7 @@ extern "C"
             checkCudaErrors(cudaUnbindTexture(cellStartTex));
             checkCudaErrors(cudaUnbindTexture(cellEndTex));
 			#endif
+			return iterations;
 	}
 }// extern "C"
 
@@ -10,6 +10,7 @@ extern "C"
 	void allocateArray(void **devPtr, int size);
 	void freeArray(void *devPtr);	
 	void copyArrayToDevice(void* device, const void* host, int offset, int size);
+	void copyArrayFromDevice(void* host, const void* device, int offset, int size);
 	void computeGridSize(uint n, uint blockSize, uint &numBlocks, uint &numThreads);
 
 	void setParameters(SimParams *hostParams);
@@ -21,6 +22,39 @@ extern "C"
 		float* acc,
 		uint numParticles);
 
+	// kick with the full pass forces over deltaTime, then wall forces on
+	// substeps against the sorted wall particles of the full pass
+	void integrateSubsteps(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float* acc,
+		float* sortedPos,
+		uint*  cellStart,
+		uint*  cellEnd,
+		float  deltaTime,
+		uint   substeps,
+		uint   numParticles,
+		uint   numFluidParticles,
+		uint   numGridCells);
+
+	void dampVelocity(
+		float* vel,
+		float* velLeapFrog,
+		float factor,
+		uint numFluidParticles);
+
+	// largest fluid particle speed
+	float maxSpeed(
+		float* vel,
+		uint numFluidParticles);
+
+	// smallest Courant and force limit of the fluid particles, block time stepping
+	float minBlockTimeLimit(
+		float* vel,
+		float* acceleration,
+		uint numFluidParticles);
+
 	void calcHash(
 		uint*  gridParticleHash,
 		uint*  gridParticleIndex,
@@ -28,12 +62,51 @@ extern "C"
 		int    numParticles);
 
 	void ExtChangeRightBoundary(float* position, int numParticles);
+
+	void buildWallField(
+		float* field,
+		float* wallPos,
+		uint   numWallParticles,
+		uint   numFieldNodes,
+		float  gateWall,
+		bool   isGate);
 	void ExtRemoveRightBoundary(float* position, int numParticles);
 
 	void sortParticles(
 		uint *dHash,
 		uint *dIndex,
 		uint numParticles);
+
+	void calcHashPersistent(
+		uint*  gridParticleHash,
+		uint*  gridParticleIndex,
+		uint*  moved,
+		float* pos,
+		int    numParticles);
+
+	uint incrementalSortParticles(
+		uint *dHash,
+		uint *dIndex,
+		uint *dHashScratch,
+		uint *dIndexScratch,
+		uint *dMoved,
+		uint numParticles);
+
+	void reorderPersistentData(
+		uint*  cellStart,
+		uint*  cellEnd,
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float* color,
+		float* scratchPos,
+		float* scratchVel,
+		float* scratchVelLeapFrog,
+		uint*  gridParticleHash,
+		uint*  gridParticleIndex,
+		bool   permute,
+		uint   numParticles,
+		uint   numCells);
 	
 	void reorderDataAndFindCellStart(
 		uint*  cellStart,
@@ -47,6 +120,10 @@ extern "C"
 		uint   numParticles,
 		uint   numCells);	
 
+	// density and force passes run over the fluid head of the sorted list,
+	// cellStart/cellEnd hold 2 * numGridCells entries (fluid, then boundary ranges).
+	// With a pair cache (PAIR_CACHE_SIZE * numFluidParticles slots, 0 for none)
+	// the density pass records fluid pairs and the force pass reads them back.
 	void calculateDamBreakDensity(			
 		float* measures,
 		float* measuresInput,
@@ -55,7 +132,11 @@ extern "C"
 		uint* gridParticleIndex,
 		uint* cellStart,
 		uint* cellEnd,
+		uint* pairCount,
+		uint* pairIndex,
+		float* pairData,
 		uint numParticles,
+		uint numFluidParticles,
 		uint numGridCells);
 
 	void calcAndApplyAcceleration(	
@@ -66,7 +147,207 @@ extern "C"
 		uint* gridParticleIndex,
 		uint* cellStart,
 		uint* cellEnd,
+		uint* pairCount,
+		uint* pairIndex,
+		float* pairData,
+		uint numParticles,
+		uint numFluidParticles,
+		uint numGridCells);
+
+	// Sort free neighbour structure: fixed capacity buckets per sort key,
+	// capacity slots each, filled in one pass with atomics. Returns 0, or the
+	// largest bucket count when some bucket overflowed (insert again with more).
+	uint buildBuckets(
+		uint*  bucketCount,
+		uint*  bucketSlots,
+		uint*  overflow,
+		float* pos,
+		uint   capacity,
+		uint   numParticles,
+		uint   numGridCells);
+
+	// density and force passes on the buckets, particle order, fluid slots only
+	void calculateDamBreakDensityBuckets(
+		float* measures,
+		float* pos,
+		uint*  bucketCount,
+		uint*  bucketSlots,
+		uint   capacity,
+		uint   numParticles,
+		uint   numFluidParticles);
+
+	void calcAndApplyAccelerationBuckets(
+		float* acceleration,
+		float* measures,
+		float* pos,
+		float* vel,
+		uint*  bucketCount,
+		uint*  bucketSlots,
+		uint   capacity,
+		uint   numParticles,
+		uint   numFluidParticles);
+
+	void packCompactData(
+		ushort* compactPos,
+		ushort* compactVel,
+		float*  sortedPos,
+		float*  sortedVel,
+		uint    numParticles);
+
+	void calculateDamBreakDensityCompact(
+		float*  measures,
+		ushort* compactMeasures,
+		float*  sortedPos,
+		ushort* compactPos,
+		uint* cellStart,
+		uint* cellEnd,
 		uint numParticles,
+		uint numFluidParticles,
 		uint numGridCells);
+
+	void calcAndApplyAccelerationCompact(
+		float*  acceleration,
+		float*  measures,
+		ushort* compactMeasures,
+		float*  sortedPos,
+		float*  sortedVel,
+		ushort* compactPos,
+		ushort* compactVel,
+		uint* gridParticleIndex,
+		uint* cellStart,
+		uint* cellEnd,
+		uint numParticles,
+		uint numFluidParticles,
+		uint numGridCells);
+
+	// one substep of block time stepping on sorted data: density and forces
+	// of the active particles, kick of the active and drift of all particles;
+	// with pairCount, adds neighbour pairs visited and, from a separate
+	// diagnostic pass, those of an all active substep; 0 skips both
+	void blockTimeStep(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float* acceleration,
+		float* sortedMeasures,
+		float* heldMeasures,
+		float* sortedPos,
+		float* sortedVel,
+		uint*  level,
+		uint*  pairCount,
+		uint*  gridParticleIndex,
+		uint*  cellStart,
+		uint*  cellEnd,
+		uint   substep,
+		float  substepTime,
+		uint   numParticles,
+		uint   numFluidParticles,
+		uint   numGridCells,
+		double* pairs,
+		double* fullPairs);
+
+	// adaptive refinement: families are cleared, walls of the sorted list get
+	// rest density measures after the number of active fluid particles changed
+	void resetRefinement(
+		uint*  children,
+		uint   numFluidParticles);
+
+	void fillWallMeasures(
+		float* sortedMeasures,
+		float  restDensity,
+		uint   numActiveFluidParticles,
+		uint   numWallParticles);
+
+	// merges and splits fluid particles from the last sorted state, returns
+	// the new number of active fluid particles
+	uint refineParticles(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float* acceleration,
+		uint*  children,
+		uint*  flags,
+		uint*  splitRank,
+		uint*  freeSlots,
+		float* sortedPos,
+		float* sortedVel,
+		uint*  gridParticleIndex,
+		uint*  cellStart,
+		uint*  cellEnd,
+		float  splitRatio,
+		float  mergeRatio,
+		uint   numParticles,
+		uint   numActiveFluidParticles,
+		uint   numFluidParticles,
+		uint   numGridCells);
+
+	// subdomains: records are positions, velocities and leapfrog velocities
+	// of count particles one after another, the buffer holds 3 * numFluidParticles
+	uint selectParticles(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float* records,
+		float  xMin,
+		float  xMax,
+		uint   numFluidParticles);
+
+	void retypeParticles(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float  fromType,
+		float  toType,
+		float  xMin,
+		float  xMax,
+		uint   numFluidParticles);
+
+	// returns the number of particles placed, limited by the free slots
+	uint insertParticles(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float* records,
+		uint*  freeSlots,
+		float  type,
+		uint   count,
+		uint   numFluidParticles);
+
+	uint countActiveParticles(
+		float* pos,
+		uint   numFluidParticles);
+
+	// implicit incompressible pressure solve over the fluid head of the
+	// sorted list; expects densities from calculateDamBreakDensity, adds
+	// non-pressure and pressure parts into acceleration and returns the
+	// number of Jacobi iterations, densityError is the mean compression left
+	uint solveIisphPressure(
+		float* acceleration,
+		float* velocity,
+		float* velLeapFrog,
+		float* sortedMeasures,
+		float* sortedPos,
+		float* sortedVel,
+		float* velAdv,
+		float* pressureAcc,
+		float* error,
+		uint* gridParticleIndex,
+		uint* cellStart,
+		uint* cellEnd,
+		uint numParticles,
+		uint numFluidParticles,
+		uint numGridCells,
+		float tolerance,
+		uint minIterations,
+		uint maxIterations,
+		float* sumScratch,    // 0 for thrust::reduce, else the deterministic sum
+		float* densityError);
+
+	// sum with a fixed pairwise tree over blocks of 256, bitwise the same on
+	// any device; scratch holds 2 * ceil(n / 256) floats
+	float deterministicSum(
+		float* values,
+		float* scratch,
+		uint   n);
 }//extern "C"
 #endif
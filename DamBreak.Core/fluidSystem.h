@@ -3,6 +3,9 @@
 
 #include "fluid_kernel.cuh"
 #include "vector_functions.h"
+#include <string>
+
+class StopWatchInterface;
 class DamBreakSystem
 {
 public:
@@ -11,7 +14,8 @@ public:
 		int boundaryOffset,
 		uint3 gridSize,
 		float particleRadius,
-		bool bUseOpenGL);
+		bool bUseOpenGL,
+		BoundaryModel boundaryModel = ParticleWalls);
 	~DamBreakSystem();
 
 	enum ParticleArray
@@ -23,11 +27,164 @@ public:
 		VELOCITYLEAPFROG,
 	};
 
+	enum PressureSolver
+	{
+		WeaklyCompressible,     //Tait equation of state, fixed deltaTime
+		ImplicitIncompressible, //IISPH, deltaTime follows the flow speed
+	};
+
 	void update();
 	void reset();
+
+	// reset() places the column with the hydrostatic density profile of the
+	// equation of state instead of the uniform lattice
+	void setHydrostaticInit(bool enable) { IsHydrostaticInit = enable; }
+	bool isHydrostaticInit() const { return IsHydrostaticInit; }
+
+	// brings the column to rest after reset(): plain steps up to relaxTime for
+	// the uniform lattice, damped steps until the fluid is still for the
+	// hydrostatic start. Elapsed time is relaxTime afterwards in both cases.
+	uint relax(float relaxTime);
+	float getMaxFluidSpeed();
+
+	// the implicit solver needs ParticleWalls, runs on float neighbour data
+	// and keeps the last pressure of each particle in velLeapFrog.w
+	void setPressureSolver(PressureSolver pressureSolver);
+	PressureSolver getPressureSolver() const { return solver; }
+	uint getSolverIterations() const { return solverIterations; }  // last step
+	uint getTotalSolverIterations() const { return totalSolverIterations; }
+	float getDensityError() const { return densityError; }         // mean compression left, last step
+	uint getStepCount() const { return stepCount; }
+
+	// Density and force sums run one thread per particle over the neighbour
+	// cells in a fixed order, and particles of a cell are in index order after
+	// the stable sort, so they do not depend on the launch configuration.
+	// Deterministic mode also replaces the float reductions (the implicit
+	// solver's density error) by a fixed pairwise tree, which makes runs
+	// bitwise repeatable run to run on one device; other devices and compiler
+	// flags may round differently. Costs one extra pass over the error array
+	// per solver iteration; the weakly compressible step has no float
+	// reduction and runs unchanged. Not with the bucket grid, which fills its
+	// buckets with atomics.
+	void setDeterministic(bool enable);
+	bool isDeterministic() const { return IsDeterministic; }
+
+	// multiple time stepping: wall forces are integrated on substeps, the full
+	// neighbour pass runs once per deltaTime; with the weakly compressible
+	// solver deltaTime becomes substeps * 1e-4, the wall force step stays 1e-4
+	void setBoundarySubsteps(uint substeps);
+	uint getBoundarySubsteps() const { return params.boundarySubsteps; }
+	float getDeltaTime() const { return params.deltaTime; }
+
+	// block time stepping: every step is 2^levels substeps of the smallest
+	// Courant and force limit of the fluid, each fluid particle is recomputed
+	// every 2^l substeps with l from its own limits; 0 switches it off.
+	// Weakly compressible solver, float neighbour data, gather ordering and
+	// no pair cache only.
+	void setBlockTimeStepping(uint levels);
+	uint getBlockLevels() const { return params.blockLevels; }
+	// fluid particles on each level after the last step, blockLevels + 1 counts
+	void getLevelHistogram(uint* counts);
+	// pair counts for reports, an extra neighbour pass per substep; off by default
+	void setPairCounting(bool enable) { IsPairCounting = enable; }
+	bool isPairCounting() const { return IsPairCounting; }
+	double getPairEvaluations() const { return pairEvaluations; }         // neighbour pairs visited
+	double getFullPairEvaluations() const { return fullPairEvaluations; } // same substeps, all particles active
+
+	// adaptive refinement: fluid particles near the free surface split into
+	// four with half the smoothing length and merge back in the bulk. Spare
+	// slots are reserved after the column, so this reallocates the particle
+	// arrays and must be called before reset(); deltaTime halves. Weakly
+	// compressible solver, wall particles and float neighbour data only.
+	void setAdaptiveRefinement(bool enable);
+	bool isAdaptiveRefinement() const { return params.adaptiveRefinement != 0; }
+	uint getNumActiveFluidParticles() const { return numActiveFluidParticles; }
+
+	// domain decomposition: this system owns the fluid with x in [xMin, xMax),
+	// the rest of the column starts as free slots. Reallocates, call before
+	// reset(); called again on a running system it only moves the bounds and
+	// particles outside leave with the next migrating export. Weakly
+	// compressible solver, wall particles, no GL and none of the other step
+	// options. Records are count positions, velocities and leapfrog
+	// velocities one after another, 12 * numFluidParticles floats max.
+	void setSubdomain(float xMin, float xMax);
+	bool isSubdomain() const { return IsSubdomain; }
+	// copies owned fluid with x in [xMin, xMax), migrate frees their slots
+	uint exportParticles(float xMin, float xMax, bool migrate, float* records);
+	// owned fluid, or halo copies that take part in density and forces only;
+	// returns the number inserted, less than count when the free slots run out
+	uint importParticles(const float* records, uint count, bool halo);
+	void clearHalo();
+
+	// keeps particle arrays in grid order between steps, particle indices are not stable;
+	// colours are permuted with the particles. Not with the bucket grid, block
+	// steps or the pair cache.
+	void setPersistentOrdering(bool enable);
+	bool isPersistentOrdering() const { return IsPersistentOrdering; }
+
+	// density and force passes read 16 bit cell relative positions and half
+	// precision velocity/measures of neighbours, sums stay in float; weakly
+	// compressible solver only
+	void setCompactNeighbourData(bool enable);
+	bool isCompactNeighbourData() const { return IsCompactNeighbourData; }
+
+	// the density pass keeps the fluid pairs inside the support (neighbour,
+	// distance, dW/dr) and the force pass streams through them instead of
+	// searching the cells again; wall forces still visit the wall cells.
+	// PAIR_CACHE_SIZE slots per fluid particle, a particle with more pairs
+	// falls back to the cell search. Used by the plain weakly compressible
+	// step, the implicit solver, block steps and compact data run without it.
+	// Changes the force summation order, results are close, not bitwise equal.
+	void setPairCache(bool enable);
+	bool isPairCache() const { return IsPairCache; }
+	size_t getPairCacheBytes() const;
+
+	// Sort free neighbour structure: particles go into fixed capacity cell
+	// buckets with atomic increments in one pass, density and forces run in
+	// particle order on them. The capacity starts at 8 and doubles when a
+	// bucket overflows. Order inside a bucket follows the atomics, so sums
+	// are not bitwise repeatable. Weakly compressible solver with none of the
+	// other step options, not in deterministic mode.
+	void setBucketGrid(bool enable);
+	bool isBucketGrid() const { return IsBucketGrid; }
+	uint getBucketCapacity() const { return bucketCapacity; }
+	size_t getBucketGridBytes() const;
+
+	// wall clock seconds of neighbour structure rebuild, density and force
+	// passes of the weakly compressible step; synchronises after each phase
+	enum NeighbourPhase
+	{
+		RebuildPhase,
+		DensityPhase,
+		ForcePhase,
+		NeighbourPhases,
+	};
+	void setNeighbourTiming(bool enable);
+	bool isNeighbourTiming() const { return IsNeighbourTiming; }
+	double getNeighbourSeconds(NeighbourPhase phase) const { return neighbourSeconds[phase]; }
 	
 	void   setArray(ParticleArray array, const float* data, int start, int count);
 
+	// Host copies of the particle state backed by the files prefix.pos, .vel,
+	// .measures, .acc and .velLeapFrog: the host side of a large run lives in
+	// the page cache instead of the heap, 0 goes back to heap arrays.
+	// Reallocates, call before reset() or restoreState(). POSIX only: false
+	// and heap arrays kept elsewhere. The device arrays still hold the whole
+	// state while stepping.
+	bool setStateFiles(const char* prefix);
+	bool isMappedState() const { return IsMappedState; }
+	// particles per chunk of checkpoint() and restoreState(), 64k by default;
+	// 16 bytes each, so the chunk has to be a page multiple
+	void setStateChunkParticles(uint count);
+	// Device state into the files plus prefix.meta, chunk by chunk. On Linux
+	// the write-back of a chunk runs while the next one is copied and written
+	// chunks are dropped from the page cache; elsewhere the files are written
+	// at the end. With persistent ordering the arrays are in grid order, so a
+	// chunk is a compact piece of the tank. No GL.
+	void checkpoint();
+	// instead of reset(): loads the last checkpoint, reading one chunk ahead
+	void restoreState();
+
 	int getNumParticles() const { return numParticles; }
 	float getElapsedTime() const { return elapsedTime; }
 	float getHalfWorldXSize() {return params.gridSize.x * params.particleRadius;}
@@ -50,10 +207,12 @@ public:
 	void removeRightBoundary();
 
 	float getParticleRadius() { return params.particleRadius; }
+	float getSmoothingRadius() { return params.smoothingRadius; }
 	uint3 getGridSize() { return params.gridSize; }
 	float3 getWorldOrigin() { return params.worldOrigin; }
 	float3 getCellSize() { return params.cellSize; }
 	float3 getGravity() {return params.gravity;}
+	BoundaryModel getBoundaryModel() const { return (BoundaryModel)params.boundaryModel; }
 protected: // methods
 	DamBreakSystem() {}
 	uint createVBO(uint size);
@@ -62,13 +221,72 @@ protected: // methods
 	void _finalize();
 
 	void initFluid(uint *size, float spacing, float jitter, uint numParticles);
-	void initBoundaryParticles(float spacing);	
+	void initBoundaryParticles(float spacing, float* position, int firstIndex);	
+	void buildWallFields(float spacing);
+	void updateBlockSteps(float* dPos);
+	void refine(float* dPos);
+	void resizeFluidCapacity(uint capacity);
+	void updateActiveCount();
+	void allocateOrderingBuffers();
+	void freeOrderingBuffers();
+	void allocateCompactData();
+	void freeCompactData();
+	void allocateImplicitSolver();
+	void freeImplicitSolver();
+	void allocateBlockSteps();
+	void freeBlockSteps();
+	void allocateRefinement();
+	void freeRefinement();
+	void allocateExchange();
+	void freeExchange();
+	void allocatePairCache();
+	void freePairCache();
+	void allocateBucketGrid();
+	void freeBucketGrid();
+	void buildBucketGrid(float* dPos);
+	void startPhases();
+	void timePhase(NeighbourPhase phase);
+	void clearHostState();
+	float* allocateHostArray(ParticleArray array);
+	void freeHostArray(float* data);
+	float* hostArray(ParticleArray array);
+	float* deviceArray(ParticleArray array);
+	void adviseState(float* data, uint start, uint count, int advice);
 
 protected: // data
 	bool IsInitialized, IsOpenGL;
+	bool IsPersistentOrdering; // particle arrays are kept in grid order between steps
+	bool IsOrdered;            // arrays are currently sorted, incremental re-sort is possible
+	bool IsCompactNeighbourData;
+	bool IsHydrostaticInit;
+	bool IsSubdomain;
+	bool IsDeterministic;
+	bool IsPairCache;
+	bool IsBucketGrid;
+	bool IsNeighbourTiming;
+	bool IsPairCounting;
+	bool IsMappedState;       // host arrays are file mappings
+	std::string statePrefix;
+	uint stateChunkParticles;
+	float subdomainMin, subdomainMax;
 	uint numParticles;
+	uint numFluidParticles;   // fluid particles come first in particle and sorted arrays
+	uint numActiveFluidParticles; // less than numFluidParticles with free refinement slots
+	uint numWallParticles;    // wall lattice size, not simulated with DistanceFieldWalls
 	uint3 fluidParticlesSize;	
-	float elapsedTime;
+	sph_accum elapsedTime;    // double unless the float policy is built
+	uint stepCount;
+
+	PressureSolver solver;
+	uint solverIterations;
+	uint totalSolverIterations;
+	float densityError;
+
+	double pairEvaluations;
+	double fullPairEvaluations;
+
+	StopWatchInterface* phaseTimer; // wall clock, created with the timing
+	double neighbourSeconds[NeighbourPhases];
 
 	// CPU data
 	float* hPos;              // particle positions
@@ -93,9 +311,55 @@ protected: // data
 	// grid data for sorting method
 	uint*  dHash; // grid hash value for each particle
 	uint*  dIndex;// particle index for each particle
-	uint*  dCellStart;        // index of start of each cell in sorted list
+	uint*  dCellStart;        // index of start of each cell in sorted list, fluid cells then boundary cells
 	uint*  dCellEnd;          // index of end of cell
 
+	// persistent ordering
+	uint*  dMoved;            // 1 if particle changed cell since last step
+	uint*  dHashScratch;
+	uint*  dIndexScratch;
+	float* dPermuteScratch;
+
+	// implicit solver, sorted order
+	float* dIisphVelAdv;      // advected velocity, a_ii
+	float* dIisphPressureAcc;
+	float* dIisphError;
+	float* dSumScratch;       // deterministic reductions
+
+	// block time stepping
+	uint*  dLevel;            // time step level of each particle
+	float* dBlockMeasures;    // measures of the last active substep, particle order
+	uint*  dPairCount;        // pairs per sorted particle: visited, all active
+
+	// pair cache, sorted order, slot k of particle i at k * numActiveFluidParticles + i
+	uint*  dPairCache;        // pairs per particle, 0 if the cache is off
+	uint*  dPairIndex;
+	float* dPairData;         // float2: distance, dW/dr
+
+	// bucket grid, 2 * numGridCells buckets of bucketCapacity particle indices
+	uint   bucketCapacity;
+	uint*  dBucketCount;
+	uint*  dBucketSlots;
+	uint*  dBucketOverflow;
+
+	// adaptive refinement, particle order
+	uint*  dChildren;         // uint4: slots of the other three children of a split particle
+	uint*  dRefineFlags;
+	uint*  dSplitRank;
+	uint*  dFreeSlots;
+
+	// domain decomposition
+	float* dExchange;         // exchange records, 3 * numFluidParticles float4
+
+	// distance field walls
+	float* dTankField;
+	float* dGateField;
+
+	// compact neighbour data, sorted order
+	ushort* dCompactPos;      // ushort4: offset inside cell, type
+	ushort* dCompactVel;      // ushort4: half velocity
+	ushort* dCompactMeasures; // ushort2: half rho/rho0 - 1, p/B
+
 	uint   gridSortBits;
 
 	uint   posVbo;            // vertex buffer object for particle positions
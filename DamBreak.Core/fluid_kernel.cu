@@ -2,6 +2,7 @@
 #include <math.h>
 #include "../Common/helper_math.h"
 #include "math_constants.h"
+#include <cuda_fp16.h>
 #include "fluid_kernel.cuh"
 
 #if USE_TEX
@@ -13,9 +14,37 @@ texture<float4, 1, cudaReadModeElementType> oldVariationsTex;
 texture<uint, 1, cudaReadModeElementType> gridParticleHashTex;
 texture<uint, 1, cudaReadModeElementType> cellStartTex;
 texture<uint, 1, cudaReadModeElementType> cellEndTex;
+
+texture<ushort4, 1, cudaReadModeElementType> compactPosTex;
+texture<ushort4, 1, cudaReadModeElementType> compactVelTex;
+texture<ushort2, 1, cudaReadModeElementType> compactMeasuresTex;
 #endif
 __constant__ SimParams params;
 
+#if SPH_PRECISION == SPH_PRECISION_FLOAT
+typedef float3 sph_accum3;
+#else
+typedef double3 sph_accum3;
+
+inline __device__ void operator+=(double3& a, float3 b){
+	a.x += b.x; a.y += b.y; a.z += b.z;
+}
+
+inline __device__ void operator+=(double3& a, double3 b){
+	a.x += b.x; a.y += b.y; a.z += b.z;
+}
+#endif
+
+inline __device__ sph_accum3 make_accum3(float s){
+	sph_accum3 a;
+	a.x = a.y = a.z = s;
+	return a;
+}
+
+inline __device__ float3 accumToFloat3(sph_accum3 a){
+	return make_float3(a.x, a.y, a.z);
+}
+
 __device__ int3 calcGridPos(float3 p){
 	int3 gridPos;
 	gridPos.x = floor((p.x - params.worldOrigin.x) / params.cellSize.x);
@@ -31,6 +60,130 @@ __device__ uint calcGridHash(int3 gridPos){
 	return __umul24(__umul24(gridPos.z, params.gridSize.y), params.gridSize.x) + __umul24(gridPos.y, params.gridSize.x) + gridPos.x;
 }
 
+__device__ bool insideGrid(int3 gridPos){
+	return gridPos.x >= 0 && gridPos.x < (int)params.gridSize.x
+		&& gridPos.y >= 0 && gridPos.y < (int)params.gridSize.y
+		&& gridPos.z >= 0 && gridPos.z < (int)params.gridSize.z;
+}
+
+// sort key: fluid particles of a cell come first in the sorted list,
+// boundary ones form a separate range after all fluid particles,
+// free fluid slots share one key after the boundary range
+__device__ uint calcSortKey(uint gridHash, float type){
+	if (type == Inactive)
+		return 2 * params.numGridCells;
+	return (type == Fluid || type == Halo) ? gridHash : gridHash + params.numGridCells;
+}
+
+// Adaptive refinement: a level 1 particle is one of four children of a
+// split level 0 particle, with a quarter of its mass and half its smoothing
+// length. A pair uses the mean smoothing length, so forces stay symmetric.
+__device__ float refinedMass(float level){
+	return (level > 0.0f) ? 0.25f : 1.0f;
+}
+
+__device__ float pairSmoothingRadius(float level, float level2){
+	return params.smoothingRadius * (1.0f - 0.25f * (level + level2));
+}
+
+#define WALL_FAR 1.0e10f
+
+__device__ float4 sampleWallField(float4* field, float x, float y){
+	float fx = (x - params.worldOrigin.x) / params.fieldSpacing;
+	float fy = (y - params.worldOrigin.y) / params.fieldSpacing;
+	int ix = (int)floorf(fx);
+	int iy = (int)floorf(fy);
+	if (ix < 0 || iy < 0 || ix >= (int)params.fieldSize.x - 1 || iy >= (int)params.fieldSize.y - 1)
+		return make_float4(WALL_FAR, 0.0f, 0.0f, 0.0f);
+
+	float tx = fx - ix;
+	float ty = fy - iy;
+	uint node = iy * params.fieldSize.x + ix;
+	float4 bottom = lerp(field[node], field[node + 1], tx);
+	float4 top = lerp(field[node + params.fieldSize.x], field[node + params.fieldSize.x + 1], tx);
+	return lerp(bottom, top, ty);
+}
+
+// wall law of sumBoundaryForces (D, a = r) for one wall particle at the
+// interpolated distance along the normal, cut at the kernel support like the
+// density sum; a particle pushed through the first layer is held at a / 2
+__device__ float3 wallFieldForce(float4 sample){
+	if (sample.x >= 2.0f * params.smoothingRadius)
+		return make_float3(0.0f);
+	float2 n = make_float2(sample.y, sample.z);
+	float len = length(n);
+	if (len < 1.0e-6f)
+		return make_float3(0.0f);
+	n /= len;
+
+	float d = fmaxf(sample.x, 0.5f * params.a);
+	float r6 = sph::ipow<6>(params.a / d);
+	float magnitude = params.D * (r6 * r6 - r6) / d;
+	return make_float3(magnitude * n.x, magnitude * n.y, 0.0f);
+}
+
+__device__ float3 sumWallFieldForces(float3 pos){
+	float3 force = wallFieldForce(sampleWallField(params.tankField, pos.x, pos.y));
+	if (params.gateField)
+		force += wallFieldForce(sampleWallField(params.gateField, pos.x - params.gateShift, pos.y));
+	return force;
+}
+
+// kernel sum of wall layers, scaled by particle mass together with fluid sum
+__device__ float sumWallFieldDensity(float3 pos){
+	float sum = sampleWallField(params.tankField, pos.x, pos.y).w;
+	if (params.gateField)
+		sum += sampleWallField(params.gateField, pos.x - params.gateShift, pos.y).w;
+	return sum;
+}
+
+__global__ void buildWallFieldD(
+	float4* field,     // output
+	float4* wallPos,   // input, wall particle lattice
+	uint    numWallParticles,
+	float   gateWall,  // x of first gate layer
+	bool    isGate){
+		uint index = __umul24(blockIdx.x, blockDim.x) + threadIdx.x;
+		if (index >= params.fieldSize.x * params.fieldSize.y) return;
+
+		float x = params.worldOrigin.x + (index % params.fieldSize.x) * params.fieldSpacing;
+		float y = params.worldOrigin.y + (index / params.fieldSize.x) * params.fieldSpacing;
+
+		// signed distance to the first wall layer, positive on the fluid side
+		float d;
+		float2 n;
+		if (isGate) {
+			d = gateWall - x;
+			n = make_float2(-1.0f, 0.0f);
+		} else {
+			float leftWall = params.worldOrigin.x + (params.boundaryOffset * 2 - 1) * params.particleRadius;
+			float bottomWall = params.worldOrigin.y + (params.boundaryOffset * 2 - 1) * params.particleRadius;
+			float dx = x - leftWall;
+			float dy = y - bottomWall;
+			if (dx >= 0 && dy >= 0) {
+				d = fminf(dx, dy);
+				n = (dx < dy) ? make_float2(1.0f, 0.0f) : make_float2(0.0f, 1.0f);
+			} else {
+				float2 out = make_float2(fminf(dx, 0.0f), fminf(dy, 0.0f));
+				d = -length(out);
+				n = -out / length(out);
+			}
+		}
+
+		float sum = 0.0f;
+		float coeff = DamBreakKernel::coefficient(params.smoothingRadius);
+		for(uint j = 0; j < numWallParticles; j++) {
+			float4 w = wallPos[j];
+			bool gateParticle = (w.w == RightFirstType) || (w.w == RightSecondType);
+			if (gateParticle != isGate)
+				continue;
+			float q = length(make_float2(x - w.x, y - w.y)) / params.smoothingRadius;
+			if(q < 2)
+				sum += coeff * DamBreakKernel::shape(q);
+		}
+		field[index] = make_float4(d, n.x, n.y, sum);
+}
+
 __global__ void calcHashD(
 	uint*   gridParticleHash,  // output
 	uint*   gridParticleIndex, // output
@@ -41,7 +194,7 @@ __global__ void calcHashD(
 		volatile float4 p = pos[index];		
 
 		int3 gridPos = calcGridPos(make_float3(p.x, p.y, p.z));
-		uint hash = calcGridHash(gridPos);
+		uint hash = calcSortKey(calcGridHash(gridPos), p.w);
 
 		gridParticleHash[index] = hash;
 		gridParticleIndex[index] = index;
@@ -96,31 +249,167 @@ __global__ void reorderDataAndFindCellStartD(
 		}
 }
 
-__device__ float sumDensity(
-	int3    gridPos,
-	uint    index,
+__global__ void calcHashPersistentD(
+	uint*   gridParticleHash,  // input, output
+	uint*   gridParticleIndex, // output
+	uint*   moved,             // output
+	float4* pos,               // input
+	uint    numParticles){
+		uint index = __umul24(blockIdx.x, blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+		volatile float4 p = pos[index];
+
+		int3 gridPos = calcGridPos(make_float3(p.x, p.y, p.z));
+		uint hash = calcSortKey(calcGridHash(gridPos), p.w);
+
+		//arrays are in grid order, so the old hash of the slot is the particle's own
+		moved[index] = (hash != gridParticleHash[index]) ? 1 : 0;
+		gridParticleHash[index] = hash;
+		gridParticleIndex[index] = index;
+}
+
+__global__ void reorderPersistentDataD(
+	uint*   cellStart,         // output
+	uint*   cellEnd,           // output
+	float4* sortedPos,         // output
+	float4* sortedVel,         // output
+	float4* sortedVelLeapFrog, // output
+	uint *  gridParticleHash,  // input
+	uint *  gridParticleIndex, // input
+	float4* oldPos,            // input
+	float4* oldVel,            // input
+	float4* oldVelLeapFrog,    // input
+	bool    permute,
+	uint    numParticles){
+		extern __shared__ uint sharedHash[];    // blockSize + 1 elements
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+
+		uint hash;
+		if (index < numParticles) {
+			hash = gridParticleHash[index];
+
+			sharedHash[threadIdx.x+1] = hash;
+
+			if (index > 0 && threadIdx.x == 0)
+			{
+				sharedHash[0] = gridParticleHash[index-1];
+			}
+		}
+
+		__syncthreads();
+
+		if (index < numParticles) {
+			if (index == 0 || hash != sharedHash[threadIdx.x])
+			{
+				cellStart[hash] = index;
+				if (index > 0)
+					cellEnd[sharedHash[threadIdx.x]] = index;
+			}
+
+			if (index == numParticles - 1)
+			{
+				cellEnd[hash] = index + 1;
+			}
+
+			if (!permute)
+				return;
+
+			uint sortedIndex = gridParticleIndex[index];
+			sortedPos[index] = oldPos[sortedIndex];
+			sortedVel[index] = oldVel[sortedIndex];
+			sortedVelLeapFrog[index] = oldVelLeapFrog[sortedIndex];
+		}
+}
+
+// per particle data that follows a persistent reorder, e.g. colours
+__global__ void gatherFloat4D(
+	float4* output,
+	float4* input,
+	uint*   gridParticleIndex,
+	uint    numParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+		output[index] = input[gridParticleIndex[index]];
+}
+
+// kernel sum in units of the level 0 particle mass
+__device__ sph_accum sumDensity(
+	uint    gridHash,
 	float3  pos,
 	float4* oldPos, 
+	float4* oldVel,
+	float   level,
 	uint*   cellStart,
 	uint*   cellEnd){
-		uint gridHash = calcGridHash(gridPos);
 		uint startIndex = FETCH(cellStart, gridHash);
 
-		float sum = 0.0f;
+		sph_accum sum = 0.0f;
 		if (startIndex != 0xffffffff) {        // cell is not empty
 			uint endIndex = FETCH(cellEnd, gridHash);
 			for(uint j=startIndex; j<endIndex; j++) {	
-					float4 post = FETCH(oldPos, j);
-					//if(post.w < RightSecondType) // RightFirstType + FirstType
-					//	continue;
+					float3 pos2 = make_float3(FETCH(oldPos, j));
+					float3 relPos = pos - pos2;
+					sph_real dist = sqrt((sph_real)dot(relPos, relPos));
+					sph_real h = params.smoothingRadius;
+					sph_real mass = 1.0f;
+					if (params.adaptiveRefinement) {
+						float level2 = FETCH(oldVel, j).w;
+						h = pairSmoothingRadius(level, level2);
+						mass = refinedMass(level2);
+					}
+					sph_real q = dist / h;									
+					if(q < 2){
+						sum += mass * DamBreakKernel::coefficient(h) * DamBreakKernel::shape(q);	
+					}
+			}
+		}
+		return sum;
+}
+
+// sumDensity that also records the fluid pairs inside the support for the
+// force pass: neighbour, distance and dW/dr. Slot k of particle i is at
+// k * numParticles + i; past PAIR_CACHE_SIZE pairs are only counted, the
+// force pass traverses the cells again for such a particle.
+__device__ sph_accum sumDensityCached(
+	uint    gridHash,
+	uint    index,
+	float3  pos,
+	float4* oldPos, 
+	float4* oldVel,
+	float   level,
+	uint*   cellStart,
+	uint*   cellEnd,
+	uint*   pairIndex,
+	float2* pairData,
+	uint&   pairs,
+	uint    numParticles){
+		uint startIndex = FETCH(cellStart, gridHash);
 
-					float3 pos2 = make_float3(post);						
+		sph_accum sum = 0.0f;
+		if (startIndex != 0xffffffff) {
+			uint endIndex = FETCH(cellEnd, gridHash);
+			for(uint j=startIndex; j<endIndex; j++) {	
+					float3 pos2 = make_float3(FETCH(oldPos, j));
 					float3 relPos = pos - pos2;
-					float dist = length(relPos);
-					float q = dist / params.smoothingRadius;									
-					float coeff = 7.0f / 4 / CUDART_PI_F / powf(params.smoothingRadius, 2);
+					sph_real dist = sqrt((sph_real)dot(relPos, relPos));
+					sph_real h = params.smoothingRadius;
+					sph_real mass = 1.0f;
+					if (params.adaptiveRefinement) {
+						float level2 = FETCH(oldVel, j).w;
+						h = pairSmoothingRadius(level, level2);
+						mass = refinedMass(level2);
+					}
+					sph_real q = dist / h;									
 					if(q < 2){
-						sum += coeff *(powf(1 - 0.5f * q, 4) * (2 * q + 1));	
+						sum += mass * DamBreakKernel::coefficient(h) * DamBreakKernel::shape(q);	
+						if (j != index) {
+							if (pairs < PAIR_CACHE_SIZE) {
+								pairIndex[pairs * numParticles + index] = j;
+								pairData[pairs * numParticles + index] = make_float2(dist,
+									DamBreakKernel::gradientCoefficient(h) * DamBreakKernel::shapeDerivative(q));
+							}
+							pairs++;
+						}
 					}
 			}
 		}
@@ -135,106 +424,137 @@ __global__ void calculateDamBreakDensityD(
 	uint* gridParticleIndex,
 	uint* cellStart,
 	uint* cellEnd,
+	uint* pairCount,  // pair cache, 0 if not kept
+	uint* pairIndex,
+	float2* pairData,
 	uint numParticles){
 		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
 		if (index >= numParticles) return;    
 
-		float4 pos1 = FETCH(oldPos, index);
-		/*if(pos1.w < RightSecondType) 
-			return;*/
-		float3 pos = make_float3(pos1);
-
-		//float3 pos = make_float3(FETCH(oldPos, index));	
-		float3 vel = make_float3(FETCH(oldVel, index));
+		float3 pos = make_float3(FETCH(oldPos, index));
+		float level = params.adaptiveRefinement ? FETCH(oldVel, index).w : 0.0f;
 		int3 gridPos = calcGridPos(pos);
 
-		float sum = 0.0f;		
+		sph_accum sum = 0.0f;		
+		uint pairs = 0;
 		for(int z=-params.cellcount; z<=params.cellcount; z++) {
 			for(int y=-params.cellcount; y<=params.cellcount; y++) {
 				for(int x=-params.cellcount; x<=params.cellcount; x++) {
-					int3 neighbourPos = gridPos + make_int3(x, y, z);
-					sum += sumDensity(
-						neighbourPos,
-						index,
-						pos,
-						oldPos,
-						cellStart,
-						cellEnd);
+					uint gridHash = calcGridHash(gridPos + make_int3(x, y, z));
+					if (pairCount)
+						sum += sumDensityCached(gridHash, index, pos, oldPos, oldVel, level, cellStart, cellEnd,
+							pairIndex, pairData, pairs, numParticles);
+					else
+						sum += sumDensity(gridHash, pos, oldPos, oldVel, level, cellStart, cellEnd);
+					if (params.boundaryModel == ParticleWalls)
+						sum += sumDensity(gridHash + params.numGridCells, pos, oldPos, oldVel, level, cellStart, cellEnd);
 				}
 			}
 		}					
-		float dens = sum * params.particleMass;
+		if (params.boundaryModel == DistanceFieldWalls)
+			sum += sumWallFieldDensity(pos);
+		if (pairCount)
+			pairCount[index] = pairs;
+		sph_real dens = sum * params.particleMass;
 		measuresOutput[index].x = dens;	
-		measuresOutput[index].y = params.B * (powf(dens / params.restDensity ,params.gamma) - 1.0f);
+		measuresOutput[index].y = DamBreakEos::pressure(dens, (sph_real)params.restDensity, (sph_real)params.B);
+}
+
+
+__device__ float3 sumBoundaryForces(
+	uint    gridHash,
+	float3  pos,
+	float4* oldPos,
+	uint*   cellStart,
+	uint*   cellEnd){
+		uint startIndex = FETCH(cellStart, gridHash);
+
+		float3 tmpForce = make_float3(0.0f);
+		if (startIndex != 0xffffffff) {
+			uint endIndex = FETCH(cellEnd, gridHash);
+			for(uint j=startIndex; j<endIndex; j++) {
+				float3 relPos = pos - make_float3(FETCH(oldPos, j));
+				float dist = length(relPos);
+
+				float r6 = sph::ipow<6>(params.a / dist);
+				tmpForce += params.D * (r6 * r6 - r6) * relPos / (dist * dist);
+			}
+		}
+		return tmpForce;
 }
 
+// pressure and artificial viscosity term of one pair, the force is scale * relPos;
+// temp is the kernel gradient dW/dr
+__device__ sph_real navierStokesScale(
+	sph_real dist2,
+	sph_real dist,
+	sph_real temp,
+	sph_real vij_pij,
+	sph_real h,
+	sph_real mass,
+	sph_real density,
+	sph_real density2,
+	sph_real pressure,
+	sph_real pressure2){
+		sph_real artViscosity = 0.0f;
+		if(vij_pij < 0){						
+			sph_real nu = (sph_real)0.76 * h *
+				params.soundspeed / (density + density2);
+
+			artViscosity = -nu * vij_pij / 
+				(dist2 + (sph_real)0.001 * h * h);
+		}
+		//relPos / dist is the unit vector, temp carries the kernel gradient
+		return -mass *
+			(pressure / (density * density) + pressure2 / (density2 * density2) +
+			artViscosity) * temp / dist;
+}
 
-__device__ float3 sumNavierStokesForces(
-	int3    gridPos,
+__device__ sph_accum3 sumNavierStokesForces(
+	uint    gridHash,
 	uint    index,
 	float3  pos,
 	float4* oldPos, 
 	float3  vel,
 	float4* oldVel,
-	float density,
-	float pressure,				   
+	sph_real density,
+	sph_real pressure,				   
+	float level,
 	float4* oldMeasures,
 	uint*   cellStart,
 	uint*   cellEnd){
-		uint gridHash = calcGridHash(gridPos);
 		uint startIndex = FETCH(cellStart, gridHash);
 	    
-		float3 tmpForce = make_float3(0.0f);
-		float texp = 0.0f;
-		float pexp = 0.0f;
+		sph_accum3 tmpForce = make_accum3(0.0f);
 		if (startIndex != 0xffffffff) {               
 			uint endIndex = FETCH(cellEnd, gridHash);
 			for(uint j=startIndex; j<endIndex; j++) {
 				if (j != index) {             
-
-					float4 post = FETCH(oldPos, j);
-					float3 pos2 = make_float3(post);
-					//if(post.w  < RightSecondType) 
-
-					if(post.w != Fluid) 
-					{
-						float3 relPos = pos - pos2;
-						float dist = length(relPos);
-						
-						tmpForce += params.D * (powf(params.a / dist, 12)
-							- powf(params.a / dist, 6)) * relPos / powf(dist, 2);						
-						
-						continue;
-					}					
-
-					//float3 pos2 = make_float3(FETCH(oldPos, j));
-					float3 vel2 = make_float3(FETCH(oldVel, j));				
+					float3 pos2 = make_float3(FETCH(oldPos, j));
+					float4 velData2 = FETCH(oldVel, j);
+					float3 vel2 = make_float3(velData2);				
 					float4 measure = FETCH(oldMeasures, j);
-					float density2 = measure.x;
-					float pressure2 = measure.y;				
-					float tempExpr = 0.0f;
+					sph_real density2 = measure.x;
+					sph_real pressure2 = measure.y;				
 
 					float3 relPos = pos - pos2;
-					float dist = length(relPos);				
+					sph_real dist2 = dot(relPos, relPos);
+					sph_real dist = sqrt(dist2);				
 
-					float q = dist / params.smoothingRadius;		
-					float temp = 0.0f;
-					float coeff = 7.0f / 2 / CUDART_PI_F / powf(params.smoothingRadius, 3);
+					sph_real h = params.smoothingRadius;
+					sph_real mass = params.particleMass;
+					if (params.adaptiveRefinement) {
+						h = pairSmoothingRadius(level, velData2.w);
+						mass *= refinedMass(velData2.w);
+					}
+					sph_real q = dist / h;		
 					if(q < 2){
-						temp = coeff * (-powf(1 - 0.5f * q,3) * (2 * q + 1) +powf(1 - 0.5f * q, 4));
-						float artViscosity = 0.0f;
-						float vij_pij = dot((vel - vel2),relPos);
-						
-						if(vij_pij < 0){						
-							float nu = 2.0f * 0.38f * params.smoothingRadius *
-								params.soundspeed / (density + density2);
-
-							artViscosity = -1.0f * nu * vij_pij / 
-								(dot(relPos, relPos) + 0.001f * pow(params.smoothingRadius, 2));
-						}
-						tmpForce +=  -1.0f * params.particleMass *
-							(pressure / pow(density,2) + pressure2 / pow(density2,2) +
-							artViscosity) * normalize(relPos) * temp;						
+						sph_real temp = DamBreakKernel::gradientCoefficient(h) * DamBreakKernel::shapeDerivative(q);
+						sph_real scale = navierStokesScale(dist2, dist, temp, dot((vel - vel2),relPos),
+							h, mass, density, density2, pressure, pressure2);
+						tmpForce.x += scale * relPos.x;
+						tmpForce.y += scale * relPos.y;
+						tmpForce.z += scale * relPos.z;
 					}        
 				}
 			}
@@ -242,6 +562,142 @@ __device__ float3 sumNavierStokesForces(
 		return tmpForce;				
 }
 
+// same sum over the pairs the density pass recorded, no cell traversal and
+// no kernel evaluation
+__device__ sph_accum3 sumNavierStokesForcesCached(
+	uint    index,
+	float3  pos,
+	float4* oldPos, 
+	float3  vel,
+	float4* oldVel,
+	sph_real density,
+	sph_real pressure,				   
+	float level,
+	float4* oldMeasures,
+	uint    pairs,
+	uint*   pairIndex,
+	float2* pairData,
+	uint    numParticles){
+		sph_accum3 tmpForce = make_accum3(0.0f);
+		for(uint k=0; k<pairs; k++) {
+			uint j = pairIndex[k * numParticles + index];
+			float2 pair = pairData[k * numParticles + index];
+			float3 pos2 = make_float3(FETCH(oldPos, j));
+			float4 velData2 = FETCH(oldVel, j);
+			float3 vel2 = make_float3(velData2);				
+			float4 measure = FETCH(oldMeasures, j);
+
+			float3 relPos = pos - pos2;
+			sph_real h = params.smoothingRadius;
+			sph_real mass = params.particleMass;
+			if (params.adaptiveRefinement) {
+				h = pairSmoothingRadius(level, velData2.w);
+				mass *= refinedMass(velData2.w);
+			}
+			sph_real scale = navierStokesScale(dot(relPos, relPos), pair.x, pair.y, dot((vel - vel2),relPos),
+				h, mass, density, measure.x, pressure, measure.y);
+			tmpForce.x += scale * relPos.x;
+			tmpForce.y += scale * relPos.y;
+			tmpForce.z += scale * relPos.z;
+		}
+		return tmpForce;
+}
+
+// Block time stepping: a particle on level l advances by 2^l substeps of
+// deltaTime / 2^blockLevels and is active on substeps that are multiples of
+// 2^l. Inactive particles keep density, pressure and acceleration of their
+// last active substep, their positions keep drifting with the last velocity.
+// Their neighbours see these held values, not values interpolated to the
+// substep: the value at the next active substep is not known yet.
+__device__ bool isActive(uint level, uint substep){
+	return (substep & ((1u << level) - 1)) == 0;
+}
+
+__device__ uint countNeighbours(uint gridHash, uint* cellStart, uint* cellEnd){
+	uint startIndex = FETCH(cellStart, gridHash);
+	if (startIndex == 0xffffffff)
+		return 0;
+	return FETCH(cellEnd, gridHash) - startIndex;
+}
+
+// diagnostic: pairs of every fluid particle, as if the substep were all active
+__global__ void countPairsD(
+	uint*   pairCount, // output, sorted
+	float4* oldPos,
+	uint*   cellStart,
+	uint*   cellEnd,
+	uint    numParticles){
+		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		int3 gridPos = calcGridPos(make_float3(FETCH(oldPos, index)));
+		uint pairs = 0;
+		for(int z=-params.cellcount; z<=params.cellcount; z++) {
+			for(int y=-params.cellcount; y<=params.cellcount; y++) {
+				for(int x=-params.cellcount; x<=params.cellcount; x++) {
+					uint gridHash = calcGridHash(gridPos + make_int3(x, y, z));
+					pairs += countNeighbours(gridHash, cellStart, cellEnd);
+					if (params.boundaryModel == ParticleWalls)
+						pairs += countNeighbours(gridHash + params.numGridCells, cellStart, cellEnd);
+				}
+			}
+		}
+		pairCount[index] = pairs;
+}
+
+__global__ void blockDensityD(
+	float4* measuresOutput, // output, sorted
+	float4* heldMeasures,   // input, output, particle order
+	uint*   pairCount,      // output: pairs evaluated, 0 if not counted
+	uint*   level,          // particle order
+	float4* oldPos,
+	float4* oldVel,
+	uint*   gridParticleIndex,
+	uint*   cellStart,
+	uint*   cellEnd,
+	uint    substep,
+	uint    numParticles){
+		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float3 pos = make_float3(FETCH(oldPos, index));
+		int3 gridPos = calcGridPos(pos);
+		uint originalIndex = gridParticleIndex[index];
+		if (!isActive(level[originalIndex], substep)) {
+			if (pairCount)
+				pairCount[index] = 0;
+			measuresOutput[index] = heldMeasures[originalIndex];
+			return;
+		}
+
+		sph_accum sum = 0.0f;
+		uint pairs = 0;
+		for(int z=-params.cellcount; z<=params.cellcount; z++) {
+			for(int y=-params.cellcount; y<=params.cellcount; y++) {
+				for(int x=-params.cellcount; x<=params.cellcount; x++) {
+					uint gridHash = calcGridHash(gridPos + make_int3(x, y, z));
+					sum += sumDensity(gridHash, pos, oldPos, oldVel, 0.0f, cellStart, cellEnd);
+					if (params.boundaryModel == ParticleWalls)
+						sum += sumDensity(gridHash + params.numGridCells, pos, oldPos, oldVel, 0.0f, cellStart, cellEnd);
+					if (!pairCount)
+						continue;
+					pairs += countNeighbours(gridHash, cellStart, cellEnd);
+					if (params.boundaryModel == ParticleWalls)
+						pairs += countNeighbours(gridHash + params.numGridCells, cellStart, cellEnd);
+				}
+			}
+		}
+		if (pairCount)
+			pairCount[index] = pairs;
+
+		if (params.boundaryModel == DistanceFieldWalls)
+			sum += sumWallFieldDensity(pos);
+		sph_real dens = sum * params.particleMass;
+		measuresOutput[index].x = dens;
+		measuresOutput[index].y = DamBreakEos::pressure(dens, (sph_real)params.restDensity, (sph_real)params.B);
+		heldMeasures[originalIndex] = measuresOutput[index];
+}
+
 __global__ void calcAndApplyAccelerationD(
 	float4* acceleration,			
 	float4* oldMeasures,
@@ -250,105 +706,809 @@ __global__ void calcAndApplyAccelerationD(
 	uint* gridParticleIndex,
 	uint* cellStart,
 	uint* cellEnd,
+	uint* level,      // block time stepping, 0 if all particles are active
+	uint substep,
+	uint* pairCount,  // pair cache of the density pass, 0 if not kept
+	uint* pairIndex,
+	float2* pairData,
 	uint numParticles){
 		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
 		if (index >= numParticles) return;    
+		if (level && !isActive(level[gridParticleIndex[index]], substep)) return;
 
-		float4 pos1 = FETCH(oldPos, index);
-		if(pos1.w != Fluid) 
-			return;
-		float3 pos = make_float3(pos1);
-
-		//float3 pos = make_float3(FETCH(oldPos, index));
-		float3 vel = make_float3(FETCH(oldVel, index));
+		//launched for fluid particles only, they occupy the head of the sorted list
+		float3 pos = make_float3(FETCH(oldPos, index));
+		float4 velData = FETCH(oldVel, index);
+		float3 vel = make_float3(velData);
+		float refineLevel = params.adaptiveRefinement ? velData.w : 0.0f;
 		float4 measure = FETCH(oldMeasures,index);
 		float density = measure.x;
 		float pressure = measure.y;
 
 		int3 gridPos = calcGridPos(pos);
+		uint pairs = pairCount ? pairCount[index] : 0;
+		bool cached = pairCount && pairs <= PAIR_CACHE_SIZE;
 
-		float3 force = make_float3(0.0f);	
+		sph_accum3 force = make_accum3(0.0f);	
 		for(int z=-params.cellcount; z<=params.cellcount; z++) {
 			for(int y=-params.cellcount; y<=params.cellcount; y++) {
 				for(int x=-params.cellcount; x<=params.cellcount; x++) {
-					int3 neighbourPos = gridPos + make_int3(x, y, z);
-					force += sumNavierStokesForces(neighbourPos, 
-						index, 
-						pos, 
-						oldPos,
-						vel,
-						oldVel,
-						density,
-						pressure,					
-						oldMeasures,
-						cellStart, 
-						cellEnd);
+					uint gridHash = calcGridHash(gridPos + make_int3(x, y, z));
+					if (params.boundaryModel == ParticleWalls && params.boundarySubsteps == 1)
+						force += sumBoundaryForces(gridHash + params.numGridCells, pos, oldPos, cellStart, cellEnd);
+					if (!cached)
+						force += sumNavierStokesForces(gridHash, 
+							index, 
+							pos, 
+							oldPos,
+							vel,
+							oldVel,
+							density,
+							pressure,					
+							refineLevel,
+							oldMeasures,
+							cellStart, 
+							cellEnd);
 				}
 			}
 		}
+		if (cached)
+			force += sumNavierStokesForcesCached(index, pos, oldPos, vel, oldVel, density, pressure,
+				refineLevel, oldMeasures, pairs, pairIndex, pairData, numParticles);
+		if (params.boundaryModel == DistanceFieldWalls && params.boundarySubsteps == 1)
+			force += sumWallFieldForces(pos);
 		uint originalIndex = gridParticleIndex[index];					
-		float3 acc = force;			
+		float3 acc = accumToFloat3(force);			
 		acceleration[originalIndex] =  make_float4(acc, 0.0f);
 }
 
-__global__ void shiftRightBoundaryD(
-	float4* posArray,		 
-	uint numParticles){
-		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
-		if (index >= numParticles) return;          		
-		
-		volatile float4 posData = posArray[index]; 
-		if((posData.w != RightFirstType) && (posData.w != RightSecondType))
-			return;
+// Compact neighbour data: position is stored as 16 bit offset inside the
+// particle's cell, the cell itself is known from the neighbour loop.
+// w keeps the particle type, COMPACT_OUTSIDE marks particles whose cell lies
+// outside the grid (hash wraps), those fall back to the full position.
+// So do all particles of a stencil cell outside the grid: its hash aliases a
+// cell on the far side, whose particles are not in the stencil cell.
+#define COMPACT_OUTSIDE 0x8000
 
-		float halfWorldXSize = params.fluidParticlesSize.x * 2 * params.particleRadius;				
-		posArray[index] = make_float4(posData.x + halfWorldXSize, posData.y, posData.z, posData.w);
+__device__ ushort quantizeInCell(float p, float origin, float cellSize, int cell){
+	float t = ((p - origin) / cellSize - cell) * 65536.0f;
+	return (ushort)fminf(fmaxf(floorf(t), 0.0f), 65535.0f);
 }
 
-__global__ void removeRightBoundaryD(
-	float4* posArray,		 
-	uint numParticles){
-		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
-		if (index >= numParticles) return;          		
-		
-		volatile float4 posData = posArray[index]; 
-		if((posData.w != RightFirstType) && (posData.w != RightSecondType))
-			return;
+__device__ float3 dequantizeInCell(int3 gridPos, ushort4 q){
+	float3 t = make_float3(q.x + 0.5f, q.y + 0.5f, q.z + 0.5f) / 65536.0f;
+	return params.worldOrigin + (make_float3(gridPos) + t) * params.cellSize;
+}
 
-		float fluidWidth = params.fluidParticlesSize.x * 2 * params.particleRadius;				
-		float height = params.gridSize.y * 2 * params.particleRadius;
-		posArray[index] = make_float4(fluidWidth, height, posData.z, posData.w);
+__device__ ushort toHalf(float v){
+	return __half_as_ushort(__float2half_rn(v));
 }
 
-__global__ void integrate(
-	float4* posArray,		 // input, output
-	float4* velArray,		 // input, output  
-	float4* velLeapFrogArray, // output
-	float4* acceleration,	 // input
-	uint numParticles){
-		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
-		if (index >= numParticles) return;          		
+__device__ float fromHalf(ushort v){
+	return __half2float(__ushort_as_half(v));
+}
 
-		volatile float4 posData = posArray[index]; 
-		volatile float4 velData = velArray[index];
-		volatile float4 accData = acceleration[index];
-		volatile float4 velLeapFrogData = velLeapFrogArray[index];
+__global__ void packCompactDataD(
+	ushort4* compactPos, // output
+	ushort4* compactVel, // output
+	float4*  sortedPos,  // input
+	float4*  sortedVel,  // input
+	uint     numParticles){
+		uint index = __umul24(blockIdx.x, blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
 
-		if(posData.w != Fluid)
-			return;
+		float4 p = sortedPos[index];
+		float4 v = sortedVel[index];
+		int3 gridPos = calcGridPos(make_float3(p));
 
-		float3 pos = make_float3(posData.x, posData.y, posData.z);
-		float3 vel = make_float3(velData.x, velData.y, velData.z);
-		float3 acc = make_float3(accData.x, accData.y, accData.z);
+		ushort type = (ushort)p.w;
+		if (!insideGrid(gridPos))
+			type |= COMPACT_OUTSIDE;
 
-		float3 nextVel = vel + (params.gravity + acc) * params.deltaTime;
+		compactPos[index] = make_ushort4(
+			quantizeInCell(p.x, params.worldOrigin.x, params.cellSize.x, gridPos.x),
+			quantizeInCell(p.y, params.worldOrigin.y, params.cellSize.y, gridPos.y),
+			quantizeInCell(p.z, params.worldOrigin.z, params.cellSize.z, gridPos.z),
+			type);
+		compactVel[index] = make_ushort4(toHalf(v.x), toHalf(v.y), toHalf(v.z), 0);
+}
 
-		float3 velLeapFrog = vel + nextVel;
-		velLeapFrog *= 0.5;
+__device__ float3 compactNeighbourPos(int3 gridPos, uint j, float4* oldPos, ushort4 cp){
+	if ((cp.w & COMPACT_OUTSIDE) || !insideGrid(gridPos))
+		return make_float3(FETCH(oldPos, j));
+	return dequantizeInCell(gridPos, cp);
+}
 
-		vel = nextVel;   	
-		pos += vel * params.deltaTime;   
+__device__ float sumDensityCompact(
+	int3     gridPos,
+	uint     gridHash,
+	float3   pos,
+	float4*  oldPos,
+	ushort4* compactPos,
+	uint*    cellStart,
+	uint*    cellEnd){
+		uint startIndex = FETCH(cellStart, gridHash);
+
+		float sum = 0.0f;
+		if (startIndex != 0xffffffff) {
+			uint endIndex = FETCH(cellEnd, gridHash);
+			for(uint j=startIndex; j<endIndex; j++) {
+					float3 pos2 = compactNeighbourPos(gridPos, j, oldPos, FETCH(compactPos, j));
+					float3 relPos = pos - pos2;
+					float dist = length(relPos);
+					float q = dist / params.smoothingRadius;
+					if(q < 2){
+						sum += DamBreakKernel::coefficient(params.smoothingRadius) * DamBreakKernel::shape(q);
+					}
+			}
+		}
+		return sum;
+}
+
+__global__ void calculateDamBreakDensityCompactD(
+	float4*  measuresOutput,        //output
+	ushort2* compactMeasuresOutput, //output
+	float4*  oldPos,                //input
+	ushort4* compactPos,            //input
+	uint* cellStart,
+	uint* cellEnd,
+	uint numParticles){
+		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float3 pos = make_float3(FETCH(oldPos, index));
+		int3 gridPos = calcGridPos(pos);
+
+		float sum = 0.0f;
+		for(int z=-params.cellcount; z<=params.cellcount; z++) {
+			for(int y=-params.cellcount; y<=params.cellcount; y++) {
+				for(int x=-params.cellcount; x<=params.cellcount; x++) {
+					int3 neighbourPos = gridPos + make_int3(x, y, z);
+					uint gridHash = calcGridHash(neighbourPos);
+					sum += sumDensityCompact(neighbourPos, gridHash, pos, oldPos, compactPos, cellStart, cellEnd);
+					if (params.boundaryModel == ParticleWalls)
+						sum += sumDensityCompact(neighbourPos, gridHash + params.numGridCells, pos, oldPos, compactPos, cellStart, cellEnd);
+				}
+			}
+		}
+		if (params.boundaryModel == DistanceFieldWalls)
+			sum += sumWallFieldDensity(pos);
+		float dens = sum * params.particleMass;
+		float pressure = DamBreakEos::pressure(dens, params.restDensity, params.B);
+		measuresOutput[index].x = dens;
+		measuresOutput[index].y = pressure;
+		//deviations from rest state keep half precision meaningful
+		compactMeasuresOutput[index] = make_ushort2(
+			toHalf(dens / params.restDensity - 1.0f),
+			toHalf(pressure / params.B));
+}
+
+__device__ float3 sumBoundaryForcesCompact(
+	int3     gridPos,
+	uint     gridHash,
+	float3   pos,
+	float4*  oldPos,
+	ushort4* compactPos,
+	uint*    cellStart,
+	uint*    cellEnd){
+		uint startIndex = FETCH(cellStart, gridHash);
+
+		float3 tmpForce = make_float3(0.0f);
+		if (startIndex != 0xffffffff) {
+			uint endIndex = FETCH(cellEnd, gridHash);
+			for(uint j=startIndex; j<endIndex; j++) {
+				float3 relPos = pos - compactNeighbourPos(gridPos, j, oldPos, FETCH(compactPos, j));
+				float dist = length(relPos);
+
+				float r6 = sph::ipow<6>(params.a / dist);
+				tmpForce += params.D * (r6 * r6 - r6) * relPos / (dist * dist);
+			}
+		}
+		return tmpForce;
+}
+
+__device__ float3 sumNavierStokesForcesCompact(
+	int3     gridPos,
+	uint     gridHash,
+	uint     index,
+	float3   pos,
+	float4*  oldPos,
+	ushort4* compactPos,
+	float3   vel,
+	ushort4* compactVel,
+	float density,
+	float pressure,
+	ushort2* compactMeasures,
+	uint*    cellStart,
+	uint*    cellEnd){
+		uint startIndex = FETCH(cellStart, gridHash);
+
+		float3 tmpForce = make_float3(0.0f);
+		if (startIndex != 0xffffffff) {
+			uint endIndex = FETCH(cellEnd, gridHash);
+			for(uint j=startIndex; j<endIndex; j++) {
+				if (j != index) {
+					float3 pos2 = compactNeighbourPos(gridPos, j, oldPos, FETCH(compactPos, j));
+
+					ushort4 cv = FETCH(compactVel, j);
+					float3 vel2 = make_float3(fromHalf(cv.x), fromHalf(cv.y), fromHalf(cv.z));
+					ushort2 measure = FETCH(compactMeasures, j);
+					float density2 = params.restDensity * (1.0f + fromHalf(measure.x));
+					float pressure2 = params.B * fromHalf(measure.y);
+
+					float3 relPos = pos - pos2;
+					float dist = length(relPos);
+
+					float h = params.smoothingRadius;
+					float q = dist / h;
+					if(q < 2){
+						float temp = DamBreakKernel::gradientCoefficient(h) * DamBreakKernel::shapeDerivative(q);
+						float artViscosity = 0.0f;
+						float vij_pij = dot((vel - vel2),relPos);
+
+						if(vij_pij < 0){
+							float nu = 2.0f * 0.38f * h *
+								params.soundspeed / (density + density2);
+
+							artViscosity = -1.0f * nu * vij_pij /
+								(dot(relPos, relPos) + 0.001f * h * h);
+						}
+						tmpForce +=  -1.0f * params.particleMass *
+							(pressure / (density * density) + pressure2 / (density2 * density2) +
+							artViscosity) * relPos * (temp / dist);
+					}
+				}
+			}
+		}
+		return tmpForce;
+}
+
+__global__ void calcAndApplyAccelerationCompactD(
+	float4*  acceleration,
+	float4*  oldMeasures,
+	ushort2* compactMeasures,
+	float4*  oldPos,
+	float4*  oldVel,
+	ushort4* compactPos,
+	ushort4* compactVel,
+	uint* gridParticleIndex,
+	uint* cellStart,
+	uint* cellEnd,
+	uint numParticles){
+		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float3 pos = make_float3(FETCH(oldPos, index));
+		float3 vel = make_float3(FETCH(oldVel, index));
+		float4 measure = FETCH(oldMeasures,index);
+		float density = measure.x;
+		float pressure = measure.y;
+
+		int3 gridPos = calcGridPos(pos);
+
+		float3 force = make_float3(0.0f);
+		for(int z=-params.cellcount; z<=params.cellcount; z++) {
+			for(int y=-params.cellcount; y<=params.cellcount; y++) {
+				for(int x=-params.cellcount; x<=params.cellcount; x++) {
+					int3 neighbourPos = gridPos + make_int3(x, y, z);
+					uint gridHash = calcGridHash(neighbourPos);
+					if (params.boundaryModel == ParticleWalls && params.boundarySubsteps == 1)
+						force += sumBoundaryForcesCompact(neighbourPos, gridHash + params.numGridCells,
+							pos, oldPos, compactPos, cellStart, cellEnd);
+					force += sumNavierStokesForcesCompact(neighbourPos,
+						gridHash,
+						index,
+						pos,
+						oldPos,
+						compactPos,
+						vel,
+						compactVel,
+						density,
+						pressure,
+						compactMeasures,
+						cellStart,
+						cellEnd);
+				}
+			}
+		}
+		if (params.boundaryModel == DistanceFieldWalls && params.boundarySubsteps == 1)
+			force += sumWallFieldForces(pos);
+		uint originalIndex = gridParticleIndex[index];
+		acceleration[originalIndex] = make_float4(force, 0.0f);
+}
+
+// Bucket grid: fixed capacity cells filled with atomic increments in one
+// pass over the particles in their own order, no sort and no reorder.
+// Keys are the sort keys, fluid cells then boundary cells. Particles outside
+// the grid are left out, the sorted grid wraps them into cells where they
+// are out of range anyway. Past the capacity a particle is only counted,
+// the host grows the buckets and inserts again.
+__global__ void buildBucketsD(
+	uint*   bucketCount,
+	uint*   bucketSlots,
+	uint*   overflow,    // largest count past the capacity
+	float4* pos,
+	uint    capacity,
+	uint    numParticles){
+		uint index = __umul24(blockIdx.x, blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+		float4 p = pos[index];
+		int3 gridPos = calcGridPos(make_float3(p));
+		if (p.w == Inactive || !insideGrid(gridPos)) return;
+
+		uint key = calcSortKey(calcGridHash(gridPos), p.w);
+		uint slot = atomicAdd(&bucketCount[key], 1);
+		if (slot < capacity)
+			bucketSlots[key * capacity + slot] = index;
+		else
+			atomicMax(overflow, slot + 1);
+}
+
+// neighbour sums over one bucket, particle data in particle order
+__device__ sph_accum sumDensityBucket(
+	uint    key,
+	float3  pos,
+	float4* oldPos,
+	uint*   bucketCount,
+	uint*   bucketSlots,
+	uint    capacity){
+		uint count = bucketCount[key];
+		sph_accum sum = 0.0f;
+		for(uint k=0; k<count; k++) {
+			uint j = bucketSlots[key * capacity + k];
+			float3 relPos = pos - make_float3(FETCH(oldPos, j));
+			sph_real h = params.smoothingRadius;
+			sph_real q = sqrt((sph_real)dot(relPos, relPos)) / h;
+			if(q < 2)
+				sum += DamBreakKernel::coefficient(h) * DamBreakKernel::shape(q);
+		}
+		return sum;
+}
+
+__device__ float3 sumBoundaryForcesBucket(
+	uint    key,
+	float3  pos,
+	float4* oldPos,
+	uint*   bucketCount,
+	uint*   bucketSlots,
+	uint    capacity){
+		uint count = bucketCount[key];
+		float3 tmpForce = make_float3(0.0f);
+		for(uint k=0; k<count; k++) {
+			uint j = bucketSlots[key * capacity + k];
+			float3 relPos = pos - make_float3(FETCH(oldPos, j));
+			float dist = length(relPos);
+
+			float r6 = sph::ipow<6>(params.a / dist);
+			tmpForce += params.D * (r6 * r6 - r6) * relPos / (dist * dist);
+		}
+		return tmpForce;
+}
+
+__device__ sph_accum3 sumNavierStokesForcesBucket(
+	uint    key,
+	uint    index,
+	float3  pos,
+	float4* oldPos,
+	float3  vel,
+	float4* oldVel,
+	sph_real density,
+	sph_real pressure,
+	float4* oldMeasures,
+	uint*   bucketCount,
+	uint*   bucketSlots,
+	uint    capacity){
+		uint count = bucketCount[key];
+		sph_accum3 tmpForce = make_accum3(0.0f);
+		for(uint k=0; k<count; k++) {
+			uint j = bucketSlots[key * capacity + k];
+			if (j == index)
+				continue;
+			float3 relPos = pos - make_float3(FETCH(oldPos, j));
+			sph_real dist2 = dot(relPos, relPos);
+			sph_real dist = sqrt(dist2);
+			sph_real h = params.smoothingRadius;
+			sph_real q = dist / h;
+			if(q < 2){
+				float3 vel2 = make_float3(FETCH(oldVel, j));
+				float4 measure = FETCH(oldMeasures, j);
+				sph_real temp = DamBreakKernel::gradientCoefficient(h) * DamBreakKernel::shapeDerivative(q);
+				sph_real scale = navierStokesScale(dist2, dist, temp, dot((vel - vel2),relPos),
+					h, params.particleMass, density, measure.x, pressure, measure.y);
+				tmpForce.x += scale * relPos.x;
+				tmpForce.y += scale * relPos.y;
+				tmpForce.z += scale * relPos.z;
+			}
+		}
+		return tmpForce;
+}
+
+// one thread per fluid slot in particle order, free slots are skipped
+__global__ void calculateDamBreakDensityBucketsD(
+	float4* measuresOutput,
+	float4* oldPos,
+	uint*   bucketCount,
+	uint*   bucketSlots,
+	uint    capacity,
+	uint    numParticles){
+		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+		float4 posData = FETCH(oldPos, index);
+		if (posData.w == Inactive) return;
+
+		float3 pos = make_float3(posData);
+		int3 gridPos = calcGridPos(pos);
+
+		sph_accum sum = 0.0f;
+		for(int z=-params.cellcount; z<=params.cellcount; z++) {
+			for(int y=-params.cellcount; y<=params.cellcount; y++) {
+				for(int x=-params.cellcount; x<=params.cellcount; x++) {
+					uint gridHash = calcGridHash(gridPos + make_int3(x, y, z));
+					sum += sumDensityBucket(gridHash, pos, oldPos, bucketCount, bucketSlots, capacity);
+					if (params.boundaryModel == ParticleWalls)
+						sum += sumDensityBucket(gridHash + params.numGridCells, pos, oldPos, bucketCount, bucketSlots, capacity);
+				}
+			}
+		}
+		if (params.boundaryModel == DistanceFieldWalls)
+			sum += sumWallFieldDensity(pos);
+		sph_real dens = sum * params.particleMass;
+		measuresOutput[index].x = dens;
+		measuresOutput[index].y = DamBreakEos::pressure(dens, (sph_real)params.restDensity, (sph_real)params.B);
+}
+
+__global__ void calcAndApplyAccelerationBucketsD(
+	float4* acceleration,
+	float4* oldMeasures,
+	float4* oldPos,
+	float4* oldVel,
+	uint*   bucketCount,
+	uint*   bucketSlots,
+	uint    capacity,
+	uint    numParticles){
+		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+		float4 posData = FETCH(oldPos, index);
+		if (posData.w == Inactive) return;
+
+		float3 pos = make_float3(posData);
+		float3 vel = make_float3(FETCH(oldVel, index));
+		float4 measure = FETCH(oldMeasures, index);
+		int3 gridPos = calcGridPos(pos);
+
+		sph_accum3 force = make_accum3(0.0f);
+		for(int z=-params.cellcount; z<=params.cellcount; z++) {
+			for(int y=-params.cellcount; y<=params.cellcount; y++) {
+				for(int x=-params.cellcount; x<=params.cellcount; x++) {
+					uint gridHash = calcGridHash(gridPos + make_int3(x, y, z));
+					if (params.boundaryModel == ParticleWalls)
+						force += sumBoundaryForcesBucket(gridHash + params.numGridCells, pos, oldPos,
+							bucketCount, bucketSlots, capacity);
+					force += sumNavierStokesForcesBucket(gridHash, index, pos, oldPos, vel, oldVel,
+						measure.x, measure.y, oldMeasures, bucketCount, bucketSlots, capacity);
+				}
+			}
+		}
+		if (params.boundaryModel == DistanceFieldWalls)
+			force += sumWallFieldForces(pos);
+		float3 acc = accumToFloat3(force);
+		acceleration[index] = make_float4(acc, 0.0f);
+}
+
+// Implicit incompressible SPH (Ihmsen et al. 2014, relaxed Jacobi form).
+// All passes run over the fluid head of the sorted list; wall particles are
+// static neighbours which take the pressure of the fluid particle they face.
+__device__ float3 gradKernel(float3 relPos){
+	float dist = length(relPos);
+	float q = dist / params.smoothingRadius;
+	if (q >= 2 || dist == 0.0f)
+		return make_float3(0.0f);
+	float temp = DamBreakKernel::gradientCoefficient(params.smoothingRadius) * DamBreakKernel::shapeDerivative(q);
+	return relPos / dist * temp;
+}
+
+__device__ void sumIisphAdvection(
+	uint    gridHash,
+	uint    index,
+	float3  pos,
+	float3  vel,
+	float   density,
+	float4* oldPos,
+	float4* oldVel,
+	float4* oldMeasures,
+	uint*   cellStart,
+	uint*   cellEnd,
+	float3& force,       // artificial viscosity
+	float3& gradSum,     // sum of m * grad W
+	float&  gradSquares){// sum of |grad W|^2 over fluid neighbours
+		uint startIndex = FETCH(cellStart, gridHash);
+		if (startIndex == 0xffffffff)
+			return;
+		uint endIndex = FETCH(cellEnd, gridHash);
+		for(uint j=startIndex; j<endIndex; j++) {
+			if (j == index)
+				continue;
+			float3 relPos = pos - make_float3(FETCH(oldPos, j));
+			float3 grad = gradKernel(relPos);
+			gradSum += params.particleMass * grad;
+			gradSquares += dot(grad, grad);
+
+			float vij_pij = dot(vel - make_float3(FETCH(oldVel, j)), relPos);
+			if (vij_pij < 0) {
+				float density2 = FETCH(oldMeasures, j).x;
+				float nu = 2.0f * 0.38f * params.smoothingRadius *
+					params.viscositySpeed / (density + density2);
+				float artViscosity = -1.0f * nu * vij_pij /
+					(dot(relPos, relPos) + 0.001f * params.smoothingRadius * params.smoothingRadius);
+				force += -1.0f * params.particleMass * artViscosity * grad;
+			}
+		}
+}
+
+__device__ float3 sumIisphBoundaryGradient(
+	uint    gridHash,
+	float3  pos,
+	float4* oldPos,
+	uint*   cellStart,
+	uint*   cellEnd){
+		uint startIndex = FETCH(cellStart, gridHash);
+		float3 gradSum = make_float3(0.0f);
+		if (startIndex != 0xffffffff) {
+			uint endIndex = FETCH(cellEnd, gridHash);
+			for(uint j=startIndex; j<endIndex; j++)
+				gradSum += params.particleMass * gradKernel(pos - make_float3(FETCH(oldPos, j)));
+		}
+		return gradSum;
+}
+
+// sum of m * (value_i - value_j) * grad W, value_j is zero for wall particles
+__device__ float sumIisphDivergence(
+	uint    gridHash,
+	uint    index,
+	float3  pos,
+	float3  value,
+	float4* values,
+	bool    isBoundary,
+	float4* oldPos,
+	uint*   cellStart,
+	uint*   cellEnd){
+		uint startIndex = FETCH(cellStart, gridHash);
+		float sum = 0.0f;
+		if (startIndex != 0xffffffff) {
+			uint endIndex = FETCH(cellEnd, gridHash);
+			for(uint j=startIndex; j<endIndex; j++) {
+				if (j == index)
+					continue;
+				float3 grad = gradKernel(pos - make_float3(FETCH(oldPos, j)));
+				float3 value2 = isBoundary ? make_float3(0.0f) : make_float3(values[j]);
+				sum += params.particleMass * dot(value - value2, grad);
+			}
+		}
+		return sum;
+}
+
+// non-pressure acceleration, advected velocity and diagonal a_ii
+__global__ void iisphPredictAdvectionD(
+	float4* velAdv,       // output, sorted: advected velocity, a_ii
+	float4* acceleration, // output, non-pressure part
+	float4* velocity,     // input, velocity at the start of the step
+	float4* oldMeasures,
+	float4* oldPos,
+	float4* oldVel,
+	uint*   gridParticleIndex,
+	uint*   cellStart,
+	uint*   cellEnd,
+	uint    numParticles){
+		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float3 pos = make_float3(FETCH(oldPos, index));
+		float3 vel = make_float3(FETCH(oldVel, index));
+		float density = FETCH(oldMeasures, index).x;
+		int3 gridPos = calcGridPos(pos);
+
+		float3 force = make_float3(0.0f);
+		float3 gradSum = make_float3(0.0f);
+		float gradSquares = 0.0f;
+		for(int z=-params.cellcount; z<=params.cellcount; z++) {
+			for(int y=-params.cellcount; y<=params.cellcount; y++) {
+				for(int x=-params.cellcount; x<=params.cellcount; x++) {
+					uint gridHash = calcGridHash(gridPos + make_int3(x, y, z));
+					if (params.boundarySubsteps == 1)
+						force += sumBoundaryForces(gridHash + params.numGridCells, pos, oldPos, cellStart, cellEnd);
+					gradSum += sumIisphBoundaryGradient(gridHash + params.numGridCells, pos, oldPos, cellStart, cellEnd);
+					sumIisphAdvection(gridHash, index, pos, vel, density,
+						oldPos, oldVel, oldMeasures, cellStart, cellEnd,
+						force, gradSum, gradSquares);
+				}
+			}
+		}
+
+		uint originalIndex = gridParticleIndex[index];
+		float3 v = make_float3(velocity[originalIndex]) + (params.gravity + force) * params.deltaTime;
+		float dt2 = params.deltaTime * params.deltaTime;
+		float aii = -dt2 * (dot(gradSum, gradSum) + params.particleMass * params.particleMass * gradSquares)
+			/ (density * density);
+		velAdv[index] = make_float4(v, aii);
+		acceleration[originalIndex] = make_float4(force, 0.0f);
+}
+
+// source term rho0 - rho_adv and the warm start of the pressure
+__global__ void iisphSourceD(
+	float4* measures,     // input, output: density, pressure, source
+	float4* velAdv,
+	float4* oldPos,
+	float4* oldVel,       // w holds the pressure of the previous step
+	uint*   cellStart,
+	uint*   cellEnd,
+	uint    numParticles){
+		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float3 pos = make_float3(FETCH(oldPos, index));
+		float3 v = make_float3(velAdv[index]);
+		int3 gridPos = calcGridPos(pos);
+
+		float divergence = 0.0f;
+		for(int z=-params.cellcount; z<=params.cellcount; z++) {
+			for(int y=-params.cellcount; y<=params.cellcount; y++) {
+				for(int x=-params.cellcount; x<=params.cellcount; x++) {
+					uint gridHash = calcGridHash(gridPos + make_int3(x, y, z));
+					divergence += sumIisphDivergence(gridHash, index, pos, v, velAdv, false, oldPos, cellStart, cellEnd);
+					divergence += sumIisphDivergence(gridHash + params.numGridCells, index, pos, v, velAdv, true, oldPos, cellStart, cellEnd);
+				}
+			}
+		}
+		float4 measure = measures[index];
+		float densityAdv = measure.x + params.deltaTime * divergence;
+		measures[index] = make_float4(measure.x, 0.5f * FETCH(oldVel, index).w,
+			params.restDensity - densityAdv, 0.0f);
+}
+
+__global__ void iisphPressureAccelerationD(
+	float4* pressureAcc, // output
+	float4* oldMeasures,
+	float4* oldPos,
+	uint*   cellStart,
+	uint*   cellEnd,
+	uint    numParticles){
+		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float3 pos = make_float3(FETCH(oldPos, index));
+		float4 measure = FETCH(oldMeasures, index);
+		float ratio = measure.y / (measure.x * measure.x);
+		int3 gridPos = calcGridPos(pos);
+
+		float3 acc = make_float3(0.0f);
+		for(int z=-params.cellcount; z<=params.cellcount; z++) {
+			for(int y=-params.cellcount; y<=params.cellcount; y++) {
+				for(int x=-params.cellcount; x<=params.cellcount; x++) {
+					uint gridHash = calcGridHash(gridPos + make_int3(x, y, z));
+					acc -= ratio * sumIisphBoundaryGradient(gridHash + params.numGridCells, pos, oldPos, cellStart, cellEnd);
+
+					uint startIndex = FETCH(cellStart, gridHash);
+					if (startIndex == 0xffffffff)
+						continue;
+					uint endIndex = FETCH(cellEnd, gridHash);
+					for(uint j=startIndex; j<endIndex; j++) {
+						if (j == index)
+							continue;
+						float4 measure2 = FETCH(oldMeasures, j);
+						float ratio2 = measure2.y / (measure2.x * measure2.x);
+						acc -= params.particleMass * (ratio + ratio2) *
+							gradKernel(pos - make_float3(FETCH(oldPos, j)));
+					}
+				}
+			}
+		}
+		pressureAcc[index] = make_float4(acc, 0.0f);
+}
+
+// one Jacobi sweep: p += omega * (source - A p) / a_ii, clamped at zero;
+// error is the predicted compression relative to rest density
+__global__ void iisphPressureUpdateD(
+	float4* measures,    // input, output
+	float*  error,       // output
+	float4* pressureAcc,
+	float4* velAdv,
+	float4* oldPos,
+	uint*   cellStart,
+	uint*   cellEnd,
+	uint    numParticles){
+		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float3 pos = make_float3(FETCH(oldPos, index));
+		float3 acc = make_float3(pressureAcc[index]);
+		int3 gridPos = calcGridPos(pos);
 
+		float sum = 0.0f;
+		for(int z=-params.cellcount; z<=params.cellcount; z++) {
+			for(int y=-params.cellcount; y<=params.cellcount; y++) {
+				for(int x=-params.cellcount; x<=params.cellcount; x++) {
+					uint gridHash = calcGridHash(gridPos + make_int3(x, y, z));
+					sum += sumIisphDivergence(gridHash, index, pos, acc, pressureAcc, false, oldPos, cellStart, cellEnd);
+					sum += sumIisphDivergence(gridHash + params.numGridCells, index, pos, acc, pressureAcc, true, oldPos, cellStart, cellEnd);
+				}
+			}
+		}
+		float ap = params.deltaTime * params.deltaTime * sum;
+		float4 measure = measures[index];
+		float aii = velAdv[index].w;
+		float pressure = 0.0f;
+		if (fabsf(aii) > 1.0e-9f)
+			pressure = fmaxf(measure.y + params.iisphOmega * (measure.z - ap) / aii, 0.0f);
+		measures[index].y = pressure;
+		error[index] = fmaxf(ap - measure.z, 0.0f) / params.restDensity;
+}
+
+__global__ void iisphApplyPressureD(
+	float4* acceleration, // input, output
+	float4* velLeapFrog,  // output, w keeps the pressure for the next warm start
+	float4* pressureAcc,
+	float4* measures,
+	uint*   gridParticleIndex,
+	uint    numParticles){
+		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		uint originalIndex = gridParticleIndex[index];
+		acceleration[originalIndex] += make_float4(make_float3(pressureAcc[index]), 0.0f);
+		velLeapFrog[originalIndex].w = measures[index].y;
+}
+
+__global__ void shiftRightBoundaryD(
+	float4* posArray,		 
+	uint numParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;          		
+		
+		volatile float4 posData = posArray[index]; 
+		if((posData.w != RightFirstType) && (posData.w != RightSecondType))
+			return;
+
+		float halfWorldXSize = params.fluidParticlesSize.x * 2 * params.particleRadius;				
+		posArray[index] = make_float4(posData.x + halfWorldXSize, posData.y, posData.z, posData.w);
+}
+
+__global__ void removeRightBoundaryD(
+	float4* posArray,		 
+	uint numParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;          		
+		
+		volatile float4 posData = posArray[index]; 
+		if((posData.w != RightFirstType) && (posData.w != RightSecondType))
+			return;
+
+		float fluidWidth = params.fluidParticlesSize.x * 2 * params.particleRadius;				
+		float height = params.gridSize.y * 2 * params.particleRadius;
+		posArray[index] = make_float4(fluidWidth, height, posData.z, posData.w);
+}
+
+// removes kinetic energy during the hydrostatic relaxation
+__global__ void dampVelocityD(
+	float4* velArray,		 // input, output
+	float4* velLeapFrogArray, // input, output
+	float factor,
+	uint numParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float4 vel = velArray[index];
+		float4 velLeapFrog = velLeapFrogArray[index];
+		velArray[index] = make_float4(factor * make_float3(vel), vel.w);
+		velLeapFrogArray[index] = make_float4(factor * make_float3(velLeapFrog), velLeapFrog.w);
+}
+
+struct speedSquared {
+	__host__ __device__ float operator()(const float4& v) const {
+		return v.x * v.x + v.y * v.y + v.z * v.z;
+	}
+};
+
+__device__ void applyTankBorders(float3& pos, float3& vel){
 		float leftBorder = params.worldOrigin.x + params.boundaryOffset * 2 * params.particleRadius;		
 		float bottomBorder = params.worldOrigin.y + params.boundaryOffset * 2 * params.particleRadius;	
 		
@@ -359,6 +1519,416 @@ __global__ void integrate(
 
 		if (pos.y < bottomBorder){
 			pos.y = bottomBorder; vel.y *= params.boundaryDamping;}	
+}
+
+// Multiple time stepping: the full pass kicks velocities with the SPH forces
+// over deltaTime, then wall forces act on substeps. Walls do not move within
+// a step, so their sorted positions and cell ranges stay valid.
+__global__ void slowKickD(
+	float4* velArray,		 // input, output
+	float4* velLeapFrogArray, // output, start velocity until the last substep
+	float4* acceleration,	 // input, forces of the full pass
+	uint numParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float4 velData = velArray[index];
+		float3 vel = make_float3(velData);
+		float3 acc = make_float3(acceleration[index]);
+		velLeapFrogArray[index] = make_float4(vel, velLeapFrogArray[index].w);
+		velArray[index] = make_float4(vel + (params.gravity + acc) * params.deltaTime, velData.w);
+}
+
+__global__ void boundarySubstepD(
+	float4* posArray,		 // input, output
+	float4* velArray,		 // input, output
+	float4* velLeapFrogArray, // input, output
+	float4* oldPos,           // sorted positions of the full pass
+	uint* cellStart,
+	uint* cellEnd,
+	float substep,
+	bool lastSubstep,
+	uint numParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float4 posData = posArray[index];
+		float4 velData = velArray[index];
+		float3 pos = make_float3(posData);
+		float3 vel = make_float3(velData);
+
+		float3 force = make_float3(0.0f);
+		if (params.boundaryModel == ParticleWalls) {
+			int3 gridPos = calcGridPos(pos);
+			for(int z=-params.cellcount; z<=params.cellcount; z++) {
+				for(int y=-params.cellcount; y<=params.cellcount; y++) {
+					for(int x=-params.cellcount; x<=params.cellcount; x++) {
+						uint gridHash = calcGridHash(gridPos + make_int3(x, y, z));
+						force += sumBoundaryForces(gridHash + params.numGridCells, pos, oldPos, cellStart, cellEnd);
+					}
+				}
+			}
+		} else
+			force = sumWallFieldForces(pos);
+
+		vel += force * substep;
+		pos += vel * substep;
+		applyTankBorders(pos, vel);
+
+		posArray[index] = make_float4(pos, posData.w);
+		velArray[index] = make_float4(vel, velData.w);
+		if (lastSubstep) {
+			float4 start = velLeapFrogArray[index];
+			velLeapFrogArray[index] = make_float4(0.5f * (make_float3(start) + vel), start.w);
+		}
+}
+
+// Courant limit on the kernel support and force limit of one fluid particle
+__device__ float blockTimeLimit(float3 vel, float3 acc){
+	float support = 2.0f * params.smoothingRadius;
+	float dt = 0.4f * support / (params.soundspeed + length(vel));
+	if (length(acc) > 0.0f)
+		dt = fminf(dt, 0.25f * sqrtf(support / length(acc)));
+	return dt;
+}
+
+// velocity and acceleration of the last active substep
+struct blockTimeLimitOf {
+	template <typename Tuple>
+	__device__ float operator()(const Tuple& t) const {
+		float4 vel = thrust::get<0>(t);
+		float4 acc = thrust::get<1>(t);
+		return blockTimeLimit(make_float3(vel), params.gravity + make_float3(acc));
+	}
+};
+
+__global__ void blockIntegrateD(
+	float4* posArray,		 // input, output
+	float4* velArray,		 // input, output
+	float4* velLeapFrogArray, // output
+	float4* acceleration,	 // input
+	uint*   level,            // input, output
+	uint    substep,
+	float   substepTime,
+	uint    numParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float4 posData = posArray[index];
+		float4 velData = velArray[index];
+		float3 pos = make_float3(posData);
+		float3 vel = make_float3(velData);
+
+		uint l = level[index];
+		if (isActive(l, substep)) {
+			float3 acc = params.gravity + make_float3(acceleration[index]);
+
+			//substepTime is the smallest limit of the step, level l runs at 2^l of it
+			float dt = blockTimeLimit(vel, acc);
+			l = 0;
+			while (l < params.blockLevels && substepTime * (2u << l) <= dt)
+				l++;
+			//coarser levels are only entered on substeps aligned with them
+			while (!isActive(l, substep))
+				l--;
+			level[index] = l;
+
+			float3 nextVel = vel + acc * (substepTime * (1u << l));
+			float4 velLeapFrogData = velLeapFrogArray[index];
+			velLeapFrogArray[index] = make_float4(0.5f * (vel + nextVel), velLeapFrogData.w);
+			vel = nextVel;
+		}
+
+		pos += vel * substepTime;
+		applyTankBorders(pos, vel);
+
+		posArray[index] = make_float4(pos, posData.w);
+		velArray[index] = make_float4(vel, velData.w);
+}
+
+#define NO_CHILDREN 0xffffffff
+
+enum RefinementFlag
+{
+	RefineKeep,
+	RefineSplit,
+	RefineMerge,
+};
+
+// kernel sum on the level 0 smoothing length whatever the levels are, so
+// split and merge decisions do not depend on the current resolution
+__device__ float sumCoarseDensity(
+	uint    gridHash,
+	float3  pos,
+	float4* oldPos,
+	float4* oldVel,
+	uint*   cellStart,
+	uint*   cellEnd){
+		uint startIndex = FETCH(cellStart, gridHash);
+
+		float sum = 0.0f;
+		if (startIndex != 0xffffffff) {
+			uint endIndex = FETCH(cellEnd, gridHash);
+			float coeff = DamBreakKernel::coefficient(params.smoothingRadius);
+			for(uint j=startIndex; j<endIndex; j++) {
+				float q = length(pos - make_float3(FETCH(oldPos, j))) / params.smoothingRadius;
+				if(q < 2)
+					sum += refinedMass(FETCH(oldVel, j).w) * coeff * DamBreakKernel::shape(q);
+			}
+		}
+		return sum;
+}
+
+// free surface and front have a deficient kernel sum: level 0 particles
+// there are split, level 1 particles with full support may merge back
+__global__ void markRefinementD(
+	uint*   flags,        // output, particle order
+	float4* oldPos,
+	float4* oldVel,
+	uint*   gridParticleIndex,
+	uint*   cellStart,
+	uint*   cellEnd,
+	float   splitRatio,
+	float   mergeRatio,
+	uint    numParticles){
+		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float3 pos = make_float3(FETCH(oldPos, index));
+		float level = FETCH(oldVel, index).w;
+		int3 gridPos = calcGridPos(pos);
+
+		float sum = 0.0f;
+		for(int z=-params.cellcount; z<=params.cellcount; z++) {
+			for(int y=-params.cellcount; y<=params.cellcount; y++) {
+				for(int x=-params.cellcount; x<=params.cellcount; x++) {
+					uint gridHash = calcGridHash(gridPos + make_int3(x, y, z));
+					sum += sumCoarseDensity(gridHash, pos, oldPos, oldVel, cellStart, cellEnd);
+					sum += sumCoarseDensity(gridHash + params.numGridCells, pos, oldPos, oldVel, cellStart, cellEnd);
+				}
+			}
+		}
+		float ratio = sum * params.particleMass / params.restDensity;
+
+		uint flag = RefineKeep;
+		if (level == 0.0f && ratio < splitRatio)
+			flag = RefineSplit;
+		if (level > 0.0f && ratio > mergeRatio)
+			flag = RefineMerge;
+		flags[gridParticleIndex[index]] = flag;
+}
+
+// a family head replaces its four members by one level 0 particle at their
+// centre of mass with their mean velocity, the other three slots are freed
+__global__ void mergeParticlesD(
+	float4* posArray,         // input, output
+	float4* velArray,         // input, output
+	float4* velLeapFrogArray, // input, output
+	float4* acceleration,     // input, output
+	uint4*  children,         // input, output
+	uint*   flags,
+	uint    numParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		uint4 family = children[index];
+		if (family.x == NO_CHILDREN)
+			return;
+		uint member[4] = {index, family.x, family.y, family.z};
+		for(int k = 0; k < 4; k++)
+			if (flags[member[k]] != RefineMerge)
+				return;
+
+		float3 pos = make_float3(0.0f);
+		float3 vel = make_float3(0.0f);
+		float3 velLeapFrog = make_float3(0.0f);
+		float3 acc = make_float3(0.0f);
+		for(int k = 0; k < 4; k++) {
+			pos += make_float3(posArray[member[k]]);
+			vel += make_float3(velArray[member[k]]);
+			velLeapFrog += make_float3(velLeapFrogArray[member[k]]);
+			acc += make_float3(acceleration[member[k]]);
+		}
+		for(int k = 1; k < 4; k++) {
+			posArray[member[k]].w = Inactive;
+			velArray[member[k]] = make_float4(0.0f);
+			velLeapFrogArray[member[k]] = make_float4(0.0f);
+		}
+
+		float4 posData = posArray[index];
+		posArray[index] = make_float4(0.25f * pos, posData.w);
+		velArray[index] = make_float4(0.25f * vel, velArray[index].w);
+		velLeapFrogArray[index] = make_float4(0.25f * velLeapFrog, 0.0f);
+		acceleration[index] = make_float4(0.25f * acc, 0.0f);
+		children[index].x = NO_CHILDREN;
+}
+
+// a level 0 particle becomes four level 1 children on a square of side
+// particleRadius; the parent slot keeps the first child, the others take
+// free slots in order of the split rank. Without free slots it stays coarse.
+__global__ void splitParticlesD(
+	float4* posArray,         // input, output
+	float4* velArray,         // input, output
+	float4* velLeapFrogArray, // input, output
+	float4* acceleration,     // input, output
+	uint4*  children,         // output
+	uint*   flags,
+	uint*   splitRank,        // exclusive scan of split flags
+	uint*   freeSlots,
+	uint    numFreeSlots,
+	uint    numParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+		if (flags[index] != RefineSplit) return;
+
+		uint rank = splitRank[index];
+		if (3 * rank + 3 > numFreeSlots)
+			return;
+
+		float4 posData = posArray[index];
+		float4 velData = velArray[index];
+		float4 velLeapFrogData = velLeapFrogArray[index];
+		float4 accData = acceleration[index];
+		uint slot[4] = {index, freeSlots[3 * rank], freeSlots[3 * rank + 1], freeSlots[3 * rank + 2]};
+		float d = 0.5f * params.particleRadius;
+		for(int k = 0; k < 4; k++) {
+			float dx = (k & 1) ? d : -d;
+			float dy = (k & 2) ? d : -d;
+			posArray[slot[k]] = make_float4(posData.x + dx, posData.y + dy, posData.z, Fluid);
+			velArray[slot[k]] = velData;
+			velLeapFrogArray[slot[k]] = make_float4(make_float3(velLeapFrogData), 1.0f);
+			acceleration[slot[k]] = accData;
+			children[slot[k]].x = NO_CHILDREN;
+		}
+		children[index] = make_uint4(slot[1], slot[2], slot[3], 0);
+}
+
+struct isSplitFlag {
+	__host__ __device__ uint operator()(const uint& flag) const {
+		return (flag == RefineSplit) ? 1 : 0;
+	}
+};
+
+struct isInactiveSlot {
+	__host__ __device__ bool operator()(const float4& pos) const {
+		return pos.w == Inactive;
+	}
+};
+
+struct isFluidSlot {
+	__host__ __device__ bool operator()(const float4& pos) const {
+		return pos.w == Fluid;
+	}
+};
+
+// Subdomains: fluid slots hold owned particles, halo copies of the
+// neighbours' particles near the shared edges and free slots.
+__global__ void retypeParticlesD(
+	float4* posArray,         // input, output
+	float4* velArray,         // output
+	float4* velLeapFrogArray, // output
+	float   fromType,
+	float   toType,
+	float   xMin,
+	float   xMax,
+	uint    numParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float4 posData = posArray[index];
+		if (posData.w != fromType || posData.x < xMin || posData.x >= xMax)
+			return;
+		posArray[index].w = toType;
+		if (toType == Inactive) {
+			velArray[index] = make_float4(0.0f);
+			velLeapFrogArray[index] = make_float4(0.0f);
+		}
+}
+
+__global__ void insertParticlesD(
+	float4* posArray,         // output
+	float4* velArray,         // output
+	float4* velLeapFrogArray, // output
+	float4* records,          // input: count positions, velocities, leapfrog velocities
+	uint*   freeSlots,
+	float   type,
+	uint    count){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= count) return;
+
+		uint slot = freeSlots[index];
+		float4 pos = records[index];
+		posArray[slot] = make_float4(pos.x, pos.y, pos.z, type);
+		velArray[slot] = records[count + index];
+		velLeapFrogArray[slot] = records[2 * count + index];
+}
+
+struct isOwnedInSlab {
+	float xMin, xMax;
+	isOwnedInSlab(float xMin, float xMax) : xMin(xMin), xMax(xMax) {}
+	template <typename Tuple>
+	__host__ __device__ bool operator()(const Tuple& t) const {
+		float4 pos = thrust::get<0>(t);
+		return pos.w == Fluid && pos.x >= xMin && pos.x < xMax;
+	}
+};
+
+struct isActiveSlot {
+	__host__ __device__ bool operator()(const float4& pos) const {
+		return pos.w != Inactive;
+	}
+};
+
+// Deterministic reductions: every block sums SUM_BLOCK_SIZE consecutive
+// values with a fixed pairwise tree, so the rounding depends on n only,
+// not on the device or the launch configuration.
+#define SUM_BLOCK_SIZE 256
+
+__global__ void blockSumD(
+	float* blockSums, // output, one per block
+	float* values,
+	uint   n){
+		__shared__ float partial[SUM_BLOCK_SIZE];
+		uint index = blockIdx.x * SUM_BLOCK_SIZE + threadIdx.x;
+		partial[threadIdx.x] = (index < n) ? values[index] : 0.0f;
+		__syncthreads();
+		for(uint stride = SUM_BLOCK_SIZE / 2; stride > 0; stride >>= 1){
+			if (threadIdx.x < stride)
+				partial[threadIdx.x] += partial[threadIdx.x + stride];
+			__syncthreads();
+		}
+		if (threadIdx.x == 0)
+			blockSums[blockIdx.x] = partial[0];
+}
+
+__global__ void integrate(
+	float4* posArray,		 // input, output
+	float4* velArray,		 // input, output  
+	float4* velLeapFrogArray, // output
+	float4* acceleration,	 // input
+	uint numParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;          		
+
+		volatile float4 posData = posArray[index]; 
+		if (posData.w != Fluid) return; //free slots and halo copies stay put
+		volatile float4 velData = velArray[index];
+		volatile float4 accData = acceleration[index];
+		volatile float4 velLeapFrogData = velLeapFrogArray[index];
+
+		float3 pos = make_float3(posData.x, posData.y, posData.z);
+		float3 vel = make_float3(velData.x, velData.y, velData.z);
+		float3 acc = make_float3(accData.x, accData.y, accData.z);
+
+		float3 nextVel = vel + (params.gravity + acc) * params.deltaTime;
+
+		float3 velLeapFrog = vel + nextVel;
+		velLeapFrog *= 0.5;
+
+		vel = nextVel;   	
+		pos += vel * params.deltaTime;   
+
+		applyTankBorders(pos, vel);
 	    
 		posArray[index] = make_float4(pos, posData.w);
 		velArray[index] = make_float4(vel, velData.w);
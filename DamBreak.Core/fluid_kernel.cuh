@@ -1,6 +1,7 @@
 #ifndef _FLUID_KERNEL_CUH
 #define _FLUID_KERNEL_CUH
 #include "vector_types.h"
+#include "../Common/sph_kernels.h"
 #ifndef __DEVICE_EMULATION__
 #define USE_TEX 1
 #endif
@@ -12,6 +13,42 @@
 #endif
 
 typedef unsigned int uint;
+typedef unsigned short ushort;
+
+// smoothing kernel and equation of state, see Common/sph_kernels.h
+typedef sph::WendlandC2<2> DamBreakKernel;
+typedef sph::Tait<7> DamBreakEos;
+
+// Precision policy, chosen at compile time with -DSPH_PRECISION=n:
+// float pair terms and sums, float pair terms with double sums (and host
+// time), or double pair terms and sums. Applies to the density and force
+// passes of the weakly compressible step. Particle arrays stay float4 in all
+// three (textures have no double4 fetch): positions, velocities and measures
+// are stored and integrated in float, the double policy only widens the
+// arithmetic between loading and storing them. The compact neighbour path
+// and the implicit solver stay float. The double policy needs sm_13 or newer.
+#define SPH_PRECISION_FLOAT  0
+#define SPH_PRECISION_MIXED  1
+#define SPH_PRECISION_DOUBLE 2
+#ifndef SPH_PRECISION
+#define SPH_PRECISION SPH_PRECISION_FLOAT
+#endif
+
+#if SPH_PRECISION == SPH_PRECISION_FLOAT
+typedef float sph_real;  // kernel and pair terms
+typedef float sph_accum; // neighbour sums, elapsed time
+#elif SPH_PRECISION == SPH_PRECISION_MIXED
+typedef float sph_real;
+typedef double sph_accum;
+#elif SPH_PRECISION == SPH_PRECISION_DOUBLE
+typedef double sph_real;
+typedef double sph_accum;
+#else
+#error "SPH_PRECISION must be 0 (float), 1 (mixed) or 2 (double)"
+#endif
+
+// pair cache: fluid neighbours kept per particle between the density and force passes
+#define PAIR_CACHE_SIZE 64
 
 enum BoundaryTypes
 {
@@ -20,10 +57,19 @@ enum BoundaryTypes
 	RightSecondType,
 	SecondType,
 	Fluid,
+	Inactive, //free fluid slot of adaptive refinement or a subdomain, sorted after all walls
+	Halo,     //copy of a neighbour subdomain's fluid particle, in density and forces only
+};
+
+enum BoundaryModel
+{
+	ParticleWalls,      //wall particles with Lennard-Jones repulsion
+	DistanceFieldWalls, //precomputed distance/normal field, no wall particles
 };
 
 struct SimParams {     
 	uint3 gridSize;
+	uint numGridCells; //boundary particles are stored after fluid ones, at hash + numGridCells
 	float3 worldOrigin;
 	float3 cellSize;
 	uint3 fluidParticlesSize;
@@ -35,11 +81,13 @@ struct SimParams {
 	float particleMass;
 	float restDensity;
 	float soundspeed;
+	float viscositySpeed; //velocity scale of artificial viscosity in the implicit solver
 	float B;//Equation of state    
 	
 	//float Poly6Kern;
 	//float SpikyKern;		
 	float deltaTime;		
+	float iisphOmega; //relaxation of the implicit pressure iteration
 	float gamma;
 	float boundaryDamping;	
 
@@ -48,5 +96,17 @@ struct SimParams {
 
 	float D; //Lennard - Jones
 	float a;
+	int boundarySubsteps; //> 1: wall forces leave the full pass and act on substeps of deltaTime
+	int blockLevels;      //block time stepping: deltaTime is split into 2^blockLevels substeps
+	int adaptiveRefinement; //fluid particles split once, the level is kept in velLeapFrog.w
+
+	int boundaryModel;
+	//distance field walls: per node distance to first wall layer (positive on fluid side),
+	//normal and kernel sum of wall layers; gate field is sampled shifted by gateShift
+	float4* tankField;
+	float4* gateField;
+	uint2 fieldSize;
+	float fieldSpacing;
+	float gateShift;
 };
 #endif
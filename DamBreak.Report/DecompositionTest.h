@@ -0,0 +1,280 @@
+// YFront case split into x slabs owned by forked worker processes on one host,
+// a local stand-in for the multi-node decomposition. Each step the workers
+// hand over particles that left their slab, then exchange halo copies of the
+// fluid near the shared edges through single producer/consumer rings in
+// shared memory. POSIX only.
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <unistd.h>
+#include <assert.h>
+#include <string.h>
+#include <cfloat>
+#include <vector>
+
+const int DecompositionWorkers = 2;
+
+// byte ring, one per direction of each shared edge
+struct HaloRing {
+	volatile unsigned long long head; // written by the producer
+	volatile unsigned long long tail; // written by the consumer
+	size_t capacity;
+	char* data;
+};
+
+// sense reversing barrier and per worker results, all in shared memory
+struct DecompositionShared {
+	volatile int barrierCount;
+	volatile int barrierSense;
+	volatile float height[DecompositionWorkers];
+	volatile double exchangeSeconds[DecompositionWorkers];
+	volatile double stepSeconds[DecompositionWorkers];
+	volatile uint steps[DecompositionWorkers];
+	volatile uint exchanged[DecompositionWorkers]; // particles sent, migrants and halo
+	volatile uint dropped[DecompositionWorkers];   // received particles without a free slot
+};
+
+void ringCopy(HaloRing* ring, unsigned long long position, const char* src, size_t size){
+	size_t offset = position % ring->capacity;
+	size_t first = min(size, ring->capacity - offset);
+	memcpy(ring->data + offset, src, first);
+	memcpy(ring->data, src + first, size - first);
+}
+
+void ringPeek(HaloRing* ring, unsigned long long position, char* dst, size_t size){
+	size_t offset = position % ring->capacity;
+	size_t first = min(size, ring->capacity - offset);
+	memcpy(dst, ring->data + offset, first);
+	memcpy(dst + first, ring->data, size - first);
+}
+
+// message is the record count followed by 3 * count float4 records
+void ringSend(HaloRing* ring, const float* records, uint count){
+	size_t size = sizeof(uint) + 12 * count * sizeof(float);
+	assert(size <= ring->capacity);
+	unsigned long long head = ring->head;
+	while (head + size - ring->tail > ring->capacity)
+		sched_yield();
+	ringCopy(ring, head, (const char*)&count, sizeof(uint));
+	ringCopy(ring, head + sizeof(uint), (const char*)records, size - sizeof(uint));
+	__sync_synchronize();
+	ring->head = head + size;
+}
+
+uint ringReceive(HaloRing* ring, float* records){
+	unsigned long long tail = ring->tail;
+	while (ring->head == tail)
+		sched_yield();
+	__sync_synchronize();
+	uint count;
+	ringPeek(ring, tail, (char*)&count, sizeof(uint));
+	ringPeek(ring, tail + sizeof(uint), (char*)records, 12 * count * sizeof(float));
+	__sync_synchronize();
+	ring->tail = tail + sizeof(uint) + 12 * count * sizeof(float);
+	return count;
+}
+
+void decompositionBarrier(DecompositionShared* shared, int& sense){
+	sense = !sense;
+	if (__sync_add_and_fetch(&shared->barrierCount, 1) == DecompositionWorkers) {
+		shared->barrierCount = 0;
+		__sync_synchronize();
+		shared->barrierSense = sense;
+	} else {
+		while (shared->barrierSense != sense)
+			sched_yield();
+	}
+	__sync_synchronize();
+}
+
+double decompositionClock(){
+	timeval t;
+	gettimeofday(&t, 0);
+	return t.tv_sec + 1e-6 * t.tv_usec;
+}
+
+// highest owned fluid particle of this worker
+float localFluidHeight(DamBreakSystem* psystem){
+	thrust::device_ptr<float4> dev_ptr((float4*)psystem->getCudaPosVBO());
+	thrust::host_vector<float4> h_vec(psystem->getNumParticles());
+	thrust::copy(dev_ptr, dev_ptr + psystem->getNumParticles(), h_vec.begin());
+	float y = -FLT_MAX;
+	for(uint i = 0; i < h_vec.size(); i++)
+		if (h_vec[i].w == Fluid)
+			y = max(y, h_vec[i].y);
+	return y;
+}
+
+float globalFluidHeight(DamBreakSystem* psystem, DecompositionShared* shared, int worker, int& sense){
+	shared->height[worker] = localFluidHeight(psystem);
+	decompositionBarrier(shared, sense);
+	float y = -FLT_MAX;
+	for(int w = 0; w < DecompositionWorkers; w++)
+		y = max(y, shared->height[w]);
+	decompositionBarrier(shared, sense);
+	return y;
+}
+
+struct DecompositionWorker {
+	DamBreakSystem* psystem;
+	DecompositionShared* shared;
+	int worker;
+	float xMin, xMax, haloWidth;
+	HaloRing* send[2];    // to the left and right neighbours, 0 at the tank walls
+	HaloRing* receive[2];
+	std::vector<float> records;
+
+	// migrants first, so that particles which changed owner are in the halo of this step
+	void exchange(){
+		float bands[2][2] = {{-FLT_MAX, xMin}, {xMax, FLT_MAX}};
+		for(int side = 0; side < 2; side++)
+			if (send[side]) {
+				uint count = psystem->exportParticles(bands[side][0], bands[side][1], true, &records[0]);
+				ringSend(send[side], &records[0], count);
+				shared->exchanged[worker] += count;
+			}
+		for(int side = 0; side < 2; side++)
+			if (receive[side])
+				receiveParticles(receive[side], false);
+
+		float halos[2][2] = {{xMin, xMin + haloWidth}, {xMax - haloWidth, xMax}};
+		psystem->clearHalo();
+		for(int side = 0; side < 2; side++)
+			if (send[side]) {
+				uint count = psystem->exportParticles(halos[side][0], halos[side][1], false, &records[0]);
+				ringSend(send[side], &records[0], count);
+				shared->exchanged[worker] += count;
+			}
+		for(int side = 0; side < 2; side++)
+			if (receive[side])
+				receiveParticles(receive[side], true);
+	}
+
+	void receiveParticles(HaloRing* ring, bool halo){
+		uint count = ringReceive(ring, &records[0]);
+		shared->dropped[worker] += count - psystem->importParticles(&records[0], count, halo);
+	}
+
+	void step(){
+		double start = decompositionClock();
+		exchange();
+		double exchanged = decompositionClock();
+		psystem->update();
+		cudaThreadSynchronize();
+		shared->exchangeSeconds[worker] += exchanged - start;
+		shared->stepSeconds[worker] += decompositionClock() - exchanged;
+		shared->steps[worker]++;
+	}
+};
+
+// same case and output as YFrontTest, worker 0 writes the file
+void YFrontDecompositionWorker(DecompositionShared* shared, HaloRing* rings, int worker, const char* outputName){
+	int num = 128;
+	uint3 fluidParticlesSize = make_uint3(num, 2 * num, 1);
+	uint3 gridSize = make_uint3(512, 256, 4);
+	float radius = 1.0f / (2 * num);
+	int boundaryOffset = 1;
+
+	DamBreakSystem *psystem = new DamBreakSystem(fluidParticlesSize, boundaryOffset, gridSize, radius, false);
+	//equal slabs of the column, the outer ones open towards the tank walls
+	float columnLeft = psystem->getWorldOrigin().x + boundaryOffset * 2 * radius;
+	float slabWidth = fluidParticlesSize.x * 2 * radius / DecompositionWorkers;
+	DecompositionWorker w;
+	w.psystem = psystem;
+	w.shared = shared;
+	w.worker = worker;
+	w.xMin = (worker == 0) ? -FLT_MAX : columnLeft + worker * slabWidth;
+	w.xMax = (worker == DecompositionWorkers - 1) ? FLT_MAX : columnLeft + (worker + 1) * slabWidth;
+	//two kernel supports: halo particles get their density from local neighbours too
+	w.haloWidth = 4 * psystem->getSmoothingRadius();
+	//ring 2k goes from worker k to k + 1, ring 2k + 1 back
+	w.send[0] = (worker > 0) ? &rings[2 * (worker - 1) + 1] : 0;
+	w.send[1] = (worker < DecompositionWorkers - 1) ? &rings[2 * worker] : 0;
+	w.receive[0] = (worker > 0) ? &rings[2 * (worker - 1)] : 0;
+	w.receive[1] = (worker < DecompositionWorkers - 1) ? &rings[2 * worker + 1] : 0;
+	psystem->setSubdomain(w.xMin, w.xMax);
+	w.records.resize(12 * psystem->getNumParticles());
+	psystem->reset();
+
+	int sense = 0;
+	while(psystem->getElapsedTime() < 1.5f)
+		w.step();
+	psystem->removeRightBoundary();
+
+	float yheight = globalFluidHeight(psystem, shared, worker, sense) + radius - psystem->getWorldOrigin().y;
+	float timeScale = sqrt(2 * fabs(psystem->getGravity().y) / yheight);
+	FILE *file = (worker == 0) ? fopen(outputName, "w") : 0;
+	for(int k = 0; k < YFrontFrames; k++){
+		//all workers take the same fixed steps
+		while(psystem->getElapsedTime() * timeScale < YFrontFrameData[k][0])
+			w.step();
+		float y = globalFluidHeight(psystem, shared, worker, sense);
+		if (file)
+			fprintf(file, "%f %f %f %f \n",
+				YFrontFrameData[k][0],
+				psystem->getElapsedTime(),
+				YFrontFrameData[k][1],
+				(y + radius - psystem->getWorldOrigin().y) / yheight);
+	}
+	if (file)
+		fclose(file);
+	delete psystem;
+}
+
+// forked workers, each with its own CUDA context on the same device;
+// the parent touches CUDA only after they exit
+bool YFrontDecompositionTest(){
+	const char* outputName = "YFrontOutputDecomposed";
+	size_t ringCapacity = 64 << 20;
+	int numRings = 2 * (DecompositionWorkers - 1);
+	size_t size = sizeof(DecompositionShared) + numRings * (sizeof(HaloRing) + ringCapacity);
+	char* memory = (char*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+		cout << "Decomposition: shared memory not available" << endl;
+		return false;
+	}
+	memset(memory, 0, size);
+	DecompositionShared* shared = (DecompositionShared*)memory;
+	HaloRing* rings = (HaloRing*)(memory + sizeof(DecompositionShared));
+	char* ringData = (char*)(rings + numRings);
+	for(int k = 0; k < numRings; k++){
+		rings[k].capacity = ringCapacity;
+		rings[k].data = ringData + k * ringCapacity;
+	}
+
+	pid_t workers[DecompositionWorkers];
+	for(int w = 0; w < DecompositionWorkers; w++){
+		workers[w] = fork();
+		if (workers[w] == 0) {
+			YFrontDecompositionWorker(shared, rings, w, outputName);
+			_exit(0);
+		}
+	}
+	bool failed = false;
+	for(int w = 0; w < DecompositionWorkers; w++){
+		int status;
+		waitpid(workers[w], &status, 0);
+		failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	}
+	for(int w = 0; w < DecompositionWorkers; w++)
+		failed |= shared->dropped[w] > 0;
+	if (failed) {
+		cout << "Decomposition: worker failed or dropped received particles" << endl;
+		munmap(memory, size);
+		return false;
+	}
+
+	for(int w = 0; w < DecompositionWorkers; w++)
+		cout << "Decomposition worker " << w << ": " << shared->steps[w] << " steps, "
+			<< 1000 * shared->exchangeSeconds[w] / shared->steps[w] << " ms exchange and "
+			<< 1000 * shared->stepSeconds[w] / shared->steps[w] << " ms update per step, "
+			<< (float)shared->exchanged[w] / shared->steps[w] << " particles sent per step" << endl;
+	munmap(memory, size);
+
+	//summation order differs at the slab edges, results are close, not bitwise equal
+	YFrontReference();
+	return YFrontCompare("YFrontOutput", outputName, YFrontReorderTolerance);
+}
+#endif
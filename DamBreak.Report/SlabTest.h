@@ -0,0 +1,328 @@
+// YFront case split into x slabs inside one process. Every slab is its own
+// DamBreakSystem on its own device where there are enough of them, driven
+// by a host thread pinned to the CPUs of the NUMA node the device hangs off.
+// Exchange buffers are first touched by the owning thread, so they live on
+// that node and neighbours only read the thin halo across the interconnect.
+// Slab edges follow the owned fluid as the front moves. Uses the helpers of
+// DecompositionTest.h, POSIX only.
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <ctype.h>
+
+const int SlabCount = 2;
+const uint SlabRebalanceInterval = 200;
+
+struct SlabShared;
+
+struct Slab {
+	SlabShared* shared;
+	DamBreakSystem* psystem;
+	int index;
+	int device;
+	int node;                // -1 if the device has no NUMA affinity
+	float xMin, xMax, haloWidth;
+	std::vector<float> out[2][2]; // migrants and halo, to the left and right neighbour
+	uint outCount[2][2];
+	std::vector<float> in;
+	std::vector<float> ownedX;    // x of owned fluid for rebalancing
+	double exchangeSeconds;       // whole exchange, barrier and device lock waits included
+	double copySeconds;           // export, import and their copies alone
+	double stepSeconds, exchangedBytes;
+	uint steps;
+	uint dropped;                 // received particles without a free slot
+	float height;
+};
+
+struct SlabShared {
+	Slab slabs[SlabCount];
+	pthread_barrier_t barrier;
+	pthread_mutex_t deviceLock[SlabCount]; // per device, slabs sharing one share its constant memory
+	float edges[SlabCount + 1];
+	const char* outputName;
+};
+
+// NUMA node of a CUDA device from sysfs, -1 if unknown
+int deviceNumaNode(int device){
+	char busId[32];
+	if (cudaDeviceGetPCIBusId(busId, sizeof(busId), device) != cudaSuccess)
+		return -1;
+	for(char* c = busId; *c; c++)
+		*c = tolower(*c);
+	char path[128];
+	sprintf(path, "/sys/bus/pci/devices/%s/numa_node", busId);
+	FILE* file = fopen(path, "r");
+	int node = -1;
+	if (file) {
+		if (fscanf(file, "%d", &node) != 1)
+			node = -1;
+		fclose(file);
+	}
+	return node;
+}
+
+// pins the calling thread to the CPUs listed for the node, e.g. "0-15,32-47"
+void pinToNumaNode(int node){
+	if (node < 0)
+		return;
+	char path[128];
+	sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+	FILE* file = fopen(path, "r");
+	if (!file)
+		return;
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	int first, last;
+	while (fscanf(file, "%d", &first) == 1) {
+		last = first;
+		char c = fgetc(file);
+		if (c == '-') {
+			if (fscanf(file, "%d", &last) != 1)
+				break;
+			c = fgetc(file);
+		}
+		for(int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, &cpus);
+		if (c != ',')
+			break;
+	}
+	fclose(file);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+void slabBarrier(Slab* slab){
+	pthread_barrier_wait(&slab->shared->barrier);
+}
+
+void lockDevice(Slab* slab){
+	pthread_mutex_lock(&slab->shared->deviceLock[slab->device]);
+}
+
+void unlockDevice(Slab* slab){
+	pthread_mutex_unlock(&slab->shared->deviceLock[slab->device]);
+}
+
+// phase 0 hands over migrants, phase 1 the halo; neighbours read the
+// buffers of this slab directly after the barrier. Each phase has its own
+// buffers and a slab passes the other phase's barrier before it writes
+// them again, so one barrier per phase is enough.
+void slabExchange(Slab* slab, int phase){
+	SlabShared* shared = slab->shared;
+	float bands[2][2][2] = {
+		{{-FLT_MAX, slab->xMin}, {slab->xMax, FLT_MAX}},
+		{{slab->xMin, slab->xMin + slab->haloWidth}, {slab->xMax - slab->haloWidth, slab->xMax}}};
+	lockDevice(slab);
+	double copyStart = decompositionClock();
+	if (phase == 1)
+		slab->psystem->clearHalo();
+	for(int side = 0; side < 2; side++){
+		bool hasNeighbour = (side == 0) ? slab->index > 0 : slab->index < SlabCount - 1;
+		slab->outCount[phase][side] = hasNeighbour ? slab->psystem->exportParticles(
+			bands[phase][side][0], bands[phase][side][1], phase == 0, &slab->out[phase][side][0]) : 0;
+	}
+	slab->copySeconds += decompositionClock() - copyStart;
+	unlockDevice(slab);
+	slabBarrier(slab);
+
+	lockDevice(slab);
+	copyStart = decompositionClock();
+	for(int side = 0; side < 2; side++){
+		int neighbour = slab->index + (side == 0 ? -1 : 1);
+		if (neighbour < 0 || neighbour >= SlabCount)
+			continue;
+		Slab* from = &shared->slabs[neighbour];
+		uint count = from->outCount[phase][1 - side];
+		if (count == 0)
+			continue;
+		//thin read of the neighbour's node, then the copy to the device
+		slab->in.assign(from->out[phase][1 - side].begin(), from->out[phase][1 - side].begin() + 12 * count);
+		slab->dropped += count - slab->psystem->importParticles(&slab->in[0], count, phase == 1);
+		slab->exchangedBytes += 12 * count * sizeof(float);
+	}
+	slab->copySeconds += decompositionClock() - copyStart;
+	unlockDevice(slab);
+}
+
+void slabStep(Slab* slab){
+	double start = decompositionClock();
+	slabExchange(slab, 0);
+	slabExchange(slab, 1);
+	double exchanged = decompositionClock();
+	lockDevice(slab);
+	slab->psystem->update();
+	cudaThreadSynchronize();
+	unlockDevice(slab);
+	slab->exchangeSeconds += exchanged - start;
+	slab->stepSeconds += decompositionClock() - exchanged;
+	slab->steps++;
+
+	if (slab->steps % SlabRebalanceInterval != 0)
+		return;
+	//new edges at the quantiles of the owned fluid, particles follow with the next exchange
+	SlabShared* shared = slab->shared;
+	lockDevice(slab);
+	thrust::device_ptr<float4> dev_ptr((float4*)slab->psystem->getCudaPosVBO());
+	thrust::host_vector<float4> h_vec(slab->psystem->getNumParticles());
+	thrust::copy(dev_ptr, dev_ptr + slab->psystem->getNumParticles(), h_vec.begin());
+	unlockDevice(slab);
+	slab->ownedX.clear();
+	for(uint i = 0; i < h_vec.size(); i++)
+		if (h_vec[i].w == Fluid)
+			slab->ownedX.push_back(h_vec[i].x);
+	slabBarrier(slab);
+	if (slab->index == 0) {
+		std::vector<float> x;
+		for(int k = 0; k < SlabCount; k++)
+			x.insert(x.end(), shared->slabs[k].ownedX.begin(), shared->slabs[k].ownedX.end());
+		std::sort(x.begin(), x.end());
+		for(int k = 1; k < SlabCount; k++)
+			shared->edges[k] = x[k * x.size() / SlabCount];
+	}
+	slabBarrier(slab);
+	slab->xMin = shared->edges[slab->index];
+	slab->xMax = shared->edges[slab->index + 1];
+	slab->psystem->setSubdomain(slab->xMin, slab->xMax);
+}
+
+float slabFluidHeight(Slab* slab){
+	lockDevice(slab);
+	slab->height = localFluidHeight(slab->psystem);
+	unlockDevice(slab);
+	slabBarrier(slab);
+	float y = -FLT_MAX;
+	for(int k = 0; k < SlabCount; k++)
+		y = max(y, slab->shared->slabs[k].height);
+	slabBarrier(slab);
+	return y;
+}
+
+// same case and output as YFrontTest, slab 0 writes the file
+void* YFrontSlabWorker(void* arg){
+	Slab* slab = (Slab*)arg;
+	SlabShared* shared = slab->shared;
+	pinToNumaNode(slab->node);
+	cudaSetDevice(slab->device);
+
+	int num = 128;
+	uint3 fluidParticlesSize = make_uint3(num, 2 * num, 1);
+	uint3 gridSize = make_uint3(512, 256, 4);
+	float radius = 1.0f / (2 * num);
+	int boundaryOffset = 1;
+
+	//constructor and reset upload constants too
+	lockDevice(slab);
+	slab->psystem = new DamBreakSystem(fluidParticlesSize, boundaryOffset, gridSize, radius, false);
+	float columnLeft = slab->psystem->getWorldOrigin().x + boundaryOffset * 2 * radius;
+	float slabWidth = fluidParticlesSize.x * 2 * radius / SlabCount;
+	if (slab->index == 0) {
+		shared->edges[0] = -FLT_MAX;
+		shared->edges[SlabCount] = FLT_MAX;
+	}
+	slab->xMin = (slab->index == 0) ? -FLT_MAX : columnLeft + slab->index * slabWidth;
+	slab->xMax = (slab->index == SlabCount - 1) ? FLT_MAX : columnLeft + (slab->index + 1) * slabWidth;
+	slab->haloWidth = 4 * slab->psystem->getSmoothingRadius();
+	slab->psystem->setSubdomain(slab->xMin, slab->xMax);
+	slab->psystem->reset();
+	unlockDevice(slab);
+	//first touch from this thread places the buffers on its node
+	for(int phase = 0; phase < 2; phase++)
+		for(int side = 0; side < 2; side++)
+			slab->out[phase][side].resize(12 * slab->psystem->getNumParticles());
+	slab->in.reserve(12 * slab->psystem->getNumParticles());
+	slabBarrier(slab);
+
+	while(slab->psystem->getElapsedTime() < 1.5f)
+		slabStep(slab);
+	lockDevice(slab);
+	slab->psystem->removeRightBoundary();
+	unlockDevice(slab);
+
+	float yheight = slabFluidHeight(slab) + radius - slab->psystem->getWorldOrigin().y;
+	float timeScale = sqrt(2 * fabs(slab->psystem->getGravity().y) / yheight);
+	FILE *file = (slab->index == 0) ? fopen(shared->outputName, "w") : 0;
+	for(int k = 0; k < YFrontFrames; k++){
+		while(slab->psystem->getElapsedTime() * timeScale < YFrontFrameData[k][0])
+			slabStep(slab);
+		float y = slabFluidHeight(slab);
+		if (file)
+			fprintf(file, "%f %f %f %f \n",
+				YFrontFrameData[k][0],
+				slab->psystem->getElapsedTime(),
+				YFrontFrameData[k][1],
+				(y + radius - slab->psystem->getWorldOrigin().y) / yheight);
+	}
+	if (file)
+		fclose(file);
+	lockDevice(slab);
+	delete slab->psystem;
+	unlockDevice(slab);
+	return 0;
+}
+
+// Reports per slab (node) the exchange bandwidth of the copies alone, without
+// barrier and lock waits, and the particle state streamed by update():
+// position, velocities, measures and acceleration read and written once per
+// step. The latter is counted from the particle number, a lower bound of
+// the real traffic. With fewer devices than slabs the slabs take turns on
+// one device and the per node figures are left out.
+bool YFrontSlabTest(){
+	int deviceCount = 0;
+	cudaGetDeviceCount(&deviceCount);
+	if (deviceCount == 0) {
+		cout << "Slabs: no CUDA device" << endl;
+		return false;
+	}
+
+	SlabShared* shared = new SlabShared();
+	shared->outputName = "YFrontOutputSlabs";
+	pthread_barrier_init(&shared->barrier, 0, SlabCount);
+	for(int k = 0; k < SlabCount; k++)
+		pthread_mutex_init(&shared->deviceLock[k], 0);
+	pthread_t threads[SlabCount];
+	for(int k = 0; k < SlabCount; k++){
+		Slab* slab = &shared->slabs[k];
+		slab->shared = shared;
+		slab->index = k;
+		slab->device = k % deviceCount;
+		assert(slab->device < SlabCount);
+		slab->node = deviceNumaNode(slab->device);
+		slab->exchangeSeconds = slab->copySeconds = slab->stepSeconds = slab->exchangedBytes = 0.0;
+		slab->steps = 0;
+		slab->dropped = 0;
+		pthread_create(&threads[k], 0, YFrontSlabWorker, slab);
+	}
+	for(int k = 0; k < SlabCount; k++)
+		pthread_join(threads[k], 0);
+
+	const float stateBytes = 2 * 5 * 4 * sizeof(float);
+	bool perNode = deviceCount >= SlabCount;
+	if (!perNode)
+		cout << "Slabs: single device, slabs serialised, NUMA effect not measurable" << endl;
+	uint dropped = 0;
+	for(int k = 0; k < SlabCount; k++){
+		Slab* slab = &shared->slabs[k];
+		dropped += slab->dropped;
+		cout << "Slab " << k << " (device " << slab->device << ", node " << slab->node << "): "
+			<< slab->steps << " steps, "
+			<< 1000 * slab->exchangeSeconds / slab->steps << " ms exchange with waits, "
+			<< 1000 * slab->copySeconds / slab->steps << " ms copying, "
+			<< 1000 * slab->stepSeconds / slab->steps << " ms update per step";
+		if (perNode)
+			cout << ", " << slab->exchangedBytes / slab->copySeconds / 1e6 << " MB/s halo and migrant copies, at least "
+				<< slab->ownedX.size() * stateBytes * slab->steps / slab->stepSeconds / 1e9
+				<< " GB/s particle state (counted, not measured) at the last rebalance";
+		cout << endl;
+	}
+	for(int k = 0; k < SlabCount; k++)
+		pthread_mutex_destroy(&shared->deviceLock[k]);
+	pthread_barrier_destroy(&shared->barrier);
+	delete shared;
+	if (dropped > 0) {
+		cout << "Slabs: " << dropped << " received particles dropped" << endl;
+		return false;
+	}
+
+	YFrontReference();
+	return YFrontCompare("YFrontOutput", "YFrontOutputSlabs", YFrontReorderTolerance);
+}
+#endif
@@ -13,7 +13,7 @@ typedef unsigned int uint;
 
 using namespace std;
 
-void XFrontTest(){				
+void XFrontTest(bool hydrostaticInit = false){				
 	int num = 128;
 	uint3 fluidParticlesSize = make_uint3(num, 2 * num, 1);	    	
 	uint3 gridSize = make_uint3(512, 256, 4);   		
@@ -21,12 +21,13 @@ void XFrontTest(){
 	float radius = 1.0f / (2 * num);
 
 	DamBreakSystem *psystem = new DamBreakSystem(fluidParticlesSize, boundaryOffset, gridSize, radius, false); 
+	psystem->setHydrostaticInit(hydrostaticInit);
 	psystem->reset();
 
 	//relax system
-	while(psystem->getElapsedTime() < 1.5f)
-		psystem->update();
-	cout << "XFront: System relaxed" << endl;
+	uint relaxSteps = psystem->relax(1.5f);
+	cout << "XFront: System relaxed in " << relaxSteps << " steps, max fluid speed "
+		<< psystem->getMaxFluidSpeed() << endl;
 	psystem->removeRightBoundary();
 	
 	struct compare_float4{
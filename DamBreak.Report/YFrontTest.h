@@ -3,9 +3,9 @@
 #include <thrust/device_vector.h>
 #include <thrust/sort.h>
 #include <iostream>
-#include <stack>
 #include <math.h>
 #include <algorithm>
+#include "../Common/helper_timer.h"
 
 typedef unsigned int uint;
 // #include "fluidSystem.cuh"
@@ -13,20 +13,35 @@ typedef unsigned int uint;
 
 using namespace std;
 
-void YFrontTest(){				
+//Table 6 (n^2 = 2). An Experimental Study o f the Collapse of Liquid Columns on a Rigid Horizontal
+//Plane.  J. C. Martin and W. J. Moyce
+//dimensionless time and height, output frames of every YFront run
+const int YFrontFrames = 15;
+const float YFrontFrameData[YFrontFrames][2] = {
+	{0.0f, 1.0f}, {0.56f, 0.94f}, {0.77f, 0.89f}, {0.93f, 0.83f}, {1.08f, 0.78f},
+	{1.28f, 0.72f}, {1.46f, 0.67f}, {1.66f, 0.61f}, {1.84f, 0.56f}, {2.00f, 0.50f},
+	{2.21f, 0.44f}, {2.45f, 0.39f}, {2.70f, 0.33f}, {3.06f, 0.28f}, {3.44f, 0.22f}};
+
+// configures system before the run, e.g. switches on optional code paths
+typedef void (*SystemSetup)(DamBreakSystem*);
+
+void YFrontTest(SystemSetup setup = 0, const char* outputName = "YFrontOutput",
+	BoundaryModel boundaryModel = ParticleWalls){				
 	int num = 128;
 	uint3 fluidParticlesSize = make_uint3(num, 2 * num, 1);	    
 	uint3 gridSize = make_uint3(512, 256, 4);   			
 	float radius = 1.0f / (2 * num);
 	int boundaryOffset = 1;
 
-	DamBreakSystem *psystem = new DamBreakSystem(fluidParticlesSize, boundaryOffset, gridSize, radius, false); 
+	DamBreakSystem *psystem = new DamBreakSystem(fluidParticlesSize, boundaryOffset, gridSize, radius, false, boundaryModel); 
+	if (setup)
+		setup(psystem);
 	psystem->reset();
 
 	//relax system
-	while(psystem->getElapsedTime() < 1.5f)
-		psystem->update();
-	cout << "YFront System relaxed" << endl;
+	uint relaxSteps = psystem->relax(1.5f);
+	cout << "YFront System relaxed in " << relaxSteps << " steps, max fluid speed "
+		<< psystem->getMaxFluidSpeed() << endl;
 	psystem->removeRightBoundary();
 	
 	struct compareFloat4Y {
@@ -42,25 +57,6 @@ void YFrontTest(){
 	};
 	compareFloat4Y comparator;
 
-	//Table 6 (n^2 = 2). An Experimental Study o f the Collapse of Liquid Columns on a Rigid Horizontal
-	//Plane.  J. C. Martin and W. J. Moyce
-	stack<float2> timeFrames;				
-	timeFrames.push(make_float2(3.44f, 0.22f));	
-	timeFrames.push(make_float2(3.06f, 0.28f));	
-	timeFrames.push(make_float2(2.70f, 0.33f));		
-	timeFrames.push(make_float2(2.45f, 0.39f));	
-	timeFrames.push(make_float2(2.21f, 0.44f));	
-	timeFrames.push(make_float2(2.00f, 0.50f));	
-	timeFrames.push(make_float2(1.84f, 0.56f));	
-	timeFrames.push(make_float2(1.66f, 0.61f));	
-	timeFrames.push(make_float2(1.46f, 0.67f));	
-	timeFrames.push(make_float2(1.28f, 0.72f));	
-	timeFrames.push(make_float2(1.08f, 0.78f));	
-	timeFrames.push(make_float2(0.93f, 0.83f));	
-	timeFrames.push(make_float2(0.77f, 0.89f));	
-	timeFrames.push(make_float2(0.56f, 0.94f));	
-	timeFrames.push(make_float2(0.0f, 1.0f));	
-
 	thrust::device_ptr<float4> dev_ptr((float4*)psystem->getCudaPosVBO());	
 	thrust::host_vector<float4> h_vec(psystem->getNumParticles());
 	thrust::copy(dev_ptr, dev_ptr + psystem->getNumParticles(), h_vec.begin());		
@@ -68,12 +64,9 @@ void YFrontTest(){
 	float yheight = ((float4)h_vec[0]).y + radius - psystem->getWorldOrigin().y;
 
 	float timeScale = sqrt(2 * fabs(psystem->getGravity().y) / yheight);	
-	FILE *file= fopen("YFrontOutput", "w");
-	while (!(timeFrames.empty())){
-		float2 expData= timeFrames.top();
-		timeFrames.pop();
-
-		while(psystem->getElapsedTime() * timeScale < expData.x)
+	FILE *file= fopen(outputName, "w");
+	for(int k = 0; k < YFrontFrames; k++){
+		while(psystem->getElapsedTime() * timeScale < YFrontFrameData[k][0])
 			psystem->update();	
 
 		thrust::device_ptr<float4> dev_ptr((float4*)psystem->getCudaPosVBO());	
@@ -84,11 +77,389 @@ void YFrontTest(){
 
 		float y = ((float4)h_vec[0]).y;
 		fprintf(file, "%f %f %f %f \n",
-			expData.x, //dimensionless experimental time
+			YFrontFrameData[k][0], //dimensionless experimental time
 			psystem->getElapsedTime(), //real time
-			expData.y, //dimensionless experimental height
+			YFrontFrameData[k][1], //dimensionless experimental height
 			(y + radius - psystem->getWorldOrigin().y) / yheight ); //dimensional height
 	}
 	fclose(file);
+
+	cout << "YFront: " << psystem->getStepCount() << " steps";
+	if (psystem->getPressureSolver() == DamBreakSystem::ImplicitIncompressible)
+		cout << ", " << (float)psystem->getTotalSolverIterations() / psystem->getStepCount()
+			<< " solver iterations per step, last density error " << psystem->getDensityError();
+	if (psystem->getBlockLevels() > 0) {
+		if (psystem->isPairCounting())
+			cout << ", " << psystem->getPairEvaluations() << " neighbour pairs against "
+				<< psystem->getFullPairEvaluations() << " with all particles on the finest level";
+		cout << ", particles per level";
+		uint levels[32];
+		psystem->getLevelHistogram(levels);
+		for(uint l = 0; l <= psystem->getBlockLevels(); l++)
+			cout << " " << levels[l];
+	}
+	if (psystem->isAdaptiveRefinement())
+		cout << ", " << psystem->getNumActiveFluidParticles() << " fluid particles against "
+			<< 4 * fluidParticlesSize.x * fluidParticlesSize.y << " at the fine resolution";
+	if (psystem->isBucketGrid())
+		cout << ", bucket capacity " << psystem->getBucketCapacity() << ", "
+			<< psystem->getBucketGridBytes() / (1 << 20) << " MB";
+	if (psystem->isNeighbourTiming())
+		cout << ", ms per step: rebuild "
+			<< 1000 * psystem->getNeighbourSeconds(DamBreakSystem::RebuildPhase) / psystem->getStepCount()
+			<< ", density " << 1000 * psystem->getNeighbourSeconds(DamBreakSystem::DensityPhase) / psystem->getStepCount()
+			<< ", forces " << 1000 * psystem->getNeighbourSeconds(DamBreakSystem::ForcePhase) / psystem->getStepCount();
+	cout << endl;
 	delete psystem;	
 }
+
+void enableCompactNeighbourData(DamBreakSystem* psystem){
+	psystem->setCompactNeighbourData(true);
+}
+
+// Allowed differences of the dimensionless front height against the
+// reference run, as fractions of the column height; 0.01 is about 2.5
+// particle spacings for num = 128. Margins for the front of a splashing
+// flow, not error bounds.
+// same arithmetic, other summation order or rounding: bucket grid, pair
+// cache, subdomains, float and mixed precision sums
+const float YFrontReorderTolerance = 0.005f;
+// 16 bit positions inside the cell, 11 bit mantissa for neighbour
+// velocity and density/pressure deviations
+const float YFrontCompactTolerance = 0.01f;
+// same model, other time integration or start: wall force substeps,
+// block steps, hydrostatic start
+const float YFrontSteppingTolerance = 0.02f;
+// other model of the same flow: incompressible pressure, distance field
+// walls, refined surface; about the scatter of the Martin and Moyce data
+const float YFrontModelTolerance = 0.05f;
+
+// compares dimensionless heights of two YFrontTest outputs
+bool YFrontCompare(const char* referenceName, const char* candidateName, float tolerance){
+	FILE *reference = fopen(referenceName, "r");
+	FILE *candidate = fopen(candidateName, "r");
+	if (!reference || !candidate) {
+		cout << "YFront outputs not found" << endl;
+		if (reference) fclose(reference);
+		if (candidate) fclose(candidate);
+		return false;
+	}
+
+	float maxDiff = 0.0f;
+	int frames = 0;
+	bool complete = true;
+	float r[4], c[4];
+	while (fscanf(reference, "%f %f %f %f", &r[0], &r[1], &r[2], &r[3]) == 4) {
+		if (fscanf(candidate, "%f %f %f %f", &c[0], &c[1], &c[2], &c[3]) != 4) {
+			complete = false;
+			break;
+		}
+		maxDiff = max(maxDiff, fabs(r[3] - c[3]));
+		frames++;
+	}
+	fclose(reference);
+	fclose(candidate);
+
+	cout << "YFront " << candidateName << " against " << referenceName << ": max height difference "
+		<< maxDiff << " (tolerance " << tolerance << ")";
+	if (!complete)
+		cout << ", frames missing";
+	cout << endl;
+	return complete && frames > 0 && maxDiff <= tolerance;
+}
+
+// plain run into YFrontOutput, once per process
+void YFrontReference(){
+	static bool done = false;
+	if (!done)
+		YFrontTest();
+	done = true;
+}
+
+// Densities of the first step with full and with compact neighbour data,
+// same lattice and same sorted order. Positions are quantised to 2r/65536,
+// which moves a kernel sum by well under 1e-4 of the rest density; a cell
+// read with the wrong origin moves it by whole particles.
+const float YFrontCompactDensityTolerance = 1e-3f;
+
+bool YFrontCompactDensityCheck(){
+	int num = 128;
+	uint3 fluidParticlesSize = make_uint3(num, 2 * num, 1);
+	uint3 gridSize = make_uint3(512, 256, 4);
+	float radius = 1.0f / (2 * num);
+	int boundaryOffset = 1;
+
+	DamBreakSystem *full = new DamBreakSystem(fluidParticlesSize, boundaryOffset, gridSize, radius, false);
+	DamBreakSystem *compact = new DamBreakSystem(fluidParticlesSize, boundaryOffset, gridSize, radius, false);
+	compact->setCompactNeighbourData(true);
+	full->reset();
+	compact->reset();
+	full->update();
+	compact->update();
+
+	uint n = full->getNumParticles();
+	thrust::host_vector<float4> a(n), b(n);
+	thrust::device_ptr<float4> da((float4*)full->getCudaMeasures());
+	thrust::device_ptr<float4> db((float4*)compact->getCudaMeasures());
+	thrust::copy(da, da + n, a.begin());
+	thrust::copy(db, db + n, b.begin());
+	float maxDiff = 0.0f;
+	for(uint i = 0; i < n; i++)
+		if (a[i].x > 0.0f)
+			maxDiff = max(maxDiff, fabs(b[i].x - a[i].x) / a[i].x);
+	delete compact;
+	delete full;
+
+	cout << "YFront compact density max relative difference " << maxDiff
+		<< " (tolerance " << YFrontCompactDensityTolerance << ")" << endl;
+	return maxDiff <= YFrontCompactDensityTolerance;
+}
+
+bool YFrontCompactTest(){
+	bool passed = YFrontCompactDensityCheck();
+	YFrontReference();
+	YFrontTest(enableCompactNeighbourData, "YFrontOutputCompact");
+	return YFrontCompare("YFrontOutput", "YFrontOutputCompact", YFrontCompactTolerance) && passed;
+}
+
+void enablePersistentOrdering(DamBreakSystem* psystem){
+	psystem->setPersistentOrdering(true);
+}
+
+// particles of a cell are summed in the order they were kept in, not in
+// index order as after a fresh sort
+bool YFrontPersistentOrderingTest(){
+	YFrontReference();
+	YFrontTest(enablePersistentOrdering, "YFrontOutputPersistent");
+	return YFrontCompare("YFrontOutput", "YFrontOutputPersistent", YFrontReorderTolerance);
+}
+
+void enableHydrostaticInit(DamBreakSystem* psystem){
+	psystem->setHydrostaticInit(true);
+}
+
+// lattice start with the full relaxation against the hydrostatic start
+bool YFrontHydrostaticTest(){
+	YFrontReference();
+	YFrontTest(enableHydrostaticInit, "YFrontOutputHydrostatic");
+	return YFrontCompare("YFrontOutput", "YFrontOutputHydrostatic", YFrontSteppingTolerance);
+}
+
+void enableImplicitSolver(DamBreakSystem* psystem){
+	psystem->setPressureSolver(DamBreakSystem::ImplicitIncompressible);
+}
+
+// weakly compressible against the implicit incompressible solver
+bool YFrontImplicitTest(){
+	YFrontReference();
+	YFrontTest(enableImplicitSolver, "YFrontOutputImplicit");
+	return YFrontCompare("YFrontOutput", "YFrontOutputImplicit", YFrontModelTolerance);
+}
+
+void enableBoundarySubsteps(DamBreakSystem* psystem){
+	psystem->setBoundarySubsteps(2);
+}
+
+// full neighbour pass every step against every second step, wall forces on 1e-4
+bool YFrontSubstepTest(){
+	YFrontReference();
+	YFrontTest(enableBoundarySubsteps, "YFrontOutputSubsteps");
+	return YFrontCompare("YFrontOutput", "YFrontOutputSubsteps", YFrontSteppingTolerance);
+}
+
+void enableBlockTimeStepping(DamBreakSystem* psystem){
+	psystem->setBlockTimeStepping(2);
+	psystem->setPairCounting(true);
+}
+
+// global 1e-4 step against particle levels of 1, 2 and 4 times the smallest limit
+bool YFrontBlockTest(){
+	YFrontReference();
+	YFrontTest(enableBlockTimeStepping, "YFrontOutputBlock");
+	return YFrontCompare("YFrontOutput", "YFrontOutputBlock", YFrontSteppingTolerance);
+}
+
+void enableAdaptiveRefinement(DamBreakSystem* psystem){
+	psystem->setAdaptiveRefinement(true);
+}
+
+// uniform column against the column refined along the free surface
+bool YFrontRefinementTest(){
+	YFrontReference();
+	YFrontTest(enableAdaptiveRefinement, "YFrontOutputRefinement");
+	return YFrontCompare("YFrontOutput", "YFrontOutputRefinement", YFrontModelTolerance);
+}
+
+void enableDeterministicImplicit(DamBreakSystem* psystem){
+	psystem->setPressureSolver(DamBreakSystem::ImplicitIncompressible);
+	psystem->setDeterministic(true);
+}
+
+// wall clock seconds of one YFrontTest run
+float YFrontTimedTest(SystemSetup setup, const char* outputName){
+	StopWatchInterface* timer = 0;
+	sdkCreateTimer(&timer);
+	sdkStartTimer(&timer);
+	YFrontTest(setup, outputName);
+	cudaThreadSynchronize();
+	float seconds = sdkGetTimerValue(&timer) / 1000.0f;
+	sdkDeleteTimer(&timer);
+	return seconds;
+}
+
+// Two deterministic implicit runs on this device must match to the last
+// digit written; the implicit solver is the case with a float reduction in
+// the loop. The deterministic run also has to stay within the reordering
+// tolerance of the fast one. Run times of the two give the overhead.
+bool YFrontDeterministicTest(){
+	float fastSeconds = YFrontTimedTest(enableImplicitSolver, "YFrontOutputImplicit");
+	float deterministicSeconds = YFrontTimedTest(enableDeterministicImplicit, "YFrontOutputDeterministic");
+	YFrontTest(enableDeterministicImplicit, "YFrontOutputDeterministicRepeat");
+	cout << "YFront deterministic run " << deterministicSeconds << " s against "
+		<< fastSeconds << " s; repeat on the same device and launch configuration only,"
+		<< " other thread and block counts not exercised" << endl;
+	bool repeatable = YFrontCompare("YFrontOutputDeterministic", "YFrontOutputDeterministicRepeat", 0.0f);
+	bool physical = YFrontCompare("YFrontOutputImplicit", "YFrontOutputDeterministic", YFrontReorderTolerance);
+	return repeatable && physical;
+}
+
+// Run once with each SPH_PRECISION build: every build writes its own output
+// and its run time, the double build's output is the reference. Without a
+// double build run in this directory the comparison is skipped.
+bool YFrontPrecisionTest(){
+	const char* names[3] = {"YFrontOutputFloat", "YFrontOutputMixed", "YFrontOutputDouble"};
+	float seconds = YFrontTimedTest(0, names[SPH_PRECISION]);
+	cout << "YFront precision policy " << SPH_PRECISION << ": " << seconds << " s" << endl;
+	if (SPH_PRECISION == SPH_PRECISION_DOUBLE)
+		return true;
+	FILE *reference = fopen(names[SPH_PRECISION_DOUBLE], "r");
+	if (!reference) {
+		cout << "YFront precision: no double reference, skipped" << endl;
+		return true;
+	}
+	fclose(reference);
+	return YFrontCompare(names[SPH_PRECISION_DOUBLE], names[SPH_PRECISION], YFrontReorderTolerance);
+}
+
+size_t YFrontPairCacheBytes = 0;
+
+void enablePairCache(DamBreakSystem* psystem){
+	psystem->setPairCache(true);
+	YFrontPairCacheBytes = psystem->getPairCacheBytes();
+}
+
+void enableRefinedPairCache(DamBreakSystem* psystem){
+	enableAdaptiveRefinement(psystem);
+	enablePairCache(psystem);
+}
+
+// memory of the pair cache against the time it saves, for the uniform
+// column and the refined one (more pairs per particle near the surface)
+bool YFrontPairCacheTest(){
+	const char* scenarios[2] = {"uniform", "refined"};
+	SystemSetup setups[2][2] = {{0, enablePairCache}, {enableAdaptiveRefinement, enableRefinedPairCache}};
+	const char* names[2][2] = {{"YFrontOutput", "YFrontOutputPairCache"},
+		{"YFrontOutputRefinement", "YFrontOutputRefinedPairCache"}};
+	bool passed = true;
+	for(int k = 0; k < 2; k++){
+		float plainSeconds = YFrontTimedTest(setups[k][0], names[k][0]);
+		float cachedSeconds = YFrontTimedTest(setups[k][1], names[k][1]);
+		cout << "YFront pair cache, " << scenarios[k] << ": " << YFrontPairCacheBytes / (1 << 20)
+			<< " MB, " << cachedSeconds << " s against " << plainSeconds << " s" << endl;
+		passed = YFrontCompare(names[k][0], names[k][1], YFrontReorderTolerance) && passed;
+	}
+	return passed;
+}
+
+void enableNeighbourTiming(DamBreakSystem* psystem){
+	psystem->setNeighbourTiming(true);
+}
+
+void enableTimedBucketGrid(DamBreakSystem* psystem){
+	psystem->setBucketGrid(true);
+	psystem->setNeighbourTiming(true);
+}
+
+// sorted cell ranges against the bucket grid, rebuild and traversal times
+// are printed per step for both
+bool YFrontBucketTest(){
+	YFrontTest(enableNeighbourTiming);
+	YFrontTest(enableTimedBucketGrid, "YFrontOutputBuckets");
+	return YFrontCompare("YFrontOutput", "YFrontOutputBuckets", YFrontReorderTolerance);
+}
+
+#ifndef _WIN32
+float maxPositionDifference(DamBreakSystem* a, DamBreakSystem* b){
+	uint n = a->getNumParticles();
+	thrust::host_vector<float4> pa(n), pb(n);
+	thrust::device_ptr<float4> da((float4*)a->getCudaPosVBO());
+	thrust::device_ptr<float4> db((float4*)b->getCudaPosVBO());
+	thrust::copy(da, da + n, pa.begin());
+	thrust::copy(db, db + n, pb.begin());
+	float diff = 0.0f;
+	for(uint i = 0; i < n; i++)
+		diff = max(diff, max(fabs(pa[i].x - pb[i].x), fabs(pa[i].y - pb[i].y)));
+	return diff;
+}
+
+// checkpoint chunks small enough for the column to span several of them
+const uint YFrontStateChunkParticles = 1 << 12;
+
+// YFront column with its host state in mapped files: checkpoint after the
+// gate opens, restore into a second system and run both on. The restored
+// run has to follow the original one exactly.
+bool YFrontCheckpointTest(){
+	int num = 128;
+	uint3 fluidParticlesSize = make_uint3(num, 2 * num, 1);
+	uint3 gridSize = make_uint3(512, 256, 4);
+	float radius = 1.0f / (2 * num);
+	int boundaryOffset = 1;
+
+	DamBreakSystem *psystem = new DamBreakSystem(fluidParticlesSize, boundaryOffset, gridSize, radius, false);
+	if (!psystem->setStateFiles("YFrontState")) {
+		delete psystem;
+		return false;
+	}
+	psystem->setStateChunkParticles(YFrontStateChunkParticles);
+	psystem->reset();
+	psystem->relax(1.5f);
+	psystem->removeRightBoundary();
+	for(int k = 0; k < 1000; k++)
+		psystem->update();
+
+	StopWatchInterface* timer = 0;
+	sdkCreateTimer(&timer);
+	cudaThreadSynchronize();
+	sdkStartTimer(&timer);
+	psystem->checkpoint();
+	cudaThreadSynchronize();
+	float checkpointSeconds = sdkGetTimerValue(&timer) / 1000.0f;
+
+	DamBreakSystem *restored = new DamBreakSystem(fluidParticlesSize, boundaryOffset, gridSize, radius, false);
+	restored->setStateFiles("YFrontState");
+	restored->setStateChunkParticles(YFrontStateChunkParticles);
+	sdkResetTimer(&timer);
+	restored->restoreState();
+	cudaThreadSynchronize();
+	float restoreSeconds = sdkGetTimerValue(&timer) / 1000.0f;
+	sdkDeleteTimer(&timer);
+
+	for(int k = 0; k < 1000; k++){
+		psystem->update();
+		restored->update();
+	}
+	float difference = maxPositionDifference(psystem, restored);
+	cout << "YFront checkpoint " << checkpointSeconds << " s, restore " << restoreSeconds
+		<< " s, position difference after 1000 steps " << difference << endl;
+	delete restored;
+	delete psystem;
+	return difference == 0.0f;
+}
+#endif
+
+// wall particles against the distance field walls, same case
+bool YFrontWallFieldTest(){
+	YFrontReference();
+	YFrontTest(0, "YFrontOutputField", DistanceFieldWalls);
+	return YFrontCompare("YFrontOutput", "YFrontOutputField", YFrontModelTolerance);
+}
@@ -13,7 +13,7 @@
 using namespace std;
 using namespace thrust;
 
-void dump() 
+void dump(bool hydrostaticInit = false) 
 {
 	float num = 128;
 	DamBreakSystem *psystem = new DamBreakSystem(
@@ -23,9 +23,9 @@ void dump()
 		1.0f / (2 * num),				
 		false); 
 
+	psystem->setHydrostaticInit(hydrostaticInit);
 	psystem->reset();	
-	while(psystem->getElapsedTime() < 1.0f)
-		psystem->update();//relax
+	psystem->relax(1.0f);
 	psystem->changeRightBoundary();
 	psystem->changeRightBoundary();
 
@@ -1,10 +1,57 @@
 #include "dump.h"
 // #include "XFrontTest.h"
 #include "YFrontTest.h"
+#include "DecompositionTest.h"
+#include "SlabTest.h"
+#include <string.h>
 
-int main(){
+typedef bool (*ReportTest)();
+
+struct NamedTest {
+  const char* name;
+  ReportTest test;
+};
+
+// the decomposition forks its workers, it has to run before this process
+// creates a CUDA context
+NamedTest tests[] = {
+#ifndef _WIN32
+  {"decomposition", YFrontDecompositionTest},
+#endif
+  {"persistent", YFrontPersistentOrderingTest},
+  {"compact", YFrontCompactTest},
+  {"wallfield", YFrontWallFieldTest},
+  {"hydrostatic", YFrontHydrostaticTest},
+  {"implicit", YFrontImplicitTest},
+  {"substep", YFrontSubstepTest},
+  {"block", YFrontBlockTest},
+  {"refinement", YFrontRefinementTest},
+  {"deterministic", YFrontDeterministicTest},
+  {"precision", YFrontPrecisionTest},
+  {"paircache", YFrontPairCacheTest},
+  {"bucket", YFrontBucketTest},
+#ifndef _WIN32
+  {"slab", YFrontSlabTest},
+  {"checkpoint", YFrontCheckpointTest},
+#endif
+};
+
+// runs every comparison, or the ones named on the command line;
+// the exit code is the number of failed ones
+int main(int argc, char** argv){
   //dump();
-  YFrontTest();
   //XFrontTest();
-  return 0;
-}
\ No newline at end of file
+  int count = sizeof(tests) / sizeof(tests[0]);
+  int failed = 0;
+  for(int k = 0; k < count; k++){
+    bool selected = argc == 1;
+    for(int a = 1; a < argc; a++)
+      selected |= strcmp(argv[a], tests[k].name) == 0;
+    if (!selected)
+      continue;
+    bool passed = tests[k].test();
+    cout << tests[k].name << ": " << (passed ? "passed" : "FAILED") << endl;
+    failed += !passed;
+  }
+  return failed;
+}
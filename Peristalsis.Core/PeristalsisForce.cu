@@ -1,5 +1,4 @@
 #include "cutil_math.h"
-#include "peristalsisUtil.cu"
 
 //__device__ struct BottomF {	
 //	float x0, y0, t;
@@ -140,8 +139,9 @@ __device__ float4 getVelocityDiff(
 	return iVelocity - jVelocity;	
 }
 
-__device__ float3 sumViscosity(
-	int3    gridPos,
+// pressure and viscous terms share one neighbour walk and one kernel gradient
+__device__ void sumForces(
+	uint    gridHash,
 	uint    index,
 	float4  pos,
 	float4* oldPos, 
@@ -152,51 +152,44 @@ __device__ float3 sumViscosity(
 	float4* oldMeasures,
 	uint*   cellStart,
 	uint*   cellEnd,
-	float elapsedTime){
-		uint gridHash = calcGridHash(gridPos);
-		int3 shift = make_int3(EvaluateShift(gridPos.x, cfg.gridSize.x),
-			EvaluateShift(gridPos.y, cfg.gridSize.y),
-			EvaluateShift(gridPos.z, cfg.gridSize.z));							
-
+	float elapsedTime,
+	float3& pressureForce,
+	float3& viscousForce){
 		uint startIndex = FETCH(cellStart, gridHash);	    
-		float3 force = make_float3(0.0f);
-		if (startIndex != 0xffffffff) {               
-			uint endIndex = FETCH(cellEnd, gridHash);
-			for(uint j=startIndex; j<endIndex; j++) {
-				if (j != index) {             
-					float4 pos2 = FETCH(oldPos, j);
+		if (startIndex == 0xffffffff) 
+			return;
+
+		float coeff = PeristalsisKernel::gradientCoefficient(cfg.smoothingRadius);
+		uint endIndex = FETCH(cellEnd, gridHash);
+		for(uint j=startIndex; j<endIndex; j++) {
+			if (j != index) {             
+				float4 pos2 = FETCH(oldPos, j);
+				float3 relPos = make_float3(pos - pos2);
+				float dist = length(relPos);
+				float q = dist / cfg.smoothingRadius;									
+				if(q < 2){
 					float4 vel2 = FETCH(oldVel, j);
 					float4 measure = FETCH(oldMeasures, j);
 					float density2 = measure.x;
 					float pressure2 = measure.y;
-
-					float3 relPos = make_float3(pos.x - (pos2.x + shift.x * cfg.worldSize.x),
-						pos.y - (pos2.y + shift.y * cfg.worldSize.y),
-						pos.z - (pos2.z + shift.z * cfg.worldSize.z));
-					  										
-					float dist = length(relPos);
-					float q = dist / cfg.smoothingRadius;									
-
-					float coeff = 7.0f / (2 * CUDART_PI_F * powf(cfg.smoothingRadius, 3));
 					float4 Vab = getVelocityDiff(vel, pos, vel2, pos2, elapsedTime);
-					if(q < 2){
-
-						float temp = coeff * (-pow(1 - 0.5f * q,3) * (2 * q + 1) + pow(1 - 0.5f * q, 4));
-					/*	force += cfg.particleMass * temp * (-1.0f *
-							(pressure / powf(density,2) + pressure2 / powf(density2,2)) * 
-							normalize(relPos) + (cfg.mu + cfg.mu) * 
-							make_float3(Vab) / (density * density2 * dist));	*/
-						force += cfg.particleMass * temp * (cfg.mu + cfg.mu) * 
-							make_float3(Vab) / (density * density2 * dist);
-					}
+
+					float temp = cfg.particleMass *
+						coeff * PeristalsisKernel::shapeDerivative(q);
+					pressureForce += -1.0f * temp *
+						(pressure / (density * density) + pressure2 / (density2 * density2)) * 
+						normalize(relPos);
+					viscousForce += temp * (cfg.mu + cfg.mu) * 
+						make_float3(Vab) / (density * density2 * dist);
 				}
 			}
 		}
-		return force;				
 }
 
-__global__ void computeViscousForceD(
-	float4* viscousForce,	
+__global__ void computeForceD(
+	float4* force,          // output, pressure + viscous
+	float4* pressureForce,  // output, optional (diagnostics)
+	float4* viscousForce,   // output, optional (diagnostics)
 	float4* oldMeasures,
 	float4* oldPos,			
 	float4* oldVel,
@@ -208,6 +201,7 @@ __global__ void computeViscousForceD(
 		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
 		if (index >= numParticles) return;    
 
+		//launched for fluid particles only, they occupy the head of the sorted list
 		float4 pos = FETCH(oldPos, index);
 		float4 vel = FETCH(oldVel, index);
 		float4 measure = FETCH(oldMeasures,index);
@@ -216,27 +210,23 @@ __global__ void computeViscousForceD(
 
 		int3 gridPos = calcGridPos(make_float3(pos));
 
-		float3 force = make_float3(0.0f);		
+		float3 pres = make_float3(0.0f);		
+		float3 vis = make_float3(0.0f);		
 		for(int z=-cfg.cellcount; z<=cfg.cellcount; z++) {
 			for(int y=-cfg.cellcount; y<=cfg.cellcount; y++) {
 				for(int x=-cfg.cellcount; x<=cfg.cellcount; x++) {
-					int3 neighbourPos = gridPos + make_int3(x, y, z);
-					force += sumViscosity(
-						neighbourPos, 
-						index, 
-						pos, 
-						oldPos,
-						vel,
-						oldVel,
-						density,
-						pressure,	
-						oldMeasures,
-						cellStart, 
-						cellEnd,
-						elapsedTime);
+					uint gridHash = calcGridHash(gridPos + make_int3(x, y, z));
+					sumForces(gridHash, index, pos, oldPos, vel, oldVel, density, pressure,
+						oldMeasures, cellStart, cellEnd, elapsedTime, pres, vis);
+					sumForces(gridHash + cfg.numGridCells, index, pos, oldPos, vel, oldVel, density, pressure,
+						oldMeasures, cellStart, cellEnd, elapsedTime, pres, vis);
 				}
 			}
 		}
 		uint originalIndex = gridParticleIndex[index];							
-		viscousForce[originalIndex] = make_float4(force, 0.0f);
+		force[originalIndex] = make_float4(pres + vis, 0.0f);
+		if (pressureForce) {
+			pressureForce[originalIndex] = make_float4(pres, 0.0f);
+			viscousForce[originalIndex] = make_float4(vis, 0.0f);
+		}
 }
\ No newline at end of file
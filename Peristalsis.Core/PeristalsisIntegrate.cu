@@ -2,48 +2,23 @@ __global__ void computeCoordinatesD(
 	float4* posArray,		 
 	float4* velArray,		 
 	float4* velLeapFrogArray, 
-	float4* viscouseForce,	 
-	float4* pressureForce,
+	float4* force,	 // pressure + viscous
 	float elapsedTime,
 	uint numParticles){
 		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
 		if (index >= numParticles) return;     		
 
+		//fluid particles only, walls follow them in particle arrays
 		volatile float4 posData = posArray[index]; 	
-		if(posData.w != 0.0f && cfg.IsBoundaryConfiguration) return;//skip boundary particle
-		if(posData.w > 0.0f)//bottom
-		{
-			posArray[index] = make_float4(
-				posData.x,
-				-1.0f * cfg.fluid_size.y * cfg.radius +
-				cfg.amplitude * cfg.GetWave(posData.x, elapsedTime)
-				- cfg.radius * (posData.w - 1.0f),
-				posData.z,
-				posData.w);									
-			return;
-		}
-		if(posData.w < 0.0f)//top
-		{
-			posArray[index] = make_float4(posData.x,
-				cfg.fluid_size.y * cfg.radius - 
-				cfg.amplitude * cfg.GetWave(posData.x, elapsedTime) + 
-				cfg.radius * (-posData.w - 1.0f),
-				posData.z,
-				posData.w);		
-			return;
-		}
-
 		volatile float4 velData = velArray[index];
 		volatile float4 velLeapFrogData = velLeapFrogArray[index];
-		volatile float4 viscouseData = viscouseForce[index];
-		volatile float4 pressureData = pressureForce[index];
+		volatile float4 forceData = force[index];
 
 		float3 pos = make_float3(posData.x, posData.y, posData.z);
 		float3 vel = make_float3(velData.x, velData.y, velData.z);
-		float3 vis = make_float3(viscouseData.x, viscouseData.y, viscouseData.z);
-		float3 pres = make_float3(pressureData.x, pressureData.y, pressureData.z);											
+		float3 f = make_float3(forceData.x, forceData.y, forceData.z);
 
-		float3 nextVel = vel + (cfg.gravity + vis + pres) * cfg.deltaTime;		
+		float3 nextVel = vel + (cfg.gravity + f) * cfg.deltaTime;		
 		//float3 nextVel = vel + (cfg.gravity + pres) * cfg.deltaTime;		
 		//float3 nextVel = vel + pres * cfg.deltaTime;		
 
@@ -52,15 +27,111 @@ __global__ void computeCoordinatesD(
 
 		vel = nextVel;   	
 		pos += vel * cfg.deltaTime;   
-
-		float halfWorldXSize = cfg.gridSize.x * cfg.radius;			
-		if(pos.x > halfWorldXSize)
-			pos.x -= 2 * halfWorldXSize;		
-		if(pos.x < -halfWorldXSize)
-			pos.x += 2 * halfWorldXSize;
-
 				  
 		posArray[index] = make_float4(pos, posData.w);
 		velArray[index] = make_float4(vel, velData.w);
 		velLeapFrogArray[index] = make_float4(velLeapFrog, velLeapFrogData.w);
+}
+
+// velocity Verlet, first half: kick with the previous force, drift, and
+// predict the end of step velocity the force pass sees
+__global__ void kickDriftD(
+	float4* posArray,		 // input, output
+	float4* velArray,		 // input, output: half step velocity
+	float4* predictedVelocity,// output
+	float4* force,	 
+	uint numParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;     		
+
+		//fluid particles only
+		volatile float4 posData = posArray[index]; 	
+		volatile float4 velData = velArray[index];
+		volatile float4 forceData = force[index];
+
+		float3 pos = make_float3(posData.x, posData.y, posData.z);
+		float3 vel = make_float3(velData.x, velData.y, velData.z);
+		float3 acc = cfg.gravity + make_float3(forceData.x, forceData.y, forceData.z);
+
+		float3 halfVel = vel + acc * (0.5f * cfg.deltaTime);
+		pos += halfVel * cfg.deltaTime;
+
+		posArray[index] = make_float4(pos, posData.w);
+		velArray[index] = make_float4(halfVel, velData.w);
+		predictedVelocity[index] = make_float4(halfVel + acc * (0.5f * cfg.deltaTime), velData.w);
+}
+
+// velocity Verlet, second half: kick with the force at the new positions
+__global__ void kickD(
+	float4* velArray,		 // input, output
+	float4* velLeapFrogArray, // output
+	float4* force,	 
+	uint numParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;     		
+
+		volatile float4 velData = velArray[index];
+		volatile float4 forceData = force[index];
+
+		float3 vel = make_float3(velData.x, velData.y, velData.z);
+		float3 acc = cfg.gravity + make_float3(forceData.x, forceData.y, forceData.z);
+		vel += acc * (0.5f * cfg.deltaTime);
+
+		velArray[index] = make_float4(vel, velData.w);
+		velLeapFrogArray[index] = make_float4(vel, velData.w);
+}
+
+// removes kinetic energy while the walls are being set up
+__global__ void dampVelocityD(
+	float4* velArray,		 // input, output
+	float4* velLeapFrogArray, // input, output
+	float factor,
+	uint numParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float4 vel = velArray[index];
+		float4 velLeapFrog = velLeapFrogArray[index];
+		velArray[index] = make_float4(factor * make_float3(vel), vel.w);
+		velLeapFrogArray[index] = make_float4(factor * make_float3(velLeapFrog), velLeapFrog.w);
+}
+
+// frame change along x, used when switching to the wave frame
+__global__ void shiftVelocityD(
+	float4* velArray,	// input, output
+	float shift,
+	uint numParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		velArray[index].x += shift;
+}
+
+__global__ void moveBoundaryD(
+	float4* posArray,	// wall part of particle array
+	float elapsedTime,
+	uint numBoundaryParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numBoundaryParticles) return;
+
+		volatile float4 posData = posArray[index]; 	
+		if(posData.w > 0.0f)//bottom
+		{
+			posArray[index] = make_float4(
+				posData.x,
+				-1.0f * cfg.fluid_size.y * cfg.radius +
+				cfg.amplitude * cfg.GetWave(posData.x, elapsedTime)
+				- cfg.radius * (posData.w - 1.0f),
+				posData.z,
+				posData.w);									
+		}
+		else//top
+		{
+			posArray[index] = make_float4(posData.x,
+				cfg.fluid_size.y * cfg.radius - 
+				cfg.amplitude * cfg.GetWave(posData.x, elapsedTime) + 
+				cfg.radius * (-posData.w - 1.0f),
+				posData.z,
+				posData.w);		
+		}
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "cutil_math.h"
 #include "math_constants.h"
 #include "peristalsisKernel.cuh"
+#include "../Common/sph_probes.h"
 
 #if USE_TEX
 texture<float4, 1, cudaReadModeElementType> oldPosTex;
@@ -23,17 +24,66 @@ __device__ int3 calcGridPos(float3 p){
 	return gridPos;
 }
 
+// x is not wrapped: columns left and right of the grid are ghost cells,
+// stored after the gridSize.x * gridSize.y * gridSize.z domain cells
 __device__ uint calcGridHash(int3 gridPos){
-	gridPos.x = gridPos.x & (cfg.gridSize.x-1);  
 	gridPos.y = gridPos.y & (cfg.gridSize.y-1);
 	gridPos.z = gridPos.z & (cfg.gridSize.z-1);        
-	return __umul24(__umul24(gridPos.z, cfg.gridSize.y), cfg.gridSize.x) + __umul24(gridPos.y, cfg.gridSize.x) + gridPos.x;
+	uint row = __umul24(gridPos.z, cfg.gridSize.y) + gridPos.y;
+	if (gridPos.x >= 0 && gridPos.x < cfg.gridSize.x)
+		return __umul24(row, cfg.gridSize.x) + gridPos.x;
+
+	uint numDomainCells = __umul24(__umul24(cfg.gridSize.z, cfg.gridSize.y), cfg.gridSize.x);
+	int ghostColumn = (gridPos.x < 0) ? 
+		gridPos.x + cfg.ghostCells :
+		gridPos.x - cfg.gridSize.x + cfg.ghostCells;
+	return numDomainCells + __umul24(row, 2 * cfg.ghostCells) + ghostColumn;
+}
+
+__device__ uint calcSortKey(uint gridHash, float type){
+	return (type == 0.0f) ? gridHash : gridHash + cfg.numGridCells;
+}
+
+// wraps particles into the periodic x range and writes their images for
+// the ghost columns after the real particles; runs once per step
+__global__ void refreshPeristalsisGhostsD(
+	float4* pos,          // input, output; ghosts start at numParticles
+	float4* vel,          // input, output
+	uint*   ghostSource,  // output, real particle each ghost is copied from
+	uint*   ghostCount,   // output
+	uint    numParticles,
+	uint    maxGhostParticles){
+		uint index = __umul24(blockIdx.x, blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float4 p = pos[index];
+		if (p.x >= cfg.worldOrigin.x + cfg.worldSize.x)
+			p.x -= cfg.worldSize.x;
+		if (p.x < cfg.worldOrigin.x)
+			p.x += cfg.worldSize.x;
+		pos[index] = p;
+
+		int column = calcGridPos(make_float3(p)).x;
+		float shift;
+		if (column < cfg.ghostCells)
+			shift = cfg.worldSize.x;
+		else if (column >= (int)cfg.gridSize.x - cfg.ghostCells)
+			shift = -cfg.worldSize.x;
+		else
+			return;
+
+		uint slot = atomicAdd(ghostCount, 1);
+		if (slot >= maxGhostParticles) return;
+		pos[numParticles + slot] = make_float4(p.x + shift, p.y, p.z, p.w);
+		vel[numParticles + slot] = vel[index];
+		ghostSource[slot] = index;
 }
 
 __global__ void calculatePeristalsisHashD(
 	uint*   gridParticleHash,  // output
 	uint*   gridParticleIndex, // output
 	float4* pos,               // input
+	uint    numRealParticles,  // ghosts follow the real particles
 	uint    numParticles){
 		uint index = __umul24(blockIdx.x, blockDim.x) + threadIdx.x;
 		if (index >= numParticles) return;
@@ -41,7 +91,15 @@ __global__ void calculatePeristalsisHashD(
 		volatile float4 p = pos[index];
 
 		int3 gridPos = calcGridPos(make_float3(p.x, p.y, p.z));
-		uint hash = calcGridHash(gridPos);
+		// keep rounding at the periodic edge from moving particles across the domain border
+		int gx = cfg.gridSize.x;
+		if (index < numRealParticles)
+			gridPos.x = clamp(gridPos.x, 0, gx - 1);
+		else if (gridPos.x < gx / 2)
+			gridPos.x = clamp(gridPos.x, -cfg.ghostCells, -1);
+		else
+			gridPos.x = clamp(gridPos.x, gx, gx + cfg.ghostCells - 1);
+		uint hash = calcSortKey(calcGridHash(gridPos), p.w);
 
 		gridParticleHash[index] = hash;
 		gridParticleIndex[index] = index;
@@ -53,6 +111,7 @@ __global__ void reorderPeristalsisDataD(
 	float4* sortedPos,        // output
 	float4* sortedVel,        // output
 	uint *  gridParticleHash, // input
+	uint*   gridParticleRank, // output, sorted position of each particle
 	uint *  gridParticleIndex,// input
 	float4* oldPos,           // input
 	float4* oldVel,           // input
@@ -88,6 +147,7 @@ __global__ void reorderPeristalsisDataD(
 			}
 
 			uint sortedIndex = gridParticleIndex[index];
+			gridParticleRank[sortedIndex] = index;
 			float4 pos = FETCH(oldPos, sortedIndex);       
 			float4 vel = FETCH(oldVel, sortedIndex);       
 
@@ -96,51 +156,20 @@ __global__ void reorderPeristalsisDataD(
 		}
 }
 
-__global__ void predictCoordinatesD(
-	float4* predictedPosition,
-	float4* predictedVelocity,
-	float4* posArray,		 
-	float4* velArray,		 	
-	float4* viscouseForce,	 
-	float4* pressureForce,
-	uint numParticles){
+// ghosts take density and pressure of the particle they were copied from
+__global__ void copyGhostMeasuresD(
+	float4* measures,         // input, output, sorted order
+	uint*   ghostSource,      // input
+	uint*   gridParticleRank, // input
+	uint    numRealParticles,
+	uint    numGhostParticles){
 		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
-		if (index >= numParticles) return;     		
+		if (index >= numGhostParticles) return;
 
-		volatile float4 posData = posArray[index]; 	
-		volatile float4 velData = velArray[index];
-		volatile float4 viscouseData = viscouseForce[index];
-		volatile float4 pressureData = pressureForce[index];
-
-		float3 pos = make_float3(posData.x, posData.y, posData.z);
-		float3 vel = make_float3(velData.x, velData.y, velData.z);
-		float3 vis = make_float3(viscouseData.x, viscouseData.y, viscouseData.z);
-		float3 pres = make_float3(pressureData.x, pressureData.y, pressureData.z);
-		
-		if(posData.w !=0.0f){
-			predictedPosition[index] = make_float4(pos, posData.w);
-			predictedVelocity[index] = make_float4(0.0f);
-			return;	
-		}
-
-		float3 nextVel = vel + (cfg.gravity + (vis + pres) ) * cfg.deltaTime;		
-		
-		pos += nextVel * cfg.deltaTime;   
-		float halfWorldXSize = cfg.gridSize.x * cfg.radius;			
-
-		if(pos.x > halfWorldXSize){
-			pos.x -= 2 * halfWorldXSize;
-		}
-		if(pos.x < -halfWorldXSize){
-			pos.x += 2 * halfWorldXSize;
-		}
-		  
-		predictedPosition[index] = make_float4(pos, posData.w);		
-		predictedVelocity[index] = make_float4(0.0f);
+		measures[gridParticleRank[numRealParticles + index]] = 
+			measures[gridParticleRank[ghostSource[index]]];
 }
 
-
-
 __global__ void configureBoundaryD(	
 	float4* posArray,
 	float currentWaveHeight,
@@ -169,3 +198,14 @@ __global__ void configureBoundaryD(
 				posData.w);
 		}
 }
+
+// probe walk on this grid, see Common/sph_probes.h
+struct PeristalsisProbeGrid {
+	__device__ int3 gridPos(float3 p) const { return calcGridPos(p); }
+	__device__ uint hash(int3 gridPos) const { return calcGridHash(gridPos); }
+	__device__ bool inside(int3 gridPos) const {
+		return gridPos.x >= 0 && gridPos.x < cfg.gridSize.x &&
+			gridPos.y >= 0 && gridPos.y < cfg.gridSize.y &&
+			gridPos.z >= 0 && gridPos.z < cfg.gridSize.z;
+	}
+};
@@ -2,6 +2,7 @@
 #define PERISTALSIS_KERNEL_CUH_
 #include "vector_types.h"
 #include <math.h>
+#include "../Common/sph_kernels.h"
 
 #ifndef __DEVICE_EMULATION__
 #define USE_TEX 1
@@ -19,8 +20,16 @@
 
 typedef unsigned int uint;
 
+// smoothing kernel and equation of state, see Common/sph_kernels.h
+typedef sph::WendlandC2<2> PeristalsisKernel;
+// with K = 50 * soundspeed, not soundspeed^2: the calibrated stiffness of
+// the original code, soundspeed is a stiffness parameter here
+typedef sph::Isothermal PeristalsisEos;
+
 struct Peristalsiscfg {     
 	uint3 gridSize;
+	uint numGridCells; //wall particles are stored after fluid ones, at hash + numGridCells
+	int ghostCells;    //periodic images in x, columns of ghost cells on each side of the grid
 	float3 worldOrigin;
 	float3 cellSize;
 	float3 worldSize;
@@ -11,9 +11,16 @@
 #include <stdio.h>
 #include <thrust/device_ptr.h>
 #include <thrust/device_vector.h>
+#include "../Common/helper_timer.h"
 
 using namespace thrust;
 
+//FAST_STARTUP: walls reach the amplitude in FastRampSteps, then the fluid settles
+//for FastRelaxSteps; velocities are damped by FastStartupDamping every step of both
+const int FastRampSteps = 100;
+const int FastRelaxSteps = 200;
+const float FastStartupDamping = 0.95f;
+
 PeristalsisSystem::PeristalsisSystem(
 	float deltaTime,
 	uint3 fluid_size,
@@ -36,10 +43,21 @@ PeristalsisSystem::PeristalsisSystem(
 	predictedPosition(0),
 	viscousForce(0),
 	pressureForce(0),
+	dForce(0),
+	dProbes(0),
+	dProbeVelocity(0),
+	dProbeMeasures(0),
+	maxProbes(0),
+	IsForceDiagnostics(false),
+	integrator(EXPLICIT_EULER),
+	IsForceCurrent(false),
+	IsWaveFrame(false),
+	startup(RAMP_STARTUP),
+	startupTimer(0),
 	elapsedTime(0.0f){		
 		numParticles = fluid_size.x * fluid_size.y * fluid_size.z +			
 			2 * gridSize.x * boundaryOffset;
-		numGridCells = gridSize.x * gridSize.y * gridSize.z;
+		numFluidParticles = fluid_size.x * fluid_size.y * fluid_size.z;
 		gridSortBits = 18;	
 		cfg.fluid_size = fluid_size;
 		cfg.gridSize = gridSize;	
@@ -51,6 +69,15 @@ PeristalsisSystem::PeristalsisSystem(
 		cfg.restDensity = 1000.0f;						
 		cfg.particleMass = 0.0f;
 		cfg.cellcount = 3;			    			
+		cfg.ghostCells = cfg.cellcount;
+		assert(2 * cfg.ghostCells <= gridSize.x);
+		numGridCells = (gridSize.x + 2 * cfg.ghostCells) * gridSize.y * gridSize.z;
+		cfg.numGridCells = numGridCells;
+		//each particle has at most one image, the margin covers uneven columns
+		numGhostParticles = 0;
+		numDroppedGhosts = 0;
+		maxGhostParticles = std::min(numParticles,
+			4 * cfg.ghostCells * numParticles / gridSize.x + gridSize.y);
 		cfg.worldOrigin = make_float3(-getHalfWorldXSize(), -getHalfWorldYSize(), -getHalfWorldZSize());
 		float cellSize = cfg.radius * 2.0f;  
 		cfg.cellSize = make_float3(cellSize, cellSize, cellSize);	    		
@@ -76,10 +103,12 @@ PeristalsisSystem::PeristalsisSystem(
 		cfg.IsBoundaryConfiguration = true;
 		currentWaveHeight = 0.0f;
 		epsDensity = 0.01f;
+		sdkCreateTimer(&startupTimer);
 		_initialize(numParticles);
 }
 
 PeristalsisSystem::~PeristalsisSystem(){
+	sdkDeleteTimer(&startupTimer);
 	_finalize();
 	numParticles = 0;
 }
@@ -98,6 +127,7 @@ void PeristalsisSystem::_initialize(uint numParticles){
 
 	numParticles = numParticles;
 	unsigned int memSize = sizeof(float) * 4 * numParticles;
+	unsigned int sortedMemSize = sizeof(float) * 4 * (numParticles + maxGhostParticles);
 
 	hPos = new float[numParticles*4];
 	hVel = new float[numParticles*4];	
@@ -107,7 +137,7 @@ void PeristalsisSystem::_initialize(uint numParticles){
 	memset(hMeasures, 0, numParticles*4*sizeof(float));	
 
 	if (IsOpenGL) {
-		posVbo = createVBO(memSize);    
+		posVbo = createVBO(sortedMemSize);    
 		registerGLBufferObject(posVbo, &cuda_posvbo_resource);
 		colorVBO = createVBO(numParticles*4*sizeof(float));
 		registerGLBufferObject(colorVBO, &cuda_colorvbo_resource);
@@ -115,23 +145,28 @@ void PeristalsisSystem::_initialize(uint numParticles){
 		//SetColorBuffer(numParticles);
 
 	} else {
-		cutilSafeCall( cudaMalloc( (void **)&cudaPosVBO, memSize ));
+		cutilSafeCall( cudaMalloc( (void **)&cudaPosVBO, sortedMemSize ));
 		cutilSafeCall( cudaMalloc( (void **)&cudaColorVBO, sizeof(float)*numParticles*4) );
 	}
 
 	allocateArray((void**)&dVel, memSize);
-	allocateArray((void**)&dVelLeapFrog, memSize);
+	allocateArray((void**)&dVelLeapFrog, sortedMemSize);
 	allocateArray((void**)&viscousForce, memSize);
 	allocateArray((void**)&pressureForce, memSize);
-	allocateArray((void**)&dMeasures, memSize);
+	allocateArray((void**)&dForce, memSize);
+	allocateArray((void**)&dMeasures, sortedMemSize);
 	allocateArray((void**)&predictedPosition, memSize);
-	allocateArray((void**)&predictedVelocity, memSize);	
-	allocateArray((void**)&dSortedPos, memSize);
-	allocateArray((void**)&dSortedVel, memSize);	
-	allocateArray((void**)&dHash, numParticles*sizeof(uint));
-	allocateArray((void**)&dIndex, numParticles*sizeof(uint));
-	allocateArray((void**)&dCellStart, numGridCells*sizeof(uint));
-	allocateArray((void**)&dCellEnd, numGridCells*sizeof(uint));		
+	allocateArray((void**)&predictedVelocity, sortedMemSize);	
+	allocateArray((void**)&dSortedPos, sortedMemSize);
+	allocateArray((void**)&dSortedVel, sortedMemSize);	
+	uint maxSortedParticles = numParticles + maxGhostParticles;
+	allocateArray((void**)&dHash, maxSortedParticles*sizeof(uint));
+	allocateArray((void**)&dIndex, maxSortedParticles*sizeof(uint));
+	allocateArray((void**)&dRank, maxSortedParticles*sizeof(uint));
+	allocateArray((void**)&dGhostSource, maxGhostParticles*sizeof(uint));
+	allocateArray((void**)&dGhostCount, sizeof(uint));
+	allocateArray((void**)&dCellStart, 2*numGridCells*sizeof(uint));
+	allocateArray((void**)&dCellEnd, 2*numGridCells*sizeof(uint));		
 
 	setParameters(&cfg);
 	
@@ -150,14 +185,24 @@ void PeristalsisSystem::_finalize(){
 	freeArray(dMeasures);
 	freeArray(viscousForce);
 	freeArray(pressureForce);
+	freeArray(dForce);
 	freeArray(predictedPosition);
 	freeArray(predictedVelocity);	
 	freeArray(dSortedPos);
 	freeArray(dSortedVel);
 	freeArray(dHash);
 	freeArray(dIndex);
+	freeArray(dRank);
+	freeArray(dGhostSource);
+	freeArray(dGhostCount);
 	freeArray(dCellStart);
 	freeArray(dCellEnd);
+	if (maxProbes > 0) {
+		freeArray(dProbes);
+		freeArray(dProbeVelocity);
+		freeArray(dProbeMeasures);
+		maxProbes = 0;
+	}
 
 	if (IsOpenGL) {
 		unregisterGLBufferObject(cuda_posvbo_resource);
@@ -204,6 +249,12 @@ void PeristalsisSystem::setArray(ParticleArray array, const float* data, int sta
 	case VELOCITYLEAPFROG:		
 		copyArrayToDevice(dVelLeapFrog, data, start*4*sizeof(float), count*4*sizeof(float));
 		break;	
+	case PREDICTEDVELOCITY:		
+		copyArrayToDevice(predictedVelocity, data, start*4*sizeof(float), count*4*sizeof(float));
+		break;	
+	case FORCE:		
+		copyArrayToDevice(dForce, data, start*4*sizeof(float), count*4*sizeof(float));
+		break;	
 	case PREDICTEDPOSITION:		
 		copyArrayToDevice(predictedPosition, data, start*4*sizeof(float), count*4*sizeof(float));
 		break;	
@@ -213,9 +264,14 @@ void PeristalsisSystem::setArray(ParticleArray array, const float* data, int sta
 void PeristalsisSystem::Reset(){
 	elapsedTime = 0.0f;	
 	time_shift = 0.0f;
-	time_relax = 1000 * cfg.deltaTime;
+	time_relax = (startup == FAST_STARTUP ? FastRelaxSteps : 1000) * cfg.deltaTime;
 	currentWaveHeight = 0.0f;
 	cfg.IsBoundaryConfiguration = true;
+	startupSteps = 0;
+	startupSeconds = 0.0f;
+	cudaThreadSynchronize();
+	sdkResetTimer(&startupTimer);
+	sdkStartTimer(&startupTimer);
 	float jitter = cfg.radius * 0.01f;			            
 	float spacing = cfg.radius * 2.0f;
 	initFluid(spacing, jitter, numParticles);
@@ -228,6 +284,9 @@ void PeristalsisSystem::Reset(){
 	setArray(PRESSUREFORCE, hMeasures, 0, numParticles);
 	setArray(VELOCITYLEAPFROG, hMeasures, 0, numParticles);
 	setArray(PREDICTEDPOSITION, hMeasures, 0, numParticles);
+	setArray(PREDICTEDVELOCITY, hMeasures, 0, numParticles);
+	setArray(FORCE, hMeasures, 0, numParticles);
+	IsForceCurrent = false;
 
 	cfg.particleMass = cfg.restDensity / CalculateMass(hPos, cfg.gridSize);
 	setParameters(&cfg);	
@@ -329,34 +388,97 @@ void PeristalsisSystem::Update(){
 
 	if(cfg.IsBoundaryConfiguration){
 		time_shift +=cfg.deltaTime;
+		startupSteps++;
 		if (currentWaveHeight < cfg.amplitude){
-			ExtConfigureBoundary(dPos, currentWaveHeight, numParticles);
-			currentWaveHeight += cfg.deltaTime * powf(10.0f, -3.0f);				
+			if (startup == FAST_STARTUP)
+				currentWaveHeight = std::min(currentWaveHeight + cfg.amplitude / FastRampSteps, cfg.amplitude);
+			ExtConfigureBoundary(dPos + 4 * numFluidParticles, currentWaveHeight, numParticles - numFluidParticles);
+			if (startup == RAMP_STARTUP)
+				currentWaveHeight += cfg.deltaTime * powf(10.0f, -3.0f);				
 		}
 		else{
 			time_relax -= cfg.deltaTime;
 			if(time_relax < 0){				
 				cfg.IsBoundaryConfiguration = !cfg.IsBoundaryConfiguration;
 				setParameters(&cfg);
+				if (IsWaveFrame)
+					StartWaveFrame();
+				cudaThreadSynchronize();
+				startupSeconds = sdkGetTimerValue(&startupTimer) / 1000.0f;
+				sdkStopTimer(&startupTimer);
 			}
 		}
 	}			
 
-	calculatePeristalsisHash(dHash, dIndex, dPos, numParticles);
+	//velocity the force pass sees: leap frog one, or the predicted one for Verlet
+	float* sphVel = dVelLeapFrog;
+	if (integrator == VELOCITY_VERLET) {
+		//the first half kick needs the force of the start positions
+		if (!IsForceCurrent)
+			computeSphForces(dPos, dVelLeapFrog);
+		kickDrift(dPos, dVel, predictedVelocity, dForce, numFluidParticles);
+		sphVel = predictedVelocity;
+	}
+
+	computeSphForces(dPos, sphVel);
+	IsForceCurrent = true;
+
+	if (integrator == VELOCITY_VERLET)
+		kick(dVel, dVelLeapFrog, dForce, numFluidParticles);
+	else
+		computeCoordinates(
+			dPos,
+			dVel,	
+			dVelLeapFrog,
+			dForce,
+			cfg.IsBoundaryConfiguration? 0: elapsedTime - time_shift,
+			numFluidParticles);
+
+	if(cfg.IsBoundaryConfiguration && startup == FAST_STARTUP)
+		dampVelocity(dVel, dVelLeapFrog, FastStartupDamping, numFluidParticles);
+
+	if(!cfg.IsBoundaryConfiguration && !IsWaveFrame)
+		moveBoundary(
+			dPos + 4 * numFluidParticles,
+			elapsedTime - time_shift,
+			numParticles - numFluidParticles);
+
+	if (IsOpenGL) {
+		unmapGLBufferObject(cuda_posvbo_resource);
+	}
+	elapsedTime+= cfg.deltaTime;
+}
+
+// neighbour search, density and force pass on the current positions,
+// viscosity sees sphVel; leaves the force in dForce
+void PeristalsisSystem::computeSphForces(float* dPos, float* sphVel){
+	numGhostParticles = refreshGhosts(
+		dPos,
+		sphVel,
+		dGhostSource,
+		dGhostCount,
+		numParticles,
+		maxGhostParticles,
+		&numDroppedGhosts);
+	assert(numDroppedGhosts == 0);
+	uint numSortedParticles = numParticles + numGhostParticles;
+
+	calculatePeristalsisHash(dHash, dIndex, dPos, numParticles, numSortedParticles);
 	
-	sortParticles(dHash, dIndex, numParticles);
+	sortParticles(dHash, dIndex, numSortedParticles);
 
 	reorderPeristalsisData(
 		dCellStart,
 		dCellEnd,
 		dSortedPos,		
 		dSortedVel,
+		dRank,
 		dHash,
 		dIndex,
 		dPos,		
-		dVelLeapFrog,
-		numParticles,
-		numGridCells);	
+		sphVel,
+		numSortedParticles,
+		2*numGridCells);	
 
 	computeDensityVariation(		
 		dMeasures, //output
@@ -365,45 +487,106 @@ void PeristalsisSystem::Update(){
 		dIndex,
 		dCellStart,
 		dCellEnd,
-		numParticles,
+		numSortedParticles,
 		numGridCells);
 
-	computeViscousForce(
-		viscousForce,//not sorted			
+	copyGhostMeasures(
+		dMeasures,
+		dGhostSource,
+		dRank,
+		numParticles,
+		numGhostParticles);
+
+	computeForce(
+		dForce,//not sorted
+		IsForceDiagnostics ? pressureForce : 0,
+		IsForceDiagnostics ? viscousForce : 0,
 		dMeasures, //input
 		dSortedPos,			
 		dSortedVel,
 		dIndex,
 		dCellStart,
 		dCellEnd,
-		numParticles,
+		numSortedParticles,
+		numFluidParticles,
 		cfg.IsBoundaryConfiguration? 0: elapsedTime - time_shift,
 		numGridCells);    
+}
 
-	computePressureForce(
-		pressureForce,//not sorted		
-		dMeasures, //input
-		dSortedPos, 
-		dIndex,
-		dCellStart,
-		dCellEnd,
-		numParticles,
-		cfg.IsBoundaryConfiguration? 0: elapsedTime - time_shift,
-		numGridCells);
+// the walls are at the wave phase of t = 0, which is where the wave frame
+// and the lab frame coincide; from here on walls move with -wave_speed along
+// themselves and the fluid gets the same velocity shift
+void PeristalsisSystem::StartWaveFrame(){
+	shiftVelocity(dVel, -cfg.wave_speed, numParticles);
+	shiftVelocity(dVelLeapFrog, -cfg.wave_speed, numParticles);
+	shiftVelocity(predictedVelocity, -cfg.wave_speed, numParticles);
+}
 
-	computeCoordinates(
-		dPos,
-		dVel,	
-		dVelLeapFrog,
-		viscousForce,
-		pressureForce,
-		cfg.IsBoundaryConfiguration? 0: elapsedTime - time_shift,
-		numParticles);
+//distance the simulation frame has moved against the lab frame, 0 outside the wave frame
+float PeristalsisSystem::WaveFrameShift() const {
+	if (!IsWaveFrame || cfg.IsBoundaryConfiguration)
+		return 0.0f;
+	return fmodf(cfg.wave_speed * (elapsedTime - time_shift), cfg.worldSize.x);
+}
 
-	if (IsOpenGL) {
-		unmapGLBufferObject(cuda_posvbo_resource);
+void PeristalsisSystem::ToLabFrame(float4* positions, float4* velocities, uint count) const {
+	if (!IsWaveFrame || cfg.IsBoundaryConfiguration)
+		return;
+	float shift = WaveFrameShift();
+	for (uint i = 0; i < count; i++) {
+		if (positions) {
+			positions[i].x += shift;
+			if (positions[i].x >= cfg.worldOrigin.x + cfg.worldSize.x)
+				positions[i].x -= cfg.worldSize.x;
+		}
+		if (velocities)
+			velocities[i].x += cfg.wave_speed;
 	}
-	elapsedTime+= cfg.deltaTime;
+}
+
+void PeristalsisSystem::ToSimulationFrame(float4* positions, uint count) const {
+	float shift = WaveFrameShift();
+	if (shift == 0.0f)
+		return;
+	for (uint i = 0; i < count; i++) {
+		positions[i].x -= shift;
+		if (positions[i].x < cfg.worldOrigin.x)
+			positions[i].x += cfg.worldSize.x;
+	}
+}
+
+// fields are those of the last neighbour pass, one step behind the positions
+void PeristalsisSystem::SampleProbes(const float* probes, uint numProbes, float* velocity, float* measures){
+	assert(IsInitialized);
+	if (numProbes == 0)
+		return;
+	if (numProbes > maxProbes) {
+		if (maxProbes > 0) {
+			freeArray(dProbes);
+			freeArray(dProbeVelocity);
+			freeArray(dProbeMeasures);
+		}
+		allocateArray((void**)&dProbes, numProbes*4*sizeof(float));
+		allocateArray((void**)&dProbeVelocity, numProbes*4*sizeof(float));
+		allocateArray((void**)&dProbeMeasures, numProbes*4*sizeof(float));
+		maxProbes = numProbes;
+	}
+	copyArrayToDevice(dProbes, probes, 0, numProbes*4*sizeof(float));
+	samplePeristalsisProbes(
+		velocity,
+		measures,
+		dProbeVelocity,
+		dProbeMeasures,
+		dProbes,
+		numProbes,
+		dSortedPos,
+		dSortedVel,
+		dMeasures,
+		dCellStart,
+		dCellEnd,
+		cfg.cellcount,
+		cfg.smoothingRadius,
+		cfg.particleMass);
 }
 
 void PeristalsisSystem::Coloring()
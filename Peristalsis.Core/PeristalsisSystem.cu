@@ -12,8 +12,7 @@
 
 #include "peristalsisKernel.cu"
 #include "peristalsisDensity.cu"
-#include "peristalsisPressureForce.cu"
-#include "peristalsisViscousForce.cu"
+#include "peristalsisForce.cu"
 #include "peristalsisIntegrate.cu"
 
 extern "C"
@@ -96,10 +95,38 @@ extern "C"
 			cutilCheckMsg("configureBoundary kernel execution failed");
 	}
 
+	uint refreshGhosts(
+		float* pos,
+		float* vel,
+		uint*  ghostSource,
+		uint*  ghostCount,
+		uint   numParticles,
+		uint   maxGhostParticles,
+		uint*  numDropped){
+			uint numThreads, numBlocks;
+			computeGridSize(numParticles, 256, numBlocks, numThreads);
+
+			cutilSafeCall(cudaMemset(ghostCount, 0, sizeof(uint)));
+			refreshPeristalsisGhostsD<<< numBlocks, numThreads >>>(
+				(float4 *) pos,
+				(float4 *) vel,
+				ghostSource,
+				ghostCount,
+				numParticles,
+				maxGhostParticles);
+			cutilCheckMsg("Kernel execution failed: refreshPeristalsisGhostsD");
+
+			uint numGhostParticles;
+			cutilSafeCall(cudaMemcpy(&numGhostParticles, ghostCount, sizeof(uint), cudaMemcpyDeviceToHost));
+			*numDropped = numGhostParticles - min(numGhostParticles, maxGhostParticles);
+			return min(numGhostParticles, maxGhostParticles);
+	}
+
 	void calculatePeristalsisHash(
 		uint* gridParticleHash,
 		uint* gridParticleIndex,
 		float* pos, 
+		uint numRealParticles,
 		int numParticles){
 			uint numThreads, numBlocks;
 			computeGridSize(numParticles, 256, numBlocks, numThreads);
@@ -108,6 +135,7 @@ extern "C"
 				gridParticleHash,
 				gridParticleIndex,
 				(float4 *) pos,
+				numRealParticles,
 				numParticles);
 		    
 			cutilCheckMsg("Kernel execution failed: calculatePeristalsisHashD");
@@ -125,6 +153,7 @@ extern "C"
 		uint*  cellEnd,
 		float* sortedPos,
 		float* sortedVel,
+		uint*  gridParticleRank,
 		uint*  gridParticleHash,
 		uint*  gridParticleIndex,
 		float* oldPos,
@@ -147,6 +176,7 @@ extern "C"
 					cellEnd,
 					(float4 *) sortedPos,
 					(float4 *) sortedVel,
+					gridParticleRank,
 					gridParticleHash,
 					gridParticleIndex,
 					(float4 *) oldPos,
@@ -172,8 +202,8 @@ extern "C"
 			#if USE_TEX
 			cutilSafeCall(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
 			cutilSafeCall(cudaBindTexture(0, oldMeasuresTex, measuresInput, numParticles*sizeof(float4)));			
-			cutilSafeCall(cudaBindTexture(0, cellStartTex, cellStart, numGridCells*sizeof(uint)));
-			cutilSafeCall(cudaBindTexture(0, cellEndTex, cellEnd, numGridCells*sizeof(uint)));    
+			cutilSafeCall(cudaBindTexture(0, cellStartTex, cellStart, 2*numGridCells*sizeof(uint)));
+			cutilSafeCall(cudaBindTexture(0, cellEndTex, cellEnd, 2*numGridCells*sizeof(uint)));    
 			#endif
 
 			uint numThreads, numBlocks;
@@ -198,7 +228,29 @@ extern "C"
 			#endif
 	}
 
-	void computeViscousForce(
+	void copyGhostMeasures(
+		float* measures,
+		uint*  ghostSource,
+		uint*  gridParticleRank,
+		uint   numRealParticles,
+		uint   numGhostParticles){
+			if (numGhostParticles == 0)
+				return;
+			uint numThreads, numBlocks;
+			computeGridSize(numGhostParticles, 256, numBlocks, numThreads);
+
+			copyGhostMeasuresD<<< numBlocks, numThreads >>>(
+				(float4*)measures,
+				ghostSource,
+				gridParticleRank,
+				numRealParticles,
+				numGhostParticles);
+			cutilCheckMsg("Kernel execution failed: copyGhostMeasuresD");
+	}
+
+	void computeForce(
+		float* force,
+		float* pressureForce,
 		float* viscousForce,
 		float* sortedMeasures,
 		float* sortedPos,			
@@ -207,20 +259,23 @@ extern "C"
 		uint* cellStart,
 		uint* cellEnd,
 		uint numParticles,
+		uint numFluidParticles,
 		float elapsedTime,
 		uint numGridCells){
 			#if USE_TEX
 			cutilSafeCall(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
 			cutilSafeCall(cudaBindTexture(0, oldVelTex, sortedVel, numParticles*sizeof(float4)));		
 			cutilSafeCall(cudaBindTexture(0, oldMeasuresTex, sortedMeasures, numParticles*sizeof(float4)));
-			cutilSafeCall(cudaBindTexture(0, cellStartTex, cellStart, numGridCells*sizeof(uint)));
-			cutilSafeCall(cudaBindTexture(0, cellEndTex, cellEnd, numGridCells*sizeof(uint)));    
+			cutilSafeCall(cudaBindTexture(0, cellStartTex, cellStart, 2*numGridCells*sizeof(uint)));
+			cutilSafeCall(cudaBindTexture(0, cellEndTex, cellEnd, 2*numGridCells*sizeof(uint)));    
 			#endif
 
 			uint numThreads, numBlocks;
-			computeGridSize(numParticles, 64, numBlocks, numThreads);
+			computeGridSize(numFluidParticles, 64, numBlocks, numThreads);
 
-			computeViscousForceD<<< numBlocks, numThreads >>>(
+			computeForceD<<< numBlocks, numThreads >>>(
+				(float4*)force,
+				(float4*)pressureForce,
 				(float4*)viscousForce,
 				(float4*)sortedMeasures,		
 				(float4*)sortedPos,                                          
@@ -228,10 +283,10 @@ extern "C"
 				gridParticleIndex,
 				cellStart,
 				cellEnd,
-				numParticles,
+				numFluidParticles,
 				elapsedTime);
 
-			cutilCheckMsg("Kernel execution failed");
+			cutilCheckMsg("Kernel execution failed: computeForceD");
 
 			#if USE_TEX
 			cutilSafeCall(cudaUnbindTexture(oldPosTex));
@@ -242,91 +297,148 @@ extern "C"
 			#endif
 	}
 
-	void computePressureForce(
-		float* pressureForce,		
-		float* sortedMeasures,
-		float* sortedPos,					
-		uint* gridParticleIndex,
-		uint* cellStart,
-		uint* cellEnd,
-		uint numParticles,
-		float elapsedTime,
-		uint numGridCells){
-			#if USE_TEX
-			cutilSafeCall(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
-			cutilSafeCall(cudaBindTexture(0, oldMeasuresTex, sortedMeasures, numParticles*sizeof(float4)));			
-			cutilSafeCall(cudaBindTexture(0, cellStartTex, cellStart, numGridCells*sizeof(uint)));
-			cutilSafeCall(cudaBindTexture(0, cellEndTex, cellEnd, numGridCells*sizeof(uint)));    
-			#endif
-
+	void kickDrift(
+		float* pos,
+		float* vel,  
+		float* predictedVelocity,
+		float* force,
+		uint numFluidParticles){
 			uint numThreads, numBlocks;
-			computeGridSize(numParticles, 64, numBlocks, numThreads);
-
-			computePressureForceD<<< numBlocks, numThreads >>>(
-				(float4*)pressureForce,
-				(float4*)sortedMeasures,										  
-				(float4*)sortedPos,				
-				gridParticleIndex,
-				cellStart,
-				cellEnd,
-				numParticles,
-				elapsedTime);
+			computeGridSize(numFluidParticles, 256, numBlocks, numThreads);
 
-			cutilCheckMsg("Kernel execution failed");
-
-			#if USE_TEX
-			cutilSafeCall(cudaUnbindTexture(oldPosTex));
-			cutilSafeCall(cudaUnbindTexture(oldMeasuresTex));			
-			cutilSafeCall(cudaUnbindTexture(cellStartTex));
-			cutilSafeCall(cudaUnbindTexture(cellEndTex));
-			#endif
+			kickDriftD<<< numBlocks, numThreads >>>(
+				(float4*)pos,
+				(float4*)vel,
+				(float4*)predictedVelocity,
+				(float4*)force,
+				numFluidParticles);
+		    
+			cutilCheckMsg("kickDrift kernel execution failed");
 	}
 
-	void predictCoordinates(
-		float* predictedPosition,
-		float* predictedVelocity,
-		float* pos,
+	void kick(
 		float* vel,  
-		float* viscousForce,
-		float* pressureForce,
-		uint numParticles){
+		float* velLeapFrog,
+		float* force,
+		uint numFluidParticles){
 			uint numThreads, numBlocks;
-			computeGridSize(numParticles, 256, numBlocks, numThreads);
+			computeGridSize(numFluidParticles, 256, numBlocks, numThreads);
 
-			predictCoordinatesD<<< numBlocks, numThreads >>>(
-				(float4*)predictedPosition,
-				(float4*)predictedVelocity,
-				(float4*)pos,
+			kickD<<< numBlocks, numThreads >>>(
 				(float4*)vel,
-				(float4*)viscousForce,
-				(float4*)pressureForce,
-				numParticles);
+				(float4*)velLeapFrog,
+				(float4*)force,
+				numFluidParticles);
 		    
-			cutilCheckMsg("predictCoordinates kernel execution failed");
+			cutilCheckMsg("kick kernel execution failed");
 	}
 	
 	void computeCoordinates(
 		float* pos,
 		float* vel,  
 		float* velLeapFrog,
-		float* viscousForce,
-		float* pressureForce,
+		float* force,
 		float elapsedTime,
-		uint numParticles){
+		uint numFluidParticles){
 			uint numThreads, numBlocks;
-			computeGridSize(numParticles, 256, numBlocks, numThreads);
+			computeGridSize(numFluidParticles, 256, numBlocks, numThreads);
 
 			computeCoordinatesD<<< numBlocks, numThreads >>>(
 				(float4*)pos,
 				(float4*)vel,
 				(float4*)velLeapFrog,
-				(float4*)viscousForce,
-				(float4*)pressureForce,
+				(float4*)force,
 				elapsedTime,
-				numParticles);
+				numFluidParticles);
 		    
 			cutilCheckMsg("computeCoordinates kernel execution failed");
 	}
 
+	void dampVelocity(
+		float* vel,
+		float* velLeapFrog,
+		float factor,
+		uint numFluidParticles){
+			uint numThreads, numBlocks;
+			computeGridSize(numFluidParticles, 256, numBlocks, numThreads);
+
+			dampVelocityD<<< numBlocks, numThreads >>>(
+				(float4*)vel,
+				(float4*)velLeapFrog,
+				factor,
+				numFluidParticles);
+		    
+			cutilCheckMsg("dampVelocity kernel execution failed");
+	}
+
+	void shiftVelocity(
+		float* vel,
+		float shift,
+		uint numParticles){
+			uint numThreads, numBlocks;
+			computeGridSize(numParticles, 256, numBlocks, numThreads);
+
+			shiftVelocityD<<< numBlocks, numThreads >>>(
+				(float4*)vel,
+				shift,
+				numParticles);
+		    
+			cutilCheckMsg("shiftVelocity kernel execution failed");
+	}
+
+	void moveBoundary(
+		float* boundaryPos,
+		float elapsedTime,
+		uint numBoundaryParticles){
+			uint numThreads, numBlocks;
+			computeGridSize(numBoundaryParticles, 256, numBlocks, numThreads);
+
+			moveBoundaryD<<< numBlocks, numThreads >>>(
+				(float4*)boundaryPos,
+				elapsedTime,
+				numBoundaryParticles);
+		    
+			cutilCheckMsg("moveBoundary kernel execution failed");
+	}
+
+	void samplePeristalsisProbes(
+		float* hostVelocity,
+		float* hostMeasures,
+		float* velocity,
+		float* measures,
+		float* probes,
+		uint   numProbes,
+		float* sortedPos,
+		float* sortedVel,
+		float* sortedMeasures,
+		uint*  cellStart,
+		uint*  cellEnd,
+		int    cellcount,
+		float  smoothingRadius,
+		float  particleMass){
+			uint numThreads, numBlocks;
+			computeGridSize(numProbes, 128, numBlocks, numThreads);
+
+			sph::sampleProbesD<PeristalsisKernel><<< numBlocks, numThreads >>>(
+				(float4*)velocity,
+				(float4*)measures,
+				(float4*)probes,
+				numProbes,
+				(float4*)sortedPos,
+				(float4*)sortedVel,
+				(float4*)sortedMeasures,
+				cellStart,
+				cellEnd,
+				PeristalsisProbeGrid(),
+				cellcount,
+				smoothingRadius,
+				particleMass);
+
+			cutilCheckMsg("sampleProbes kernel execution failed");
+
+			cutilSafeCall( cudaMemcpy(hostVelocity, velocity, numProbes*4*sizeof(float), cudaMemcpyDeviceToHost) );
+			cutilSafeCall( cudaMemcpy(hostMeasures, measures, numProbes*4*sizeof(float), cudaMemcpyDeviceToHost) );
+	}
+
 }// extern "C"
 
@@ -19,10 +19,23 @@ extern "C"
 		float currentWaveHeight,
 		uint nemParticles);
 	
+	// wraps particles in x and appends ghost copies after numParticles,
+	// returns the number of ghosts, at most maxGhostParticles; images past
+	// the capacity are not written and counted in numDropped
+	uint refreshGhosts(
+		float* pos,
+		float* vel,
+		uint*  ghostSource,
+		uint*  ghostCount,
+		uint   numParticles,
+		uint   maxGhostParticles,
+		uint*  numDropped);
+
 	void calculatePeristalsisHash(
 		uint*  gridParticleHash,
 		uint*  gridParticleIndex,
 		float* pos, 
+		uint   numRealParticles,
 		int    numParticles);
 
 	void sortParticles(
@@ -35,6 +48,7 @@ extern "C"
 		uint*  cellEnd,
 		float* sortedPos,
 		float* sortedVel,
+		uint*  gridParticleRank,
 		uint*  gridParticleHash,
 		uint*  gridParticleIndex,
 		float* oldPos,
@@ -42,6 +56,8 @@ extern "C"
 		uint   numParticles,
 		uint   numGridCells);
 
+	// fluid particles occupy the head of particle and sorted arrays, cellStart/cellEnd
+	// hold 2 * numGridCells entries (fluid, then wall ranges)
 	void computeDensityVariation(			
 		float* measures,
 		float* measuresInput,
@@ -52,45 +68,84 @@ extern "C"
 		uint numParticles,
 		uint numGridCells);
 
-	void computeViscousForce(	
-		float* viscousForce,					
+	void copyGhostMeasures(
 		float* measures,
-		float* sortedPos,			
-		float* sortedVel,
-		uint* gridParticleIndex,
-		uint* cellStart,
-		uint* cellEnd,
-		uint numParticles,
-		float elapsedTime,
-		uint numGridCells);	
+		uint*  ghostSource,
+		uint*  gridParticleRank,
+		uint   numRealParticles,
+		uint   numGhostParticles);
 
-	void computePressureForce(	
-		float* pressureForce,					
+	// pressure and viscous forces in one pass; force gets the sum,
+	// pressureForce/viscousForce are written only when not null
+	void computeForce(	
+		float* force,
+		float* pressureForce,
+		float* viscousForce,
 		float* measures,
-		float* sortedPos,					
+		float* sortedPos,			
+		float* sortedVel,
 		uint* gridParticleIndex,
 		uint* cellStart,
 		uint* cellEnd,
 		uint numParticles,
+		uint numFluidParticles,
 		float elapsedTime,
 		uint numGridCells);	
 
-	void predictCoordinates(
-		float* predictedPosition,
-		float* predictedVelocity,
+	// velocity Verlet halves around the force pass
+	void kickDrift(
 		float* pos,
 		float* vel,  
-		float* viscousForce,
-		float* pressureForce,
-		uint numParticles);
+		float* predictedVelocity,
+		float* force,
+		uint numFluidParticles);
+
+	void kick(
+		float* vel,  
+		float* velLeapFrog,
+		float* force,
+		uint numFluidParticles);
 
 	void computeCoordinates(
 		float* pos,
 		float* vel,  
 		float* velLeapFrog,
-		float* viscousForce,
-		float* pressureForce,
+		float* force,
 		float elapsedTime,
+		uint numFluidParticles);
+
+	void dampVelocity(
+		float* vel,
+		float* velLeapFrog,
+		float factor,
+		uint numFluidParticles);
+
+	void shiftVelocity(
+		float* vel,
+		float shift,
 		uint numParticles);
+
+	void moveBoundary(
+		float* boundaryPos,
+		float elapsedTime,
+		uint numBoundaryParticles);
+
+	// SPH averages at probe points from the sorted arrays, copied to
+	// hostVelocity/hostMeasures, see Common/sph_probes.h
+	void samplePeristalsisProbes(
+		float* hostVelocity,
+		float* hostMeasures,
+		float* velocity,
+		float* measures,
+		float* probes,
+		uint   numProbes,
+		float* sortedPos,
+		float* sortedVel,
+		float* sortedMeasures,
+		uint*  cellStart,
+		uint*  cellEnd,
+		int    cellcount,
+		float  smoothingRadius,
+		float  particleMass);
 }//extern "C"
 #endif //PERISTALSIS_SYSTEM_CUH_
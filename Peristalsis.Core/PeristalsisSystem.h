@@ -3,6 +3,7 @@
 
 #include "peristalsisKernel.cuh"
 #include "vector_functions.h"
+class StopWatchInterface;
 class PeristalsisSystem
 {
 public:
@@ -28,6 +29,20 @@ public:
 		VISCOUSFORCE,
 		PRESSUREFORCE,
 		VELOCITYLEAPFROG,
+		PREDICTEDVELOCITY,
+		FORCE,
+	};
+
+	enum StartupMode
+	{
+		RAMP_STARTUP, // slow wall ramp, 1000 relaxation steps
+		FAST_STARTUP, // short ramp and relaxation with damped fluid velocities
+	};
+
+	enum Integrator
+	{
+		EXPLICIT_EULER,
+		VELOCITY_VERLET, // kick-drift-kick, one force pass per step
 	};
 
 	void Update();	
@@ -39,6 +54,7 @@ public:
 	void   setArray(ParticleArray array, const float* data, int start, int count);
 
 	int getNumParticles() const { return numParticles; }
+	uint getNumDroppedGhosts() const { return numDroppedGhosts; }
 	float GetElapsedTime() const { return elapsedTime; }
 	float getHalfWorldXSize() {return cfg.gridSize.x * cfg.radius;}
 	float getHalfWorldYSize() {return cfg.gridSize.y * cfg.radius;}
@@ -47,6 +63,32 @@ public:
 	unsigned int getCurrentReadBuffer() const { return posVbo; }
 	unsigned int getColorBuffer()       const { return colorVBO; }
 	void SwitchBoundarySetup();
+	// keeps pressure and viscous parts in viscous_force()/pressure_force(), off by default
+	void SetForceDiagnostics(bool enabled) { IsForceDiagnostics = enabled; }
+	void SetIntegrator(Integrator value) { integrator = value; IsForceCurrent = false; }
+	Integrator GetIntegrator() const { return integrator; }
+
+	// wave frame: walls stay where the start-up phase leaves them and the
+	// fluid moves with -wave_speed; set before Reset()
+	void SetWaveFrame(bool enabled) { IsWaveFrame = enabled; }
+	bool GetWaveFrame() const { return IsWaveFrame; }
+	// host copies of positions/velocities from the simulation frame to the lab frame
+	void ToLabFrame(float4* positions, float4* velocities, uint count) const;
+	// host positions from the lab frame back to the simulation frame, for probes
+	void ToSimulationFrame(float4* positions, uint count) const;
+
+	// SPH averages at numProbes points (x, y, z, unused) from the sorted arrays
+	// of the last Update(), in the simulation frame: velocity with the kernel
+	// coverage in w, density and pressure in measures x, y; host arrays of
+	// float4, see Common/sph_probes.h
+	void SampleProbes(const float* probes, uint numProbes, float* velocity, float* measures);
+
+	// set before Reset()
+	void SetStartupMode(StartupMode mode) { startup = mode; }
+	// steps and wall-clock seconds spent before walls start to move (0 while still configuring)
+	bool IsStartup() const { return cfg.IsBoundaryConfiguration; }
+	uint GetStartupSteps() const { return startupSteps; }
+	float GetStartupTime() const { return startupSeconds; }
 	//void startBoundaryMotion();
 
 	void * getCudaPosVBO()              const { return (void *)cudaPosVBO; }
@@ -78,11 +120,18 @@ protected:
 
 	void initFluid(float spacing, float jitter, uint numParticles);
 	float CalculateMass(float* positions, uint3 gridSize);
+	void StartWaveFrame();
+	float WaveFrameShift() const;
+	void computeSphForces(float* dPos, float* sphVel);
 	void initBoundaryParticles(float spacing);
 
 protected:
 	bool IsInitialized, IsOpenGL;
 	uint numParticles;
+	uint numFluidParticles;   // fluid particles come first in particle and sorted arrays
+	uint numGhostParticles;   // periodic images, stored after the real particles
+	uint maxGhostParticles;
+	uint numDroppedGhosts;    // images past maxGhostParticles in the last step, missing from the neighbour search
 	float currentWaveHeight;	
 	float elapsedTime;
 	float time_shift;
@@ -105,14 +154,30 @@ protected:
 	float* dMeasures;
 	float* viscousForce;	
 	float* pressureForce;
+	float* dForce;         // pressure + viscous, used by integration
+	bool IsForceDiagnostics;
+	Integrator integrator;
+	bool IsForceCurrent;   // dForce belongs to the current positions
+	bool IsWaveFrame;
+	StartupMode startup;
+	uint startupSteps;
+	float startupSeconds;
+	StopWatchInterface* startupTimer; // wall clock, from Reset() to the first moving wall step
 
 	float* dSortedPos;
 	float* dSortedVel;
+	float* dProbes;           // probe points and their samples, grown on demand
+	float* dProbeVelocity;
+	float* dProbeMeasures;
+	uint   maxProbes;
 	
 	uint*  dHash; 
 	uint*  dIndex;
 	uint*  dCellStart;
 	uint*  dCellEnd; 
+	uint*  dRank;        // sorted position for each particle
+	uint*  dGhostSource; // real particle for each ghost
+	uint*  dGhostCount;
 
 	uint   gridSortBits;
 
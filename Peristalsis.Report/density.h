@@ -57,6 +57,8 @@ void density_avg(){
 		
 		float temp = 0.0f;
 		for(int i = 0; i < numParticles; i++){
+			if(h_index[i] >= numParticles)
+				continue;//periodic ghost
 			float type = h_position[h_index[i]].w;
 			if(type == 0)
 				temp += h_density[i].x;
@@ -34,6 +34,7 @@ void forces_avg(){
 		false);	
 
 	uint numParticles = psystem->getNumParticles();		
+	psystem->SetForceDiagnostics(true);
 	psystem->Reset();					
 	
 	host_vector<float4> h_pressure(numParticles);
@@ -66,6 +67,8 @@ void forces_avg(){
 		float avg_visc_x = 0.0f;
 		float avg_visc_y = 0.0f;
 		for(int i = 0; i < numParticles; i++){
+			if(h_index[i] >= numParticles)
+				continue;//periodic ghost
 			float type = h_position[h_index[i]].w;
 			if(type == 0){
 				avg_pres_x += h_pressure[i].x;
@@ -0,0 +1,150 @@
+#include <thrust/device_ptr.h>
+#include <thrust/device_vector.h>
+#include <vector_types.h>
+#include <vector_functions.h>
+#include <fstream>
+#include <iostream>
+#include <math.h>
+#include "peristalsisSystem.cuh"
+#include "peristalsisSystem.h"
+#include "util.h"
+#include "../Common/helper_timer.h"
+using namespace std;
+using namespace thrust;
+
+struct IntegratorRun {
+	uint steps;	//moving wall steps
+	float seconds;	//wall clock seconds of the moving wall steps
+	float avgDensity;	//density_avg() measure at the end of the run
+	host_vector<float4> velocity;	//velocity_filed() measure at the end of the run
+};
+
+// same case as velocity_filed() and density_avg(), run through the start-up
+// and then pumpTime of moving walls: the start-up relaxes a fixed number of
+// steps, so it ends later for longer steps, and runs are compared at equal
+// time after the walls start to move
+IntegratorRun run_integrator(PeristalsisSystem::Integrator integrator, float deltaTime, float pumpTime){
+	int boundary_offset = 3;
+	uint3 gridSize = make_uint3(256, 128, 4);
+	uint3 fluid_size = make_uint3(256, 64 -  2 * boundary_offset, 1);
+	float soundspeed = powf(10.0f, -4.0f);
+	float radius = 1.0f / (2 * (64 - 6) * 1000);
+	float3 gravity = make_float3(0,0,0);
+	float amplitude = 0.6 * 35 * radius;
+	float wave_speed = 100 * soundspeed;
+	PeristalsisSystem* psystem = new PeristalsisSystem(
+		deltaTime,
+		fluid_size,
+		amplitude,
+		wave_speed,
+		soundspeed,
+		gravity,
+		boundary_offset,
+		gridSize,
+		radius,
+		false);
+	psystem->SetIntegrator(integrator);
+	psystem->Reset();
+
+	while(psystem->IsStartup())
+		psystem->Update();
+
+	IntegratorRun run;
+	run.steps = 0;
+	float pumpStart = psystem->GetElapsedTime();
+	StopWatchInterface* timer = 0;
+	sdkCreateTimer(&timer);
+	cudaThreadSynchronize();
+	sdkStartTimer(&timer);
+	while(psystem->GetElapsedTime() - pumpStart < pumpTime){
+		psystem->Update();
+		run.steps++;
+	}
+	cudaThreadSynchronize();
+	run.seconds = sdkGetTimerValue(&timer) / 1000.0f;
+	sdkDeleteTimer(&timer);
+
+	uint numParticles = psystem->getNumParticles();
+	uint numFluid = fluid_size.x * fluid_size.y;
+	host_vector<uint> h_index(numParticles);
+	host_vector<float4> h_density(numParticles);
+	host_vector<float4> h_position(numParticles);
+	device_ptr<uint> index((uint*)psystem->getCudaIndex());
+	device_ptr<float4> density((float4*)psystem->getMeasures());
+	device_ptr<float4> position((float4*)psystem->getCudaPosVBO());
+	device_ptr<float4> velocity((float4*)psystem->getCudaVelVBO());
+	thrust::copy(index, index + numParticles, h_index.begin());
+	thrust::copy(density, density + numParticles, h_density.begin());
+	thrust::copy(position, position + numParticles, h_position.begin());
+	run.velocity.resize(numFluid);
+	thrust::copy(velocity, velocity + numFluid, run.velocity.begin());
+
+	float temp = 0.0f;
+	for(int i = 0; i < numParticles; i++){
+		if(h_index[i] >= numParticles)
+			continue;//periodic ghost
+		if(h_position[h_index[i]].w == 0)
+			temp += h_density[i].x;
+	}
+	run.avgDensity = temp / numFluid;
+
+	delete psystem;
+	return run;
+}
+
+// relative rms difference of the fluid velocity field, NaN marks a blown up run
+float velocity_difference(const host_vector<float4>& reference, const host_vector<float4>& candidate){
+	double diff = 0.0, norm = 0.0;
+	for(uint i = 0; i < reference.size(); i++){
+		float dx = candidate[i].x - reference[i].x;
+		float dy = candidate[i].y - reference[i].y;
+		diff += dx * dx + dy * dy;
+		norm += reference[i].x * reference[i].x + reference[i].y * reference[i].y;
+	}
+	return (float)sqrt(diff / norm);
+}
+
+// a run within this relative velocity difference of the reference counts as stable
+const float IntegratorStableDifference = 0.1f;
+
+// explicit Euler at 1e-4 is the reference; both integrators are run at
+// 1, 2, 4 and 8 times that step and compared with it after the same time
+// of moving walls, the largest stable step of each integrator is reported
+// as its dt limit
+void integrator_benchmark(){
+	float baseTime = powf(10.0f, -4.0f);
+	float pumpTime = 0.05f;
+	IntegratorRun reference = run_integrator(PeristalsisSystem::EXPLICIT_EULER, baseTime, pumpTime);
+
+	ofstream fp1;
+	string name = "integrator_benchmark.dat";
+	backup(name);
+	fp1.open(name.c_str());
+	fp1 << "integrator dt steps seconds avg_density velocity_rms_diff" << endl;
+
+	const char* names[2] = {"euler", "verlet"};
+	PeristalsisSystem::Integrator integrators[2] = {
+		PeristalsisSystem::EXPLICIT_EULER,
+		PeristalsisSystem::VELOCITY_VERLET};
+	float limits[2] = {0.0f, 0.0f};
+	for(int k = 0; k < 2; k++){
+		for(int factor = 1; factor <= 8; factor *= 2){
+			IntegratorRun run = (k == 0 && factor == 1) ? reference :
+				run_integrator(integrators[k], factor * baseTime, pumpTime);
+			float diff = velocity_difference(reference.velocity, run.velocity);
+			fp1 << names[k] << " " << factor * baseTime << " " << run.steps << " "
+				<< run.seconds << " " << run.avgDensity << " " << diff << endl;
+			cout << names[k] << " dt=" << factor * baseTime << " steps=" << run.steps
+				<< " time=" << run.seconds << "s density=" << run.avgDensity
+				<< " velocity diff=" << diff << endl;
+			//NaN compares false, a blown up run is never stable
+			if (diff < IntegratorStableDifference && limits[k] == factor / 2 * baseTime)
+				limits[k] = factor * baseTime;
+		}
+	}
+	for(int k = 0; k < 2; k++){
+		fp1 << "# " << names[k] << " dt limit " << limits[k] << endl;
+		cout << names[k] << " dt limit=" << limits[k] << endl;
+	}
+	fp1.close();
+}
@@ -2,7 +2,11 @@
 #include "forces.h"
 #include "poiseuille_velocity_profile.h"
 #include "velocityfield.h"
+#include "integrator_benchmark.h"
+#include "startup_benchmark.h"
 #include <iostream>
 void main(){			
 	velocity_filed();
+	integrator_benchmark();
+	startup_benchmark();
 }
\ No newline at end of file
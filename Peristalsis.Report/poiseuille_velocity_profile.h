@@ -7,6 +7,7 @@
 #include <stack>
 #include "peristalsissystem.cuh"
 #include "peristalsissystem.h"
+#include "../Common/sph_probes.h"
 typedef unsigned int uint;
 using namespace std;
 
@@ -47,20 +48,21 @@ void poiseuille_velocity_profile()
 		while(psystem->GetElapsedTime() < timeSlice)
 			psystem->Update();	
 
-		thrust::device_ptr<float4> d_positions((float4*)psystem->getCudaPosVBO());	
-		thrust::device_ptr<uint> d_index((uint*)psystem->getCudaIndex());	
-		thrust::device_ptr<float4> d_velocity((float4*)psystem->getLeapFrogVelocity());	
-
-		thrust::host_vector<float4> positions(psystem->getNumParticles());
-		thrust::host_vector<uint> index(psystem->getNumParticles());
-		thrust::host_vector<float4> velocity(psystem->getNumParticles());
-
-		thrust::copy(d_positions, d_positions + psystem->getNumParticles(), positions.begin());		
-		thrust::copy(d_index, d_index + psystem->getNumParticles(), index.begin());		
-		thrust::copy(d_velocity, d_velocity + psystem->getNumParticles(), velocity.begin());		
-
-		int cx = 0;
-		int tt = 0;
+		//one probe per fluid row across the channel at lab frame x = radius
+		uint rows = fluid_size.y;
+		float3 origin = psystem->getWorldOrigin();
+		float bottom = origin.y + 2 * psystem -> getradius() * boundaryOffset;
+		thrust::host_vector<float4> probes(rows);
+		thrust::host_vector<float4> velocity(rows);
+		thrust::host_vector<float4> measures(rows);
+		sph::lineProbes(&probes[0],
+			make_float3(radius, bottom + radius, origin.z + radius),
+			make_float3(radius, bottom + (2 * rows - 1) * radius, origin.z + radius),
+			rows);
+		thrust::host_vector<float4> simulationProbes(probes);
+		psystem->ToSimulationFrame(&simulationProbes[0], rows);
+		psystem->SampleProbes((float*)&simulationProbes[0], rows, (float*)&velocity[0], (float*)&measures[0]);
+		psystem->ToLabFrame(0, &velocity[0], rows);
 
 		ostringstream buffer;	
 		buffer << timeSlice;
@@ -69,26 +71,8 @@ void poiseuille_velocity_profile()
 		fp1.open(str.c_str());
 		fp1 << 0.0f << " " << 0.0f << endl;
 
-		for(int i = 0; i < psystem->getNumParticles(); i++){		
-			float posx = positions[index[i]].x;		
-			float posy = positions[index[i]].y;	
-			float bottom = psystem->getWorldOrigin().y +
-				2 * psystem -> getradius() * boundaryOffset;
-			if((posx > 0) 
-				&& (posx <  2 * psystem -> getradius())
-				&& (posy > bottom)
-				&& (posy < bottom + fluid_size.y * 2.0f * radius)
-				)
-			{							
-				fp1 << velocity[index[i]].x << " "
-					<< positions[index[i]].y
-					- psystem->getWorldOrigin().y
-					- boundaryOffset * 2 *psystem -> getradius()
-					<< endl;
-				tt++;
-			}
-			cx++;
-		}
+		for(uint i = 0; i < rows; i++)
+			fp1 << velocity[i].x << " " << probes[i].y - bottom << endl;
 		fp1 << 0.0f << " " << pow(10.0f, -3) << endl;
 		fp1.close();
 	}	
@@ -0,0 +1,83 @@
+#include <thrust/device_ptr.h>
+#include <thrust/device_vector.h>
+#include <vector_types.h>
+#include <vector_functions.h>
+#include <fstream>
+#include <iostream>
+#include <math.h>
+#include "peristalsisSystem.cuh"
+#include "peristalsisSystem.h"
+#include "util.h"
+using namespace std;
+using namespace thrust;
+
+// runs the velocity_filed() case up to the first step with moving walls and
+// reports the cost of getting there and the state of the fluid at that point
+void startup_benchmark(){
+	int boundary_offset = 3;
+	uint3 gridSize = make_uint3(256, 128, 4);
+	uint3 fluid_size = make_uint3(256, 64 -  2 * boundary_offset, 1);
+	float soundspeed = powf(10.0f, -4.0f);
+	float radius = 1.0f / (2 * (64 - 6) * 1000);
+	float3 gravity = make_float3(0,0,0);
+	float amplitude = 0.6 * 35 * radius;
+	float wave_speed = 100 * soundspeed;
+	float delaTime = powf(10.0f, -4.0f);
+	uint numFluid = fluid_size.x * fluid_size.y;
+
+	ofstream fp1;
+	string name = "startup_benchmark.dat";
+	backup(name);
+	fp1.open(name.c_str());
+	fp1 << "mode steps seconds avg_density max_speed" << endl;
+
+	const char* names[2] = {"ramp", "fast"};
+	PeristalsisSystem::StartupMode modes[2] = {
+		PeristalsisSystem::RAMP_STARTUP,
+		PeristalsisSystem::FAST_STARTUP};
+	for(int k = 0; k < 2; k++){
+		PeristalsisSystem* psystem = new PeristalsisSystem(
+			delaTime,
+			fluid_size,
+			amplitude,
+			wave_speed,
+			soundspeed,
+			gravity,
+			boundary_offset,
+			gridSize,
+			radius,
+			false);
+		psystem->SetStartupMode(modes[k]);
+		psystem->Reset();
+		while(psystem->IsStartup())
+			psystem->Update();
+
+		uint numParticles = psystem->getNumParticles();
+		host_vector<uint> h_index(numParticles);
+		host_vector<float4> h_density(numParticles);
+		host_vector<float4> h_velocity(numFluid);
+		device_ptr<uint> index((uint*)psystem->getCudaIndex());
+		device_ptr<float4> density((float4*)psystem->getMeasures());
+		device_ptr<float4> velocity((float4*)psystem->getCudaVelVBO());
+		thrust::copy(index, index + numParticles, h_index.begin());
+		thrust::copy(density, density + numParticles, h_density.begin());
+		thrust::copy(velocity, velocity + numFluid, h_velocity.begin());
+
+		//fluid occupies the head of both the particle and the sorted arrays
+		float avgDensity = 0.0f;
+		for(uint i = 0; i < numFluid; i++)
+			avgDensity += h_density[i].x;
+		avgDensity /= numFluid;
+		float maxSpeed = 0.0f;
+		for(uint i = 0; i < numFluid; i++)
+			maxSpeed = max(maxSpeed, sqrtf(h_velocity[i].x * h_velocity[i].x + h_velocity[i].y * h_velocity[i].y));
+
+		fp1 << names[k] << " " << psystem->GetStartupSteps() << " " << psystem->GetStartupTime() << " "
+			<< avgDensity << " " << maxSpeed << endl;
+		cout << names[k] << " startup: " << psystem->GetStartupSteps() << " steps, "
+			<< psystem->GetStartupTime() << "s, density " << avgDensity
+			<< ", max speed " << maxSpeed << endl;
+		delete psystem;
+	}
+	fp1.close();
+}
@@ -9,11 +9,12 @@
 #include <sstream>
 #include "peristalsisSystem.cuh"
 #include "peristalsisSystem.h"
+#include "../Common/sph_probes.h"
 
 using namespace std;
 using namespace thrust;
 
-void velocity_filed(){
+void velocity_filed(bool waveFrame = false){
 	int boundary_offset = 3;		
 	uint3 gridSize = make_uint3(256, 128, 4);   
 	uint3 fluid_size = make_uint3(256, 64 -  2 * boundary_offset, 1);	
@@ -36,9 +37,17 @@ void velocity_filed(){
 		radius,
 		false);					
 
-	uint numParticles = psystem->getNumParticles();		
+	psystem->SetWaveFrame(waveFrame);
 	psystem->Reset();		
 
+	//Eulerian grid, a node every second cell over the whole domain
+	uint3 nodes = make_uint3(gridSize.x / 2, gridSize.y / 2, 1);
+	uint numProbes = nodes.x * nodes.y;
+	float3 origin = psystem->getWorldOrigin();
+	thrust::host_vector<float4> probes(numProbes);
+	thrust::host_vector<float4> h_velocities(numProbes);
+	thrust::host_vector<float4> h_measures(numProbes);
+
 		
 	std::stack<float> timeFrames;				
 	timeFrames.push(0.4);
@@ -51,12 +60,12 @@ void velocity_filed(){
 		while(psystem->GetElapsedTime() < timeSlice)
 			psystem->Update();	
 
-		thrust::device_ptr<float4> dev_positions((float4*)psystem->getCudaPosVBO());	
-		thrust::device_ptr<float4> dev_velocities((float4*)psystem->getCudaVelVBO());	
-		thrust::host_vector<float4> h_positions(psystem->getNumParticles());
-		thrust::host_vector<float4> h_velocities(psystem->getNumParticles());
-		thrust::copy(dev_positions, dev_positions + psystem->getNumParticles(), h_positions.begin());		
-		thrust::copy(dev_velocities, dev_velocities + psystem->getNumParticles(), h_velocities.begin());
+		sph::gridProbes(&probes[0],
+			make_float3(origin.x + radius, origin.y + radius, origin.z + radius),
+			make_float3(4 * radius, 4 * radius, 4 * radius),
+			nodes);
+		psystem->SampleProbes((float*)&probes[0], numProbes, (float*)&h_velocities[0], (float*)&h_measures[0]);
+		psystem->ToLabFrame(&probes[0], &h_velocities[0], numProbes);
 
 
 		ostringstream buffer;	
@@ -68,9 +77,11 @@ void velocity_filed(){
 		/*std::string fileNameEnding = str(boost::format("%1%") % timeSlice);	
 		std::string fileName = str(boost::format("VectorField%1%") % fileNameEnding.replace(1,1,"x")); 
 		FILE *file= fopen(fileName.c_str(), "w");*/
-		for (int i = 0; i < h_positions.size(); i+=4){
-			float4 p = (float4)h_positions[i];
+		for (uint i = 0; i < numProbes; i++){
+			float4 p = (float4)probes[i];
 			float4 v = (float4)h_velocities[i];
+			if (v.w < 0.5f)
+				continue;//outside the fluid or next to the walls
 			
 			//fprintf(file, "%f %f %f %f \n", p.x, p.y -amplitude, v.x, v.y);
 			fp1 << p.x << " " << p.y << " "
@@ -3,6 +3,7 @@
 #include "helper_math.h"
 #include "math_constants.h"
 #include "poiseuilleFlowKernel.cuh"
+#include "../Common/sph_probes.h"
 
 #if USE_TEX
 texture<float4, 1, cudaReadModeElementType> oldPosTex;
@@ -23,17 +24,67 @@ __device__ int3 calcGridPos(float3 p){
 	return gridPos;
 }
 
+// x is not wrapped: columns left and right of the grid are ghost cells,
+// stored after the gridSize.x * gridSize.y * gridSize.z domain cells
 __device__ uint calcGridHash(int3 gridPos){
-	gridPos.x = gridPos.x & (params.gridSize.x-1);  
 	gridPos.y = gridPos.y & (params.gridSize.y-1);
 	gridPos.z = gridPos.z & (params.gridSize.z-1);        
-	return __umul24(__umul24(gridPos.z, params.gridSize.y), params.gridSize.x) + __umul24(gridPos.y, params.gridSize.x) + gridPos.x;
+	uint row = __umul24(gridPos.z, params.gridSize.y) + gridPos.y;
+	if (gridPos.x >= 0 && gridPos.x < params.gridSize.x)
+		return __umul24(row, params.gridSize.x) + gridPos.x;
+
+	uint numDomainCells = __umul24(__umul24(params.gridSize.z, params.gridSize.y), params.gridSize.x);
+	int ghostColumn = (gridPos.x < 0) ? 
+		gridPos.x + params.ghostCells :
+		gridPos.x - params.gridSize.x + params.ghostCells;
+	return numDomainCells + __umul24(row, 2 * params.ghostCells) + ghostColumn;
+}
+
+__device__ uint calcSortKey(uint gridHash, float type){
+	return (type == 1.0f) ? gridHash + params.numGridCells : gridHash;
+}
+
+// wraps particles into the periodic x range and writes their images for
+// the ghost columns after the real particles; runs once per step
+__global__ void refreshPoiseuilleGhostsD(
+	float4* pos,          // input, output; ghosts start at numParticles
+	float4* vel,          // input, output
+	uint*   ghostSource,  // output, real particle each ghost is copied from
+	uint*   ghostCount,   // output
+	uint    numParticles,
+	uint    maxGhostParticles){
+		uint index = __umul24(blockIdx.x, blockDim.x) + threadIdx.x;
+		if (index >= numParticles) return;
+
+		float4 p = pos[index];
+		float worldXSize = params.gridSize.x * 2.0f * params.particleRadius;
+		if (p.x >= params.worldOrigin.x + worldXSize)
+			p.x -= worldXSize;
+		if (p.x < params.worldOrigin.x)
+			p.x += worldXSize;
+		pos[index] = p;
+
+		int column = calcGridPos(make_float3(p)).x;
+		float shift;
+		if (column < params.ghostCells)
+			shift = worldXSize;
+		else if (column >= (int)params.gridSize.x - params.ghostCells)
+			shift = -worldXSize;
+		else
+			return;
+
+		uint slot = atomicAdd(ghostCount, 1);
+		if (slot >= maxGhostParticles) return;
+		pos[numParticles + slot] = make_float4(p.x + shift, p.y, p.z, p.w);
+		vel[numParticles + slot] = vel[index];
+		ghostSource[slot] = index;
 }
 
 __global__ void calculatePoiseuilleHashD(
 	uint*   gridParticleHash,  // output
 	uint*   gridParticleIndex, // output
 	float4* pos,               // input
+	uint    numRealParticles,  // ghosts follow the real particles
 	uint    numParticles){
 		uint index = __umul24(blockIdx.x, blockDim.x) + threadIdx.x;
 		if (index >= numParticles) return;
@@ -41,7 +92,15 @@ __global__ void calculatePoiseuilleHashD(
 		volatile float4 p = pos[index];
 
 		int3 gridPos = calcGridPos(make_float3(p.x, p.y, p.z));
-		uint hash = calcGridHash(gridPos);
+		// keep rounding at the periodic edge from moving particles across the domain border
+		int gx = params.gridSize.x;
+		if (index < numRealParticles)
+			gridPos.x = clamp(gridPos.x, 0, gx - 1);
+		else if (gridPos.x < gx / 2)
+			gridPos.x = clamp(gridPos.x, -params.ghostCells, -1);
+		else
+			gridPos.x = clamp(gridPos.x, gx, gx + params.ghostCells - 1);
+		uint hash = calcSortKey(calcGridHash(gridPos), p.w);
 
 		gridParticleHash[index] = hash;
 		gridParticleIndex[index] = index;
@@ -53,6 +112,7 @@ __global__ void reorderPoiseuilleDataD(
 	float4* sortedPos,        // output
 	float4* sortedVel,        // output
 	uint *  gridParticleHash, // input
+	uint*   gridParticleRank, // output, sorted position of each particle
 	uint *  gridParticleIndex,// input
 	float4* oldPos,           // input
 	float4* oldVel,           // input
@@ -88,6 +148,7 @@ __global__ void reorderPoiseuilleDataD(
 			}
 
 			uint sortedIndex = gridParticleIndex[index];
+			gridParticleRank[sortedIndex] = index;
 			float4 pos = FETCH(oldPos, sortedIndex);       
 			float4 vel = FETCH(oldVel, sortedIndex);       
 
@@ -97,16 +158,11 @@ __global__ void reorderPoiseuilleDataD(
 }
 
 __device__ float sumParticlesInDomain(
-	int3    gridPos,
-	uint    index,
+	uint    gridHash,
 	float4  pos,
 	float4* oldPos, 
-	float4  vel,
-	float4* oldVel,
-	float4* measures,
 	uint*   cellStart,
 	uint*   cellEnd){
-		uint gridHash = calcGridHash(gridPos);
 		uint startIndex = FETCH(cellStart, gridHash);
 
 		float sum = 0.0f;
@@ -114,24 +170,13 @@ __device__ float sumParticlesInDomain(
 			uint endIndex = FETCH(cellEnd, gridHash);
 			for(uint j=startIndex; j<endIndex; j++) {				  
 					float4 pos2 = FETCH(oldPos, j);
-					float4 vel2 = FETCH(oldVel, j);
-					float density2 = measures[j].x;
-					float temp = 0.0f;
-
-					float worldXSize= params.gridSize.x * 2.0f * params.particleRadius;				
 					float3 relPos = make_float3(pos - pos2);
-					if(gridPos.x < 0)
-						relPos = make_float3(pos.x - (pos2.x - worldXSize),pos.y - pos2.y,pos.z - pos2.z); 
-					else
-						if(gridPos.x > params.gridSize.x - 1)
-							relPos = make_float3(pos.x - (pos2.x + worldXSize),pos.y - pos2.y,pos.z - pos2.z);
 						
 					float dist = length(relPos);
 					float q = dist / params.smoothingRadius;					
 				
-					float coeff = 7.0f / 4 / CUDART_PI_F / powf(params.smoothingRadius, 2);
 					if(q < 2){
-						sum += coeff *(powf(1 - 0.5f * q, 4) * (2 * q + 1));	
+						sum += PoiseuilleKernel::coefficient(params.smoothingRadius) * PoiseuilleKernel::shape(q);	
 					}
 			}
 		}
@@ -149,38 +194,50 @@ __global__ void calculatePoiseuilleDensityD(
 		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
 		if (index >= numParticles) return;    
 
+		//launched for fluid particles only, boundary ones see calculatePoiseuilleBoundaryDensityD
 		float4 pos = FETCH(oldPos, index);
-		float4 vel = FETCH(oldVel, index);
-		if(pos.w == 1.0f){				
-				measures[index].x = params.restDensity;	
-				measures[index].y = powf(params.soundspeed, 2) * params.restDensity;
-				return;
-		}
 		int3 gridPos = calcGridPos(make_float3(pos));
 
 		float sum = 0.0f;		
 		for(int z=-params.cellcount; z<=params.cellcount; z++) {
 			for(int y=-params.cellcount; y<=params.cellcount; y++) {
 				for(int x=-params.cellcount; x<=params.cellcount; x++) {
-					int3 neighbourPos = gridPos + make_int3(x, y, z);
-					sum += sumParticlesInDomain(
-							neighbourPos,
-							index,
-							pos,
-							oldPos,
-							vel,
-							oldVel,
-							measures,
-							cellStart,
-							cellEnd);
+					uint gridHash = calcGridHash(gridPos + make_int3(x, y, z));
+					sum += sumParticlesInDomain(gridHash, pos, oldPos, cellStart, cellEnd);
+					sum += sumParticlesInDomain(gridHash + params.numGridCells, pos, oldPos, cellStart, cellEnd);
 				}
 			}
 		}			
 		float dens = sum * params.particleMass;
 		measures[index].x = dens;	
-		measures[index].y = powf(params.soundspeed, 2) * dens; 			
+		measures[index].y = PoiseuilleEos::pressure(dens, params.soundspeed * params.soundspeed); 			
+}
+
+__global__ void calculatePoiseuilleBoundaryDensityD(
+	float4* measures, //output, boundary part of sorted list
+	uint numBoundaryParticles){
+		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numBoundaryParticles) return;
+
+		measures[index].x = params.restDensity;	
+		measures[index].y = PoiseuilleEos::pressure(params.restDensity, params.soundspeed * params.soundspeed);
+}
+
+// ghosts take density and pressure of the particle they were copied from
+__global__ void copyPoiseuilleGhostMeasuresD(
+	float4* measures,         // input, output, sorted order
+	uint*   ghostSource,      // input
+	uint*   gridParticleRank, // input
+	uint    numRealParticles,
+	uint    numGhostParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numGhostParticles) return;
+
+		measures[gridParticleRank[numRealParticles + index]] = 
+			measures[gridParticleRank[ghostSource[index]]];
 }
 
+// velocity difference against a boundary particle
 __device__ float4 getVelocityDiff(
 	float4 iVelocity, 
 	float4 iPosition, 
@@ -189,7 +246,7 @@ __device__ float4 getVelocityDiff(
 {
 	float bottomBoundary = params.worldOrigin.y + params.boundaryOffset * 2.0f * params.particleRadius;	
 	float topBoundary = bottomBoundary + params.fluidParticlesSize.y * 2.0f * params.particleRadius;		
-	if((jPosition.w == 1.0f) && (jPosition.y > topBoundary))
+	if(jPosition.y > topBoundary)
 	{
 		float distanceA = topBoundary - iPosition.y;
 		float distanceB = jPosition.y - topBoundary;
@@ -197,7 +254,7 @@ __device__ float4 getVelocityDiff(
 		return beta * iVelocity;
 	}
 	
-	if((jPosition.w == 1.0f) && (jPosition.y < bottomBoundary))
+	if(jPosition.y < bottomBoundary)
 	{
 		float distanceA = iPosition.y - bottomBoundary;
 		float distanceB = bottomBoundary - jPosition.y;
@@ -207,8 +264,11 @@ __device__ float4 getVelocityDiff(
 	return iVelocity - jVelocity;
 }
 
+// isBoundary selects the boundary range of the cell; call sites pass constants,
+// so the velocity difference choice is resolved at compile time
 __device__ float3 sumNavierStokesForces(
-	int3    gridPos,
+	uint    gridHash,
+	bool    isBoundary,
 	uint    index,
 	float4  pos,
 	float4* oldPos, 
@@ -219,12 +279,9 @@ __device__ float3 sumNavierStokesForces(
 	float4* oldMeasures,
 	uint*   cellStart,
 	uint*   cellEnd){
-		uint gridHash = calcGridHash(gridPos);
 		uint startIndex = FETCH(cellStart, gridHash);
 	    
 		float3 tmpForce = make_float3(0.0f);
-		float texp = 0.0f;
-		float pexp = 0.0f;
 		if (startIndex != 0xffffffff) {               
 			uint endIndex = FETCH(cellEnd, gridHash);
 			for(uint j=startIndex; j<endIndex; j++) {
@@ -234,27 +291,19 @@ __device__ float3 sumNavierStokesForces(
 					float4 measure = FETCH(oldMeasures, j);
 					float density2 = measure.x;
 					float pressure2 = measure.y;				
-					float tempExpr = 0.0f;
 
-					float worldXSize= params.gridSize.x * 2.0f * params.particleRadius;				
 					float3 relPos = make_float3(pos - pos2);
-					if(gridPos.x < 0)
-						relPos = make_float3(pos) - make_float3(pos2.x - worldXSize, pos2.y, pos2.z); 
-					else
-						if(gridPos.x > params.gridSize.x - 1)
-							relPos = make_float3(pos) - make_float3(pos2.x + worldXSize, pos2.y, pos2.z); 
 										
 					float dist = length(relPos);
 					float q = dist / params.smoothingRadius;									
 
-					float coeff = 7.0f / 2 / CUDART_PI_F / powf(params.smoothingRadius, 3);
 					float temp = 0.0f;
-					float4 Vab = getVelocityDiff(vel, pos, vel2, pos2);
+					float4 Vab = isBoundary ? getVelocityDiff(vel, pos, vel2, pos2) : vel - vel2;
 					if(q < 2){
-						temp = coeff * (-powf(1 - 0.5f * q,3) * (2 * q + 1) +powf(1 - 0.5f * q, 4));
+						temp = PoiseuilleKernel::gradientCoefficient(params.smoothingRadius) * PoiseuilleKernel::shapeDerivative(q);
 						tmpForce += -1.0f * params.particleMass *
-							(pressure / powf(density,2) + pressure2 / powf(density2,2)) * 
-							normalize(relPos) * temp +
+							(pressure / (density * density) + pressure2 / (density2 * density2)) * 
+							relPos * (temp / dist) +
 							params.particleMass * (params.mu + params.mu) * 
 							make_float3(Vab) / (density * density2) * 1.0f / dist * temp;
 					}
@@ -276,6 +325,7 @@ __global__ void calculatePoiseuilleAccelerationD(
 		uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
 		if (index >= numParticles) return;    
 
+		//launched for fluid particles only, they occupy the head of the sorted list
 		float4 pos = FETCH(oldPos, index);
 		float4 vel = FETCH(oldVel, index);
 		float4 measure = FETCH(oldMeasures,index);
@@ -288,8 +338,21 @@ __global__ void calculatePoiseuilleAccelerationD(
 		for(int z=-params.cellcount; z<=params.cellcount; z++) {
 			for(int y=-params.cellcount; y<=params.cellcount; y++) {
 				for(int x=-params.cellcount; x<=params.cellcount; x++) {
-					int3 neighbourPos = gridPos + make_int3(x, y, z);
-					force += sumNavierStokesForces(neighbourPos, 
+					uint gridHash = calcGridHash(gridPos + make_int3(x, y, z));
+					force += sumNavierStokesForces(gridHash,
+						false,
+						index, 
+						pos, 
+						oldPos,
+						vel,
+						oldVel,
+						density,
+						pressure,					
+						oldMeasures,
+						cellStart, 
+						cellEnd);
+					force += sumNavierStokesForces(gridHash + params.numGridCells,
+						true,
 						index, 
 						pos, 
 						oldPos,
@@ -317,9 +380,8 @@ __global__ void integratePoiseuilleSystemD(
 		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
 		if (index >= numParticles) return;          
 
+		//fluid particles only, boundary ones follow them in particle arrays
 		volatile float4 posData = posArray[index]; 
-		if(posData.w == 1.0f) return;//skip boundary particle
-
 		volatile float4 velData = velArray[index];
 		volatile float4 accData = acceleration[index];
 		volatile float4 velLeapFrogData = velLeapFrogArray[index];
@@ -335,14 +397,129 @@ __global__ void integratePoiseuilleSystemD(
 
 		vel = nextVel;   	
 		pos += vel * params.deltaTime;   
+		  
+		posArray[index] = make_float4(pos, posData.w);
+		velArray[index] = make_float4(vel, velData.w);
+		velLeapFrogArray[index] = make_float4(velLeapFrog, velLeapFrogData.w);
+}
 
-		float halfWorldXSize = params.gridSize.x * params.particleRadius;			
+// particle type of an open channel particle that left through the outlet,
+// removed by the compaction after the step
+#define DELETED_PARTICLE -1.0f
 
-		if(pos.x > halfWorldXSize){
-			pos.x -= 2 * halfWorldXSize;
+__device__ float inflowVelocity(float y){
+	float bottomBoundary = params.worldOrigin.y + params.boundaryOffset * 2.0f * params.particleRadius;
+	float height = params.fluidParticlesSize.y * 2.0f * params.particleRadius;
+	float d = clamp(y - bottomBoundary, 0.0f, height);
+	return params.gravity.x * params.restDensity / (2.0f * params.mu) * d * (height - d);
+}
+
+// open channel: inlet buffer particles move with the inflow profile and each
+// one leaving the buffer is replaced one buffer width upstream, after numParticles;
+// outlet buffer particles keep their velocity and are deleted past the domain
+__global__ void integrateOpenPoiseuilleD(
+	float4* posArray,		  // input, output
+	float4* velArray,		  // input, output
+	float4* velLeapFrogArray, // output
+	float4* acceleration,	  // input
+	uint*   openCounts,       // output: inserted, deleted
+	uint    numFluidParticles,
+	uint    numParticles,     // real particles, inserted ones follow
+	uint    maxInsertParticles){
+		uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (index >= numFluidParticles) return;
+
+		float4 posData = posArray[index];
+		float4 velData = velArray[index];
+		float4 velLeapFrogData = velLeapFrogArray[index];
+		float3 pos = make_float3(posData);
+		float3 vel = make_float3(velData);
+		float3 velLeapFrog;
+
+		float worldXSize = params.gridSize.x * 2.0f * params.particleRadius;
+		float inletEnd = params.worldOrigin.x + params.bufferWidth;
+		float outletStart = params.worldOrigin.x + worldXSize - params.bufferWidth;
+		if (pos.x < inletEnd) {
+			vel = make_float3(inflowVelocity(pos.y), 0.0f, 0.0f);
+			velLeapFrog = vel;
+			pos += vel * params.deltaTime;
+			if (pos.x >= inletEnd) {
+				uint slot = atomicAdd(&openCounts[0], 1);
+				if (slot < maxInsertParticles) {
+					uint k = numParticles + slot;
+					posArray[k] = make_float4(pos.x - params.bufferWidth, pos.y, pos.z, posData.w);
+					velArray[k] = make_float4(vel, velData.w);
+					velLeapFrogArray[k] = make_float4(vel, velLeapFrogData.w);
+				}
+			}
+		} else {
+			float3 nextVel = vel;
+			if (pos.x < outletStart)
+				nextVel += (params.gravity + make_float3(acceleration[index])) * params.deltaTime;
+			velLeapFrog = 0.5f * (vel + nextVel);
+			vel = nextVel;
+			pos += vel * params.deltaTime;
 		}
-		  
-		posArray[index] = make_float4(pos, posData.w);
+
+		float type = posData.w;
+		if (pos.x >= params.worldOrigin.x + worldXSize) {
+			type = DELETED_PARTICLE;
+			atomicAdd(&openCounts[1], 1);
+		}
+		posArray[index] = make_float4(pos, type);
 		velArray[index] = make_float4(vel, velData.w);
 		velLeapFrogArray[index] = make_float4(velLeapFrog, velLeapFrogData.w);
 }
+
+struct isDeletedParticle {
+	template <typename Tuple>
+	__host__ __device__ bool operator()(const Tuple& t) const {
+		return thrust::get<0>(t).w == DELETED_PARTICLE;
+	}
+};
+
+struct isFluidParticle {
+	template <typename Tuple>
+	__host__ __device__ bool operator()(const Tuple& t) const {
+		return thrust::get<0>(t).w != 1.0f;
+	}
+};
+
+// mean x velocity of the fluid in each grid row, one thread per row;
+// reads the sorted velocities of the current step, ghost columns are skipped
+__global__ void binPoiseuilleProfileD(
+	float*  profile,   // output, gridSize.y entries
+	float4* sortedVel, // input
+	uint*   cellStart, // input
+	uint*   cellEnd){  // input
+		uint y = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+		if (y >= params.gridSize.y) return;
+
+		float sum = 0.0f;
+		uint count = 0;
+		for(uint z = 0; z < params.gridSize.z; z++){
+			uint row = __umul24(z, params.gridSize.y) + y;
+			for(uint x = 0; x < params.gridSize.x; x++){
+				uint hash = __umul24(row, params.gridSize.x) + x;
+				uint start = cellStart[hash];
+				if (start == 0xffffffff)
+					continue;
+				uint end = cellEnd[hash];
+				for(uint j = start; j < end; j++)
+					sum += sortedVel[j].x;
+				count += end - start;
+			}
+		}
+		profile[y] = (count > 0) ? sum / count : 0.0f;
+}
+
+// probe walk on this grid, see Common/sph_probes.h
+struct PoiseuilleProbeGrid {
+	__device__ int3 gridPos(float3 p) const { return calcGridPos(p); }
+	__device__ uint hash(int3 gridPos) const { return calcGridHash(gridPos); }
+	__device__ bool inside(int3 gridPos) const {
+		return gridPos.x >= 0 && gridPos.x < params.gridSize.x &&
+			gridPos.y >= 0 && gridPos.y < params.gridSize.y &&
+			gridPos.z >= 0 && gridPos.z < params.gridSize.z;
+	}
+};
@@ -1,6 +1,7 @@
 #ifndef __POISEUILLEFLOW_KERNEL_CUH__
 #define __POISEUILLEFLOW_KERNEL_CUH__
 #include "vector_types.h"
+#include "../Common/sph_kernels.h"
 #ifndef __DEVICE_EMULATION__
 #define USE_TEX 1
 #endif
@@ -13,8 +14,14 @@
 
 typedef unsigned int uint;
 
+// smoothing kernel and equation of state, see Common/sph_kernels.h
+typedef sph::WendlandC2<2> PoiseuilleKernel;
+typedef sph::Isothermal PoiseuilleEos;
+
 struct PoiseuilleParams {     
 	uint3 gridSize;
+	uint numGridCells; //boundary particles are stored after fluid ones, at hash + numGridCells
+	int ghostCells;    //periodic images in x, columns of ghost cells on each side of the grid
 	float3 worldOrigin;
 	float3 cellSize;
 	uint3 fluidParticlesSize;
@@ -32,5 +39,10 @@ struct PoiseuilleParams {
 	float mu;
 
 	int boundaryOffset;
+
+	//open inlet/outlet instead of periodic x: buffer zones of bufferWidth at
+	//both ends, the inlet one moves with the steady profile of the body force
+	int openBoundaries;
+	float bufferWidth;
 };
 #endif//__POISEUILLEFLOW_KERNEL_CUH__
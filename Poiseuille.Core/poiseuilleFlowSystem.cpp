@@ -26,16 +26,28 @@ PoiseuilleFlowSystem::PoiseuilleFlowSystem(
 	bool bUseOpenGL) :
 	IsInitialized(false),
 	IsOpenGL(bUseOpenGL),    	
+	IsConverged(false),
+	stepCount(0),
+	checkInterval(0),
+	checkTolerance(0.0f),
+	numChecks(0),
+	profileChange(-1.0f),
 	hPos(0),
 	hVel(0),
 	hMeasures(0),	
 	dPos(0),
 	dVel(0),
 	dMeasures(0),		
+	dProbes(0),
+	dProbeVelocity(0),
+	dProbeMeasures(0),
+	maxProbes(0),
 	elapsedTime(0.0f){		
 		numParticles = fluidParticlesSize.x * fluidParticlesSize.y * fluidParticlesSize.z +			
 			2 * gridSize.x * boundaryOffset;
-		numGridCells = gridSize.x * gridSize.y * gridSize.z;
+		numFluidParticles = fluidParticlesSize.x * fluidParticlesSize.y * fluidParticlesSize.z;
+		numWallParticles = 2 * gridSize.x * boundaryOffset;
+		maxInsertParticles = 0;
 		gridSortBits = 18;	//see radix sort for details
 		params.fluidParticlesSize = fluidParticlesSize;
 		params.gridSize = gridSize;	
@@ -49,6 +61,17 @@ PoiseuilleFlowSystem::PoiseuilleFlowSystem(
 		params.particleMass = 1000.0f /3381320880.551724;
 					
 		params.cellcount = 3;		
+
+		params.ghostCells = params.cellcount;
+		assert(2 * params.ghostCells <= gridSize.x);
+		numGridCells = (gridSize.x + 2 * params.ghostCells) * gridSize.y * gridSize.z;
+		params.numGridCells = numGridCells;
+		//each particle has at most one image, the margin covers uneven columns
+		numGhostParticles = 0;
+		numDroppedGhosts = 0;
+		maxGhostParticles = std::min(numParticles,
+			4 * params.ghostCells * numParticles / gridSize.x + gridSize.y);
+		maxParticles = numParticles + maxGhostParticles;
 	    			
 		params.worldOrigin = make_float3(-getHalfWorldXSize(), -getHalfWorldYSize(), -getHalfWorldZSize());
 		float cellSize = params.particleRadius * 2.0f;  
@@ -63,6 +86,8 @@ PoiseuilleFlowSystem::PoiseuilleFlowSystem(
 		params.mu = powf(10.0f, -3.0f);	
 
 		params.deltaTime = powf(10.0f, -4.0f);
+		params.openBoundaries = 0;
+		params.bufferWidth = params.ghostCells * cellSize;
 		_initialize(numParticles);
 }
 
@@ -122,28 +147,37 @@ void PoiseuilleFlowSystem::_initialize(int numParticles){
 	for(uint i = 0; i < numParticles; i++) //todo: check density approximation
 		hMeasures[4*i+0] = params.restDensity;
 
+	hProfile = new float[params.gridSize.y];
+	hPrevProfile = new float[params.gridSize.y];
+
 	unsigned int memSize = sizeof(float) * 4 * numParticles;
+	unsigned int sortedMemSize = sizeof(float) * 4 * maxParticles;
 
 	if (IsOpenGL) {
-		posVbo = createVBO(memSize);    
+		posVbo = createVBO(sortedMemSize);    
 	registerGLBufferObject(posVbo, &cuda_posvbo_resource);
 	} else {
-		checkCudaErrors( cudaMalloc( (void **)&cudaPosVBO, memSize )) ;
+		checkCudaErrors( cudaMalloc( (void **)&cudaPosVBO, sortedMemSize )) ;
 	}
 
-	allocateArray((void**)&dVel, memSize);
-	allocateArray((void**)&dVelLeapFrog, memSize);
-	allocateArray((void**)&dAcceleration, memSize);
-	allocateArray((void**)&dMeasures, memSize);
+	allocateArray((void**)&dVel, sortedMemSize);
+	allocateArray((void**)&dVelLeapFrog, sortedMemSize);
+	allocateArray((void**)&dAcceleration, sortedMemSize);
+	allocateArray((void**)&dMeasures, sortedMemSize);
 
-	allocateArray((void**)&dSortedPos, memSize);
-	allocateArray((void**)&dSortedVel, memSize);
+	allocateArray((void**)&dSortedPos, sortedMemSize);
+	allocateArray((void**)&dSortedVel, sortedMemSize);
+	allocateArray((void**)&dProfile, params.gridSize.y*sizeof(float));
 	
-	allocateArray((void**)&dHash, numParticles*sizeof(uint));
-	allocateArray((void**)&dIndex, numParticles*sizeof(uint));
+	allocateArray((void**)&dHash, maxParticles*sizeof(uint));
+	allocateArray((void**)&dIndex, maxParticles*sizeof(uint));
+	allocateArray((void**)&dRank, maxParticles*sizeof(uint));
+	allocateArray((void**)&dGhostSource, maxGhostParticles*sizeof(uint));
+	allocateArray((void**)&dGhostCount, sizeof(uint));
+	allocateArray((void**)&dOpenCounts, 2*sizeof(uint));
 
-	allocateArray((void**)&dCellStart, numGridCells*sizeof(uint));
-	allocateArray((void**)&dCellEnd, numGridCells*sizeof(uint));
+	allocateArray((void**)&dCellStart, 2*numGridCells*sizeof(uint));
+	allocateArray((void**)&dCellEnd, 2*numGridCells*sizeof(uint));
 
 	if (IsOpenGL) {
 		colorVBO = createVBO(numParticles*4*sizeof(float));
@@ -182,6 +216,8 @@ void PoiseuilleFlowSystem::_finalize(){
 	delete [] hVelLeapFrog;	
 	delete [] hMeasures;
 	delete [] hAcceleration;    
+	delete [] hProfile;
+	delete [] hPrevProfile;
 
 	freeArray(dVel);
 	freeArray(dVelLeapFrog);	
@@ -189,9 +225,20 @@ void PoiseuilleFlowSystem::_finalize(){
 	freeArray(dAcceleration);
 	freeArray(dSortedPos);
 	freeArray(dSortedVel);
+	freeArray(dProfile);
+	if (maxProbes > 0) {
+		freeArray(dProbes);
+		freeArray(dProbeVelocity);
+		freeArray(dProbeMeasures);
+		maxProbes = 0;
+	}
 
 	freeArray(dHash);
 	freeArray(dIndex);
+	freeArray(dRank);
+	freeArray(dGhostSource);
+	freeArray(dGhostCount);
+	freeArray(dOpenCounts);
 	freeArray(dCellStart);
 	freeArray(dCellEnd);
 
@@ -211,6 +258,8 @@ void PoiseuilleFlowSystem::changeGravity(){
 
 void PoiseuilleFlowSystem::update(){
 	assert(IsInitialized);
+	if (params.openBoundaries && numParticles + maxInsertParticles > maxParticles)
+		reserve(2 * (numParticles + maxInsertParticles));
 
 	float *dPos;
 
@@ -219,21 +268,37 @@ void PoiseuilleFlowSystem::update(){
 	else 
 		dPos = (float *) cudaPosVBO;    		
 	
-	calculatePoiseuilleHash(dHash, dIndex, dPos, numParticles);
-
-	sortParticles(dHash, dIndex, numParticles);
+	numDroppedGhosts = 0;
+	if (params.openBoundaries)
+		numGhostParticles = 0;
+	else
+		numGhostParticles = refreshPoiseuilleGhosts(
+			dPos,
+			dVelLeapFrog,
+			dGhostSource,
+			dGhostCount,
+			numParticles,
+			maxGhostParticles,
+			&numDroppedGhosts);
+	assert(numDroppedGhosts == 0);
+	uint numSortedParticles = numParticles + numGhostParticles;
+
+	calculatePoiseuilleHash(dHash, dIndex, dPos, numParticles, numSortedParticles);
+
+	sortParticles(dHash, dIndex, numSortedParticles);
 
 	reorderPoiseuilleData(
 		dCellStart,
 		dCellEnd,
 		dSortedPos,		
 		dSortedVel,
+		dRank,
 		dHash,
 		dIndex,
 		dPos,		
 		dVelLeapFrog,
-		numParticles,
-		numGridCells);
+		numSortedParticles,
+		2*numGridCells);
 	
 	calculatePoiseuilleDensity(		
 		dMeasures,
@@ -242,9 +307,17 @@ void PoiseuilleFlowSystem::update(){
 		dIndex,
 		dCellStart,
 		dCellEnd,
-		numParticles,
+		numSortedParticles,
+		numFluidParticles,
 		numGridCells);
 
+	copyPoiseuilleGhostMeasures(
+		dMeasures,
+		dGhostSource,
+		dRank,
+		numParticles,
+		numGhostParticles);
+
 	calculatePoiseuilleAcceleration(
 		dAcceleration,
 		dMeasures,		
@@ -253,20 +326,139 @@ void PoiseuilleFlowSystem::update(){
 		dIndex,
 		dCellStart,
 		dCellEnd,
-		numParticles,
+		numSortedParticles,
+		numFluidParticles,
 		numGridCells);    
 
-	integratePoiseuilleSystem(
-		dPos,
-		dVel,	
-		dVelLeapFrog,
-		dAcceleration,
-		numParticles);
+	if (params.openBoundaries) {
+		uint numDeleted;
+		uint numInserted = integrateOpenPoiseuilleSystem(
+			dPos,
+			dVel,
+			dVelLeapFrog,
+			dAcceleration,
+			dOpenCounts,
+			numFluidParticles,
+			numParticles,
+			maxInsertParticles,
+			&numDeleted);
+		if (numInserted + numDeleted > 0)
+			numParticles = compactPoiseuilleParticles(
+				dPos,
+				dVel,
+				dVelLeapFrog,
+				numParticles + numInserted,
+				&numFluidParticles);
+	} else
+		integratePoiseuilleSystem(
+			dPos,
+			dVel,	
+			dVelLeapFrog,
+			dAcceleration,
+			numFluidParticles);
 	
 	if (IsOpenGL) {
 		unmapGLBufferObject(cuda_posvbo_resource);
 	}
 	elapsedTime+= params.deltaTime;
+	stepCount++;
+	if (checkInterval > 0 && stepCount % checkInterval == 0)
+		checkConvergence();
+}
+
+void PoiseuilleFlowSystem::setOpenBoundaries(bool enable){
+	assert(!enable || !IsOpenGL);
+	params.openBoundaries = enable;
+	setParameters(&params);
+	//the inlet buffer holds ghostCells columns, each particle leaves it at most once per step
+	maxInsertParticles = enable ?
+		params.ghostCells * params.fluidParticlesSize.y * params.fluidParticlesSize.z : 0;
+}
+
+// host side of inflowVelocity() in the kernels
+float PoiseuilleFlowSystem::getInflowVelocity(float d) const {
+	float height = params.fluidParticlesSize.y * 2.0f * params.particleRadius;
+	d = std::min(std::max(d, 0.0f), height);
+	return params.gravity.x * params.restDensity / (2.0f * params.mu) * d * (height - d);
+}
+
+// grows particle and sorted arrays to rows, particle data is kept
+void PoiseuilleFlowSystem::reserve(uint rows){
+	assert(!IsOpenGL);
+	uint size = maxParticles * 4 * sizeof(float);
+	uint newSize = rows * 4 * sizeof(float);
+	growArray((void**)&cudaPosVBO, size, newSize);
+	growArray((void**)&dVel, size, newSize);
+	growArray((void**)&dVelLeapFrog, size, newSize);
+	growArray((void**)&dAcceleration, size, newSize);
+	growArray((void**)&dMeasures, size, newSize);
+	growArray((void**)&dSortedPos, size, newSize);
+	growArray((void**)&dSortedVel, size, newSize);
+	growArray((void**)&dHash, maxParticles * sizeof(uint), rows * sizeof(uint));
+	growArray((void**)&dIndex, maxParticles * sizeof(uint), rows * sizeof(uint));
+	growArray((void**)&dRank, maxParticles * sizeof(uint), rows * sizeof(uint));
+	maxParticles = rows;
+}
+
+void PoiseuilleFlowSystem::setConvergenceCheck(uint interval, float tolerance){
+	checkInterval = interval;
+	checkTolerance = tolerance;
+	numChecks = 0;
+	profileChange = -1.0f;
+	IsConverged = false;
+}
+
+void PoiseuilleFlowSystem::checkConvergence(){
+	uint numBins = getNumProfileBins();
+	std::swap(hProfile, hPrevProfile);
+	binPoiseuilleProfile(hProfile, dProfile, dSortedVel, dCellStart, dCellEnd, numBins);
+	if (numChecks++ == 0)
+		return;
+
+	double diff = 0.0, norm = 0.0;
+	for(uint i = 0; i < numBins; i++){
+		double d = hProfile[i] - hPrevProfile[i];
+		diff += d * d;
+		norm += (double)hProfile[i] * hProfile[i];
+	}
+	if (norm == 0.0)
+		return;//fluid at rest yet
+	profileChange = (float)sqrt(diff / norm);
+	IsConverged = profileChange < checkTolerance;
+}
+
+// fields are those of the last neighbour pass, one step behind the positions
+void PoiseuilleFlowSystem::sampleProbes(const float* probes, uint numProbes, float* velocity, float* measures){
+	assert(IsInitialized);
+	if (numProbes == 0)
+		return;
+	if (numProbes > maxProbes) {
+		if (maxProbes > 0) {
+			freeArray(dProbes);
+			freeArray(dProbeVelocity);
+			freeArray(dProbeMeasures);
+		}
+		allocateArray((void**)&dProbes, numProbes*4*sizeof(float));
+		allocateArray((void**)&dProbeVelocity, numProbes*4*sizeof(float));
+		allocateArray((void**)&dProbeMeasures, numProbes*4*sizeof(float));
+		maxProbes = numProbes;
+	}
+	copyArrayToDevice(dProbes, probes, 0, numProbes*4*sizeof(float));
+	samplePoiseuilleProbes(
+		velocity,
+		measures,
+		dProbeVelocity,
+		dProbeMeasures,
+		dProbes,
+		numProbes,
+		dSortedPos,
+		dSortedVel,
+		dMeasures,
+		dCellStart,
+		dCellEnd,
+		params.cellcount,
+		params.smoothingRadius,
+		params.particleMass);
 }
 
 void PoiseuilleFlowSystem::setArray(ParticleArray array, const float* data, int start, int count){
@@ -309,7 +501,13 @@ inline float frand(){
 }
 
 void PoiseuilleFlowSystem::reset(){
+	numFluidParticles = params.fluidParticlesSize.x * params.fluidParticlesSize.y * params.fluidParticlesSize.z;
+	numParticles = numFluidParticles + numWallParticles;
 	elapsedTime = 0.0f;
+	stepCount = 0;
+	numChecks = 0;
+	profileChange = -1.0f;
+	IsConverged = false;
 	float jitter = params.particleRadius * 0.01f;			            
 	float spacing = params.particleRadius * 2.0f;
 	initFluid(spacing, jitter, numParticles);
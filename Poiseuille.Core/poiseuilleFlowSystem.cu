@@ -6,6 +6,8 @@
 #include "thrust/for_each.h"
 #include "thrust/iterator/zip_iterator.h"
 #include "thrust/sort.h"
+#include "thrust/remove.h"
+#include "thrust/partition.h"
 
 #include <cuda_gl_interop.h>
 
@@ -81,6 +83,65 @@ extern "C"
 		checkCudaErrors(cudaMemcpy((char *) device + offset, host, size, cudaMemcpyHostToDevice));
 	}
 
+	// keeps the first size bytes of the array
+	void growArray(void **devPtr, int size, int newSize)
+	{
+		void* newPtr;
+		checkCudaErrors(cudaMalloc(&newPtr, newSize));
+		checkCudaErrors(cudaMemcpy(newPtr, *devPtr, size, cudaMemcpyDeviceToDevice));
+		checkCudaErrors(cudaFree(*devPtr));
+		*devPtr = newPtr;
+	}
+
+	uint integrateOpenPoiseuilleSystem(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float* acc,
+		uint*  openCounts,
+		uint   numFluidParticles,
+		uint   numParticles,
+		uint   maxInsertParticles,
+		uint*  numDeleted){
+			uint numThreads, numBlocks;
+			computeGridSize(numFluidParticles, 256, numBlocks, numThreads);
+
+			checkCudaErrors(cudaMemset(openCounts, 0, 2*sizeof(uint)));
+			integrateOpenPoiseuilleD<<< numBlocks, numThreads >>>(
+				(float4*)pos,
+				(float4*)vel,
+				(float4*)velLeapFrog,
+				(float4*)acc,
+				openCounts,
+				numFluidParticles,
+				numParticles,
+				maxInsertParticles);
+
+			uint counts[2];
+			checkCudaErrors(cudaMemcpy(counts, openCounts, 2*sizeof(uint), cudaMemcpyDeviceToHost));
+			*numDeleted = counts[1];
+			return min(counts[0], maxInsertParticles);
+	}
+
+	uint compactPoiseuilleParticles(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		uint   numParticles,
+		uint*  numFluidParticles){
+			thrust::device_ptr<float4> p((float4*)pos);
+			thrust::device_ptr<float4> v((float4*)vel);
+			thrust::device_ptr<float4> l((float4*)velLeapFrog);
+			typedef thrust::zip_iterator<thrust::tuple<
+				thrust::device_ptr<float4>, thrust::device_ptr<float4>, thrust::device_ptr<float4> > > Particles;
+			Particles begin = thrust::make_zip_iterator(thrust::make_tuple(p, v, l));
+			Particles end = thrust::remove_if(begin, begin + numParticles, isDeletedParticle());
+			//inserted particles came after the walls, stable so that walls keep their order
+			Particles walls = thrust::stable_partition(begin, end, isFluidParticle());
+			*numFluidParticles = walls - begin;
+			return end - begin;
+	}
+
 	void integratePoiseuilleSystem(
 		float *pos,
 		float *vel,  
@@ -107,10 +168,37 @@ extern "C"
 							thrust::device_ptr<uint>(dIndex));
 	}
 
+	uint refreshPoiseuilleGhosts(
+		float* pos,
+		float* vel,
+		uint*  ghostSource,
+		uint*  ghostCount,
+		uint   numParticles,
+		uint   maxGhostParticles,
+		uint*  numDropped){
+			uint numThreads, numBlocks;
+			computeGridSize(numParticles, 256, numBlocks, numThreads);
+
+			checkCudaErrors(cudaMemset(ghostCount, 0, sizeof(uint)));
+			refreshPoiseuilleGhostsD<<< numBlocks, numThreads >>>(
+				(float4 *) pos,
+				(float4 *) vel,
+				ghostSource,
+				ghostCount,
+				numParticles,
+				maxGhostParticles);
+
+			uint numGhostParticles;
+			checkCudaErrors(cudaMemcpy(&numGhostParticles, ghostCount, sizeof(uint), cudaMemcpyDeviceToHost));
+			*numDropped = numGhostParticles - min(numGhostParticles, maxGhostParticles);
+			return min(numGhostParticles, maxGhostParticles);
+	}
+
 	void calculatePoiseuilleHash(
 		uint* gridParticleHash,
 		uint* gridParticleIndex,
 		float* pos, 
+		uint numRealParticles,
 		int numParticles){
 			uint numThreads, numBlocks;
 			computeGridSize(numParticles, 256, numBlocks, numThreads);
@@ -119,6 +207,7 @@ extern "C"
 				gridParticleHash,
 				gridParticleIndex,
 				(float4 *) pos,
+				numRealParticles,
 				numParticles);
 		    
 			//checkCudaErrors("Kernel execution failed: calculatePoiseuilleHashD");
@@ -129,6 +218,7 @@ extern "C"
 		uint*  cellEnd,
 		float* sortedPos,
 		float* sortedVel,
+		uint*  gridParticleRank,
 		uint*  gridParticleHash,
 		uint*  gridParticleIndex,
 		float* oldPos,
@@ -151,6 +241,7 @@ extern "C"
 					cellEnd,
 					(float4 *) sortedPos,
 					(float4 *) sortedVel,
+					gridParticleRank,
 					gridParticleHash,
 					gridParticleIndex,
 					(float4 *) oldPos,
@@ -172,16 +263,17 @@ extern "C"
 		uint* cellStart,
 		uint* cellEnd,
 		uint numParticles,
+		uint numFluidParticles,
 		uint numGridCells){
 			#if USE_TEX
 			checkCudaErrors(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
 			checkCudaErrors(cudaBindTexture(0, oldVelTex, sortedVel, numParticles*sizeof(float4)));
-			checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, numGridCells*sizeof(uint)));
-			checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, numGridCells*sizeof(uint)));    
+			checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, 2*numGridCells*sizeof(uint)));
+			checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, 2*numGridCells*sizeof(uint)));    
 			#endif
 
 			uint numThreads, numBlocks;
-			computeGridSize(numParticles, 64, numBlocks, numThreads);
+			computeGridSize(numFluidParticles, 64, numBlocks, numThreads);
 
 			calculatePoiseuilleDensityD<<< numBlocks, numThreads >>>(										  
 				(float4*)measures,
@@ -190,7 +282,15 @@ extern "C"
 				gridParticleIndex,
 				cellStart,
 				cellEnd,
-				numParticles);
+				numFluidParticles);
+
+			uint numBoundaryParticles = numParticles - numFluidParticles;
+			if (numBoundaryParticles > 0) {
+				computeGridSize(numBoundaryParticles, 256, numBlocks, numThreads);
+				calculatePoiseuilleBoundaryDensityD<<< numBlocks, numThreads >>>(
+					(float4*)measures + numFluidParticles,
+					numBoundaryParticles);
+			}
 
 			//cutilCheckMsg("Kernel execution failed");
 			//checkCudaErrors("Kernel execution failed");
@@ -203,6 +303,25 @@ extern "C"
 			#endif
 	}
 
+	void copyPoiseuilleGhostMeasures(
+		float* measures,
+		uint*  ghostSource,
+		uint*  gridParticleRank,
+		uint   numRealParticles,
+		uint   numGhostParticles){
+			if (numGhostParticles == 0)
+				return;
+			uint numThreads, numBlocks;
+			computeGridSize(numGhostParticles, 256, numBlocks, numThreads);
+
+			copyPoiseuilleGhostMeasuresD<<< numBlocks, numThreads >>>(
+				(float4*)measures,
+				ghostSource,
+				gridParticleRank,
+				numRealParticles,
+				numGhostParticles);
+	}
+
 	void calculatePoiseuilleAcceleration(
 		float* acceleration,
 		float* sortedMeasures,			
@@ -212,17 +331,18 @@ extern "C"
 		uint* cellStart,
 		uint* cellEnd,
 		uint numParticles,
+		uint numFluidParticles,
 		uint numGridCells){
 			#if USE_TEX
 			checkCudaErrors(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
 			checkCudaErrors(cudaBindTexture(0, oldVelTex, sortedVel, numParticles*sizeof(float4)));
 			checkCudaErrors(cudaBindTexture(0, oldMeasuresTex, sortedMeasures, numParticles*sizeof(float4)));
-			checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, numGridCells*sizeof(uint)));
-			checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, numGridCells*sizeof(uint)));    
+			checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, 2*numGridCells*sizeof(uint)));
+			checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, 2*numGridCells*sizeof(uint)));    
 			#endif
 
 			uint numThreads, numBlocks;
-			computeGridSize(numParticles, 64, numBlocks, numThreads);
+			computeGridSize(numFluidParticles, 64, numBlocks, numThreads);
 
 			calculatePoiseuilleAccelerationD<<< numBlocks, numThreads >>>(
 				(float4*)acceleration,
@@ -232,7 +352,7 @@ extern "C"
 				gridParticleIndex,
 				cellStart,
 				cellEnd,
-				numParticles);
+				numFluidParticles);
 
 			//cutilCheckMsg("Kernel execution failed");
 			//checkCudaErrors("Kernel execution failed");
@@ -245,5 +365,62 @@ extern "C"
 			checkCudaErrors(cudaUnbindTexture(cellEndTex));
 			#endif
 	}
+
+	void binPoiseuilleProfile(
+		float* hostProfile,
+		float* profile,
+		float* sortedVel,
+		uint*  cellStart,
+		uint*  cellEnd,
+		uint   numBins){
+			uint numThreads, numBlocks;
+			computeGridSize(numBins, 64, numBlocks, numThreads);
+
+			binPoiseuilleProfileD<<< numBlocks, numThreads >>>(
+				profile,
+				(float4*)sortedVel,
+				cellStart,
+				cellEnd);
+
+			checkCudaErrors(cudaMemcpy(hostProfile, profile, numBins*sizeof(float), cudaMemcpyDeviceToHost));
+	}
+
+	void samplePoiseuilleProbes(
+		float* hostVelocity,
+		float* hostMeasures,
+		float* velocity,
+		float* measures,
+		float* probes,
+		uint   numProbes,
+		float* sortedPos,
+		float* sortedVel,
+		float* sortedMeasures,
+		uint*  cellStart,
+		uint*  cellEnd,
+		int    cellcount,
+		float  smoothingRadius,
+		float  particleMass){
+			uint numThreads, numBlocks;
+			computeGridSize(numProbes, 128, numBlocks, numThreads);
+
+			sph::sampleProbesD<PoiseuilleKernel><<< numBlocks, numThreads >>>(
+				(float4*)velocity,
+				(float4*)measures,
+				(float4*)probes,
+				numProbes,
+				(float4*)sortedPos,
+				(float4*)sortedVel,
+				(float4*)sortedMeasures,
+				cellStart,
+				cellEnd,
+				PoiseuilleProbeGrid(),
+				cellcount,
+				smoothingRadius,
+				particleMass);
+			//cutilCheckMsg("Kernel execution failed");
+
+			checkCudaErrors(cudaMemcpy(hostVelocity, velocity, numProbes*4*sizeof(float), cudaMemcpyDeviceToHost));
+			checkCudaErrors(cudaMemcpy(hostMeasures, measures, numProbes*4*sizeof(float), cudaMemcpyDeviceToHost));
+	}
 }// extern "C"
 
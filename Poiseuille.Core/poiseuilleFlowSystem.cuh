@@ -14,6 +14,30 @@ extern "C"
 
 	void setParameters(PoiseuilleParams *hostParams);	
 
+	void growArray(void **devPtr, int size, int newSize);
+
+	// open channel step, returns the number of particles inserted after
+	// numParticles; openCounts holds two device counters
+	uint integrateOpenPoiseuilleSystem(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		float* acc,
+		uint*  openCounts,
+		uint   numFluidParticles,
+		uint   numParticles,
+		uint   maxInsertParticles,
+		uint*  numDeleted);
+
+	// drops deleted particles and moves inserted fluid ahead of the walls,
+	// returns the new number of particles; sorted arrays are left untouched
+	uint compactPoiseuilleParticles(
+		float* pos,
+		float* vel,
+		float* velLeapFrog,
+		uint   numParticles,
+		uint*  numFluidParticles);
+
 	void integratePoiseuilleSystem(
 		float* pos,
 		float* vel,  
@@ -21,10 +45,23 @@ extern "C"
 		float* acc,
 		uint numParticles);
 
+	// wraps particles in x and appends ghost copies after numParticles,
+	// returns the number of ghosts, at most maxGhostParticles; images past
+	// the capacity are not written and counted in numDropped
+	uint refreshPoiseuilleGhosts(
+		float* pos,
+		float* vel,
+		uint*  ghostSource,
+		uint*  ghostCount,
+		uint   numParticles,
+		uint   maxGhostParticles,
+		uint*  numDropped);
+
 	void calculatePoiseuilleHash(
 		uint*  gridParticleHash,
 		uint*  gridParticleIndex,
 		float* pos, 
+		uint   numRealParticles,
 		int    numParticles);
 
 	void sortParticles(
@@ -37,6 +74,7 @@ extern "C"
 		uint*  cellEnd,
 		float* sortedPos,
 		float* sortedVel,
+		uint*  gridParticleRank,
 		uint*  gridParticleHash,
 		uint*  gridParticleIndex,
 		float* oldPos,
@@ -44,6 +82,8 @@ extern "C"
 		uint   numParticles,
 		uint   numCells);
 
+	// fluid particles occupy the head of the sorted list, cellStart/cellEnd
+	// hold 2 * numGridCells entries (fluid, then boundary ranges)
 	void calculatePoiseuilleDensity(			
 		float* measures,
 		float* sortedPos,
@@ -52,8 +92,16 @@ extern "C"
 		uint* cellStart,
 		uint* cellEnd,
 		uint numParticles,
+		uint numFluidParticles,
 		uint numGridCells);
 
+	void copyPoiseuilleGhostMeasures(
+		float* measures,
+		uint*  ghostSource,
+		uint*  gridParticleRank,
+		uint   numRealParticles,
+		uint   numGhostParticles);
+
 	void calculatePoiseuilleAcceleration(	
 		float* acceleration,			
 		float* measures,
@@ -63,6 +111,34 @@ extern "C"
 		uint* cellStart,
 		uint* cellEnd,
 		uint numParticles,
+		uint numFluidParticles,
 		uint numGridCells);
+
+	// mean fluid x velocity per grid row, copied to hostProfile
+	void binPoiseuilleProfile(
+		float* hostProfile,
+		float* profile,
+		float* sortedVel,
+		uint*  cellStart,
+		uint*  cellEnd,
+		uint   numBins);
+
+	// SPH averages at probe points from the sorted arrays, copied to
+	// hostVelocity/hostMeasures, see Common/sph_probes.h
+	void samplePoiseuilleProbes(
+		float* hostVelocity,
+		float* hostMeasures,
+		float* velocity,
+		float* measures,
+		float* probes,
+		uint   numProbes,
+		float* sortedPos,
+		float* sortedVel,
+		float* sortedMeasures,
+		uint*  cellStart,
+		uint*  cellEnd,
+		int    cellcount,
+		float  smoothingRadius,
+		float  particleMass);
 }//extern "C"
 #endif
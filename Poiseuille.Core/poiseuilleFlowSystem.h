@@ -25,6 +25,31 @@ public:
 
 	void update();
 	void reset();
+
+	// every interval steps the mean x velocity of each grid row is compared
+	// with the previous check, the run is converged once the relative L2
+	// change drops below tolerance; interval 0 switches the check off
+	void setConvergenceCheck(uint interval, float tolerance);
+	bool isConverged() const { return IsConverged; }
+	float getProfileChange() const { return profileChange; }
+	const float* getProfile() const { return hProfile; }
+	uint getNumProfileBins() const { return params.gridSize.y; }
+
+	// SPH averages at numProbes points (x, y, z, unused) from the sorted arrays
+	// of the last update(): velocity with the kernel coverage in w, density and
+	// pressure in measures x, y; host arrays of float4, see Common/sph_probes.h
+	void sampleProbes(const float* probes, uint numProbes, float* velocity, float* measures);
+
+	// open inlet/outlet buffer zones of ghostCells columns replace the periodic
+	// x wrap; the inlet imposes the steady profile of the body force, the
+	// particle count changes every step. Call before reset(), no OpenGL.
+	void setOpenBoundaries(bool enable);
+	bool isOpenBoundaries() const { return params.openBoundaries != 0; }
+	// steady x velocity of the body force at distance d from the bottom wall,
+	// the profile the inlet imposes
+	float getInflowVelocity(float d) const;
+	uint getNumFluidParticles() const { return numFluidParticles; }
+	uint getNumDroppedGhosts() const { return numDroppedGhosts; }
 	
 	void   setArray(ParticleArray array, const float* data, int start, int count);
 
@@ -62,12 +87,29 @@ protected: // methods
 
 	void initFluid( float spacing, float jitter, uint numParticles);
 	void initBoundaryParticles(float spacing);
+	void checkConvergence();
+	void reserve(uint rows);
 
 protected: // data
 	bool IsInitialized, IsOpenGL;
+	bool IsConverged;
 	uint numParticles;
+	uint numFluidParticles;   // fluid particles come first in particle and sorted arrays
+	uint numGhostParticles;   // periodic images, stored after the real particles
+	uint maxGhostParticles;
+	uint numDroppedGhosts;    // images past maxGhostParticles in the last step, missing from the neighbour search
+	uint numWallParticles;
+	uint maxParticles;        // rows of particle and sorted arrays, real particles then ghosts or inserted ones
+	uint maxInsertParticles;  // inlet buffer particles, open boundaries only
 	//uint3 fluidParticlesSize;	
 	float elapsedTime;
+	uint stepCount;
+
+	// convergence monitor
+	uint checkInterval;
+	float checkTolerance;
+	uint numChecks;
+	float profileChange;      // relative L2 change at the last check, negative before the second one
 
 	// CPU data
 	float* hPos;              // particle positions
@@ -76,6 +118,8 @@ protected: // data
 	
 	float* hMeasures;
 	float* hAcceleration;	        
+	float* hProfile;          // binned x velocity, last and previous check
+	float* hPrevProfile;
 
 	// GPU data
 	float* dPos;
@@ -87,12 +131,21 @@ protected: // data
 
 	float* dSortedPos;
 	float* dSortedVel;
+	float* dProfile;
+	float* dProbes;           // probe points and their samples, grown on demand
+	float* dProbeVelocity;
+	float* dProbeMeasures;
+	uint   maxProbes;
 
 	// grid data for sorting method
 	uint*  dHash; // grid hash value for each particle
 	uint*  dIndex;// particle index for each particle
 	uint*  dCellStart;        // index of start of each cell in sorted list
 	uint*  dCellEnd;          // index of end of cell
+	uint*  dRank;             // sorted position for each particle
+	uint*  dGhostSource;      // real particle for each ghost
+	uint*  dGhostCount;
+	uint*  dOpenCounts;       // inserted, deleted particles of the last open boundary step
 
 	uint   gridSortBits;
 
@@ -2,5 +2,7 @@
 
 int main() {
   dump();
-  return 0;
+  bool passed = dumpOpen();
+  cout << "open channel: " << (passed ? "passed" : "FAILED") << endl;
+  return passed ? 0 : 1;
 }
\ No newline at end of file